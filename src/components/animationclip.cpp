@@ -0,0 +1,445 @@
+#include "animationclip.h"
+#include <QtEndian>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+static const int LAST_TICK = 65535; // key times are 16 bit
+// Keys a refitted segment may span at most, which bounds the cost of the fit.
+static const int MAX_SEGMENT_KEYS = 32;
+// Points of every original segment the refit is held against, besides the keys.
+static const int SAMPLES_PER_SEGMENT = 4;
+static const float SQRT2 = 1.41421356f;
+
+// A point of the original curve, u along the refitted segment.
+struct Sample{
+    float u;
+    float value[4];
+};
+
+static inline void bernstein(float u, float *b)
+{
+    const float s = 1.0f - u;
+    b[0] = s * s * s;
+    b[1] = 3.0f * s * s * u;
+    b[2] = 3.0f * s * u * u;
+    b[3] = u * u * u;
+}
+
+static void evaluateBezier(const float *p0, const float *c1, const float *c2, const float *p1, int comps,
+                           float u, bool normalize, float *value)
+{
+    float w[4];
+    bernstein(u, w);
+    float len2 = 0.0f;
+    for (int c = 0; c < comps; ++c) {
+        value[c] = w[0] * p0[c] + w[1] * c1[c] + w[2] * c2[c] + w[3] * p1[c];
+        len2 += value[c] * value[c];
+    }
+    if (normalize) {
+        const float inv = 1.0f / std::sqrt(qMax(len2, 1e-12f));
+        for (int c = 0; c < comps; ++c)
+            value[c] *= inv;
+    }
+}
+
+static void lineControls(const float *p0, const float *p1, int comps, float *c1, float *c2)
+{
+    for (int c = 0; c < comps; ++c) {
+        c1[c] = p0[c] + (p1[c] - p0[c]) / 3.0f;
+        c2[c] = p0[c] + 2.0f * (p1[c] - p0[c]) / 3.0f;
+    }
+}
+
+// Inner control points of the Bezier from p0 to p1 that come closest to the
+// samples, in the least squares sense. False if a sample is further off than
+// maxError, after normalization for quaternions.
+static bool fitSegment(const std::vector<Sample> &samples, const float *p0, const float *p1, int comps,
+                       bool normalize, float maxError, float *c1, float *c2)
+{
+    double a11 = 0, a12 = 0, a22 = 0;
+    double r1[4] = {}, r2[4] = {};
+    for (const Sample &s : samples) {
+        float w[4];
+        bernstein(s.u, w);
+        a11 += w[1] * w[1];
+        a12 += w[1] * w[2];
+        a22 += w[2] * w[2];
+        for (int c = 0; c < comps; ++c) {
+            const double r = s.value[c] - w[0] * p0[c] - w[3] * p1[c];
+            r1[c] += w[1] * r;
+            r2[c] += w[2] * r;
+        }
+    }
+    const double det = a11 * a22 - a12 * a12;
+    if (det <= 1e-12)
+        return false;
+    for (int c = 0; c < comps; ++c) {
+        c1[c] = float((a22 * r1[c] - a12 * r2[c]) / det);
+        c2[c] = float((a11 * r2[c] - a12 * r1[c]) / det);
+    }
+
+    for (const Sample &s : samples) {
+        float v[4];
+        evaluateBezier(p0, c1, c2, p1, comps, s.u, normalize, v);
+        for (int c = 0; c < comps; ++c) {
+            if (std::abs(v[c] - s.value[c]) > maxError)
+                return false;
+        }
+    }
+    return true;
+}
+
+static int largestComponent(const float *q)
+{
+    int largest = 0;
+    for (int c = 1; c < 4; ++c) {
+        if (std::abs(q[c]) > std::abs(q[largest]))
+            largest = c;
+    }
+    return largest;
+}
+
+// The largest component is left out and restored from the unit length, which
+// bounds the others to +-1/sqrt(2). 15 bits each, the index of the largest in
+// the top bits of the first two. Comes back as -q if the largest is negative.
+static void encodeRotation(const float *q, quint16 *out)
+{
+    const int largest = largestComponent(q);
+    const float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+    int j = 0;
+    for (int c = 0; c < 4; ++c) {
+        if (c == largest)
+            continue;
+        const float v = qBound(0.0f, (sign * q[c] * SQRT2 + 1.0f) * 0.5f, 1.0f);
+        out[j++] = quint16(std::lround(v * 32767.0f));
+    }
+    out[0] |= quint16((largest & 1) << 15);
+    out[1] |= quint16((largest >> 1) << 15);
+}
+
+static void decodeRotation(const quint16 *in, float *q)
+{
+    const int largest = (in[0] >> 15) | ((in[1] >> 15) << 1);
+    float len2 = 0.0f;
+    int j = 0;
+    for (int c = 0; c < 4; ++c) {
+        if (c == largest)
+            continue;
+        q[c] = ((in[j++] & 0x7fff) / 32767.0f * 2.0f - 1.0f) / SQRT2;
+        len2 += q[c] * q[c];
+    }
+    q[largest] = std::sqrt(qMax(0.0f, 1.0f - len2));
+}
+
+static void appendQuantized(std::vector<quint8> *values, quint16 q, int bits)
+{
+    if (bits == 8) {
+        values->push_back(quint8(q));
+    } else {
+        values->push_back(quint8(q & 0xff));
+        values->push_back(quint8(q >> 8));
+    }
+}
+
+AnimationClip::AnimationClip(Animator::Channel channel)
+    : channel(channel),
+      comps(Animator::componentCount(channel))
+{
+}
+
+void AnimationClip::clear()
+{
+    headers.clear();
+    times.clear();
+    values.clear();
+    ranges.clear();
+}
+
+quint64 AnimationClip::byteSize() const
+{
+    return headers.size() * sizeof(TrackHeader) + times.size() * sizeof(quint16) + values.size()
+           + ranges.size() * sizeof(float);
+}
+
+int AnimationClip::keyBytes(const TrackHeader &h) const
+{
+    return channel == Animator::Rotation ? 3 * int(sizeof(quint16)) : comps * h.bits / 8;
+}
+
+int AnimationClip::controlBytes(const TrackHeader &h) const
+{
+    return 2 * comps * h.bits / 8;
+}
+
+int AnimationClip::addTrack(const QVector<Animator::Key> &keys, float errorBound)
+{
+    Q_ASSERT(!keys.isEmpty());
+    const bool normalize = channel == Animator::Rotation;
+    QVector<Animator::Key> k = keys;
+    if (normalize)
+        Animator::alignRotations(&k);
+
+    // Every key with the inner control points of the segment that follows it.
+    struct Point{
+        float time;
+        float value[4];
+        float c1[4];
+        float c2[4];
+    };
+    std::vector<Point> points;
+    for (int i = 0; i < k.size(); ++i) {
+        Point p = {};
+        p.time = k[i].time;
+        memcpy(p.value, k[i].value, sizeof(p.value));
+        if (i + 1 < k.size()) {
+            float controls[16];
+            Animator::segmentControls(k[i], k[i + 1], comps, controls);
+            memcpy(p.c1, controls + comps, comps * sizeof(float));
+            memcpy(p.c2, controls + 2 * comps, comps * sizeof(float));
+        }
+        points.push_back(p);
+        if (i + 1 < k.size() && k[i].interpolation == Animator::Step) {
+            // held until the next key, then a segment of no length to its value
+            Point hold = p;
+            hold.time = k[i + 1].time;
+            lineControls(p.value, k[i + 1].value, comps, hold.c1, hold.c2);
+            points.push_back(hold);
+        }
+    }
+    // the uncompressed track holds its first key then
+    if (points.back().time <= points.front().time)
+        points.resize(1);
+
+    // The original curve at the inner points of every segment and at its end,
+    // sampled once for all the refits that span the segment.
+    struct CurvePoint{
+        float time;
+        float value[4];
+    };
+    std::vector<CurvePoint> curve;
+    for (size_t j = 0; j + 1 < points.size(); ++j) {
+        const Point &p = points[j];
+        const Point &q = points[j + 1];
+        for (int m = 1; m <= SAMPLES_PER_SEGMENT + 1; ++m) {
+            const float u = float(m) / (SAMPLES_PER_SEGMENT + 1);
+            CurvePoint cp;
+            cp.time = p.time + u * (q.time - p.time);
+            if (m == SAMPLES_PER_SEGMENT + 1)
+                memcpy(cp.value, q.value, sizeof(cp.value));
+            else
+                evaluateBezier(p.value, p.c1, p.c2, q.value, comps, u, normalize, cp.value);
+            curve.push_back(cp);
+        }
+    }
+
+    // Refit of the keys from a to next into c1 and c2.
+    std::vector<Sample> samples;
+    auto refit = [&](int a, int next, float *c1, float *c2) {
+        const float span = points[next].time - points[a].time;
+        if (span <= 0.0f)
+            return false;
+        if (normalize) {
+            // the decoder puts both ends in the same hemisphere
+            float dot = 0.0f;
+            for (int c = 0; c < 4; ++c)
+                dot += points[a].value[c] * points[next].value[c];
+            if (dot < 0.0f)
+                return false;
+        }
+        // the inner keys and the points in between, not the end
+        samples.clear();
+        const int first = a * (SAMPLES_PER_SEGMENT + 1);
+        const int last = next * (SAMPLES_PER_SEGMENT + 1) - 1;
+        for (int j = first; j < last; ++j) {
+            Sample s;
+            s.u = (curve[j].time - points[a].time) / span;
+            memcpy(s.value, curve[j].value, sizeof(s.value));
+            samples.push_back(s);
+        }
+        return fitSegment(samples, points[a].value, points[next].value, comps, normalize, errorBound * 0.5f, c1, c2);
+    };
+
+    // Greedy, every segment reaches as many keys as its refit allows. The
+    // reach doubles until a refit fails, then a binary search finds the end.
+    std::vector<int> kept(1, 0);
+    std::vector<float> controls;//c1 and c2 of every kept segment
+    const int lastPoint = int(points.size()) - 1;
+    for (int a = 0; a < lastPoint;) {
+        int b = a + 1;
+        float c1[4], c2[4];
+        memcpy(c1, points[a].c1, sizeof(c1));
+        memcpy(c2, points[a].c2, sizeof(c2));
+        const int limit = qMin(lastPoint, a + MAX_SEGMENT_KEYS);
+        int failed = limit + 1;
+        for (int reach = 2; b < limit; reach *= 2) {
+            const int next = qMin(a + reach, limit);
+            float fit1[4], fit2[4];
+            if (!refit(a, next, fit1, fit2)) {
+                failed = next;
+                break;
+            }
+            b = next;
+            memcpy(c1, fit1, sizeof(c1));
+            memcpy(c2, fit2, sizeof(c2));
+        }
+        while (failed - b > 1) {
+            const int next = (b + failed) / 2;
+            float fit1[4], fit2[4];
+            if (refit(a, next, fit1, fit2)) {
+                b = next;
+                memcpy(c1, fit1, sizeof(c1));
+                memcpy(c2, fit2, sizeof(c2));
+            } else {
+                failed = next;
+            }
+        }
+        // rotation controls follow the sign their first key is stored with
+        const float sign = normalize && points[a].value[largestComponent(points[a].value)] < 0.0f ? -1.0f : 1.0f;
+        for (int c = 0; c < comps; ++c)
+            controls.push_back(sign * c1[c]);
+        for (int c = 0; c < comps; ++c)
+            controls.push_back(sign * c2[c]);
+        kept.push_back(b);
+        a = b;
+    }
+
+    TrackHeader h;
+    h.firstKey = quint32(times.size());
+    h.firstByte = quint32(values.size());
+    Q_ASSERT(kept.size() <= size_t(LAST_TICK));
+    h.keyCount = quint16(kept.size());
+    h.startTime = points.front().time;
+    const float duration = points.back().time - h.startTime;
+    h.ticksPerSecond = duration > 0.0f ? LAST_TICK / duration : 0.0f;
+
+    // Quantization range of every component over everything stored at h.bits.
+    float lo[4], hi[4];
+    std::fill(lo, lo + 4, std::numeric_limits<float>::max());
+    std::fill(hi, hi + 4, std::numeric_limits<float>::lowest());
+    auto extend = [&](const float *v) {
+        for (int c = 0; c < comps; ++c) {
+            lo[c] = qMin(lo[c], v[c]);
+            hi[c] = qMax(hi[c], v[c]);
+        }
+    };
+    for (size_t i = 0; i < controls.size(); i += comps)
+        extend(controls.data() + i);
+    if (!normalize) {
+        for (int i : kept)
+            extend(points[i].value);
+    }
+    float extent = 0.0f;
+    for (int c = 0; c < comps; ++c) {
+        if (lo[c] > hi[c])
+            lo[c] = hi[c] = 0.0f;
+        extent = qMax(extent, hi[c] - lo[c]);
+    }
+    // rounding is off by half a step at most
+    h.bits = extent / 255.0f <= errorBound ? 8 : 16;
+    const float maxQ = h.bits == 8 ? 255.0f : 65535.0f;
+    const size_t firstRange = ranges.size();
+    for (int c = 0; c < comps; ++c) {
+        ranges.push_back(lo[c]);
+        ranges.push_back((hi[c] - lo[c]) / maxQ);
+    }
+    const float *range = ranges.data() + firstRange;
+    auto quantize = [&](const float *v) {
+        for (int c = 0; c < comps; ++c) {
+            const float step = range[2 * c + 1];
+            const float q = step > 0.0f ? qBound(0.0f, std::round((v[c] - range[2 * c]) / step), maxQ) : 0.0f;
+            appendQuantized(&values, quint16(q), h.bits);
+        }
+    };
+
+    int prevTick = -1;
+    for (int i : kept) {
+        // keys of the same time, from step keys, are a tick apart
+        const int tick = int(std::lround((points[i].time - h.startTime) * h.ticksPerSecond));
+        prevTick = qMin(qMax(tick, prevTick + 1), LAST_TICK);
+        times.push_back(quint16(prevTick));
+        if (normalize) {
+            quint16 q[3];
+            encodeRotation(points[i].value, q);
+            for (quint16 v : q)
+                appendQuantized(&values, v, 16);
+        } else {
+            quantize(points[i].value);
+        }
+    }
+    for (size_t i = 0; i < controls.size(); i += comps)
+        quantize(controls.data() + i);
+
+    headers.push_back(h);
+    return int(headers.size()) - 1;
+}
+
+void AnimationClip::decodeKey(const TrackHeader &h, const float *range, int key, float *value) const
+{
+    const quint8 *p = values.data() + h.firstByte + key * keyBytes(h);
+    if (channel == Animator::Rotation) {
+        const quint16 q[3] = { qFromLittleEndian<quint16>(p), qFromLittleEndian<quint16>(p + 2),
+                               qFromLittleEndian<quint16>(p + 4) };
+        decodeRotation(q, value);
+        return;
+    }
+    for (int c = 0; c < comps; ++c) {
+        const int q = h.bits == 8 ? p[c] : qFromLittleEndian<quint16>(p + 2 * c);
+        value[c] = range[2 * c] + q * range[2 * c + 1];
+    }
+}
+
+void AnimationClip::decodeControls(const TrackHeader &h, const float *range, int segment, float *c1, float *c2) const
+{
+    const quint8 *p = values.data() + h.firstByte + h.keyCount * keyBytes(h) + segment * controlBytes(h);
+    auto component = [&](int i) {
+        const int q = h.bits == 8 ? p[i] : qFromLittleEndian<quint16>(p + 2 * i);
+        return range[2 * (i % comps)] + q * range[2 * (i % comps) + 1];
+    };
+    for (int c = 0; c < comps; ++c) {
+        c1[c] = component(c);
+        c2[c] = component(comps + c);
+    }
+}
+
+float AnimationClip::segment(int track, float time, int *hint, float *controls) const
+{
+    const TrackHeader &h = headers[track];
+    const float *range = trackRange(track);
+    float *p0 = controls;
+    float *c1 = controls + comps;
+    float *c2 = controls + 2 * comps;
+    float *p1 = controls + 3 * comps;
+    if (h.keyCount < 2) {
+        decodeKey(h, range, 0, p0);
+        for (float *p : { c1, c2, p1 })
+            memcpy(p, p0, comps * sizeof(float));
+        return 0.0f;
+    }
+
+    // tick within the loop, as Animator wraps the time
+    const quint16 *t = times.data() + h.firstKey;
+    const float last = t[h.keyCount - 1];
+    const float tick = (time - h.startTime) * h.ticksPerSecond;
+    float loops = float(qint64(tick / last));
+    if (tick < loops * last)
+        loops -= 1.0f;
+    const float local = qBound(0.0f, tick - loops * last, last);
+
+    const int k = Animator::findSegment(t, h.keyCount, local, *hint);
+    *hint = k;
+    decodeKey(h, range, k, p0);
+    decodeKey(h, range, k + 1, p1);
+    decodeControls(h, range, k, c1, c2);
+    if (channel == Animator::Rotation) {
+        float dot = 0.0f;
+        for (int c = 0; c < 4; ++c)
+            dot += p0[c] * p1[c];
+        if (dot < 0.0f) {
+            for (int c = 0; c < 4; ++c)
+                p1[c] = -p1[c];
+        }
+    }
+    return t[k + 1] > t[k] ? qBound(0.0f, (local - t[k]) / float(t[k + 1] - t[k]), 1.0f) : 0.0f;
+}
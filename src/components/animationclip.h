@@ -0,0 +1,67 @@
+#ifndef ANIMATIONCLIP_H
+#define ANIMATIONCLIP_H
+
+#include "animator.h"
+#include <vector>
+
+/**
+ * @brief Compressed keyframe tracks of one channel. Runs of segments are
+ * refitted with a single cubic Bezier, its inner control points found by least
+ * squares, for as long as the curve stays within the error bound, which drops
+ * the keys in between. Key times become 16 bit fractions of the track, the
+ * values are quantized to 8 or 16 bits over the range of their track, whichever
+ * is the smallest to keep within the bound, and rotation keys keep their three
+ * smallest quaternion components only. Half of the bound goes to the fit, half
+ * to the quantization. Step keys get a second key at the time of the next one,
+ * so that the jump stays where it is.
+*/
+class AnimationClip
+{
+public:
+    explicit AnimationClip(Animator::Channel channel);
+
+    /**
+     * @brief compress keys as for Animator::setTrack()
+     * @param errorBound in units for translation and scale, in quaternion
+     * components for rotations, about half the angle in radians
+     * @return index of the track in the clip
+    */
+    int addTrack(const QVector<Animator::Key> &keys, float errorBound);
+    int trackCount() const {return int(headers.size());}
+    int keyCount() const {return int(times.size());}
+    quint64 byteSize() const;
+    void clear();
+
+    /**
+     * @brief decode the segment of a track holding time into its four
+     * control points, p0, c1, c2 and p1, componentCount() floats each
+     * @param hint segment found last time, updated
+     * @return where time lies in the segment, 0 to 1
+    */
+    float segment(int track, float time, int *hint, float *controls) const;
+
+private:
+    struct TrackHeader{
+        quint32 firstKey;//into times
+        quint32 firstByte;//into values, the keys followed by the inner control points of the segments
+        quint16 keyCount;
+        quint16 bits;//of a quantized component, 8 or 16
+        float startTime;
+        float ticksPerSecond;//key times are in ticks from startTime
+    };
+
+    int keyBytes(const TrackHeader &h) const;
+    int controlBytes(const TrackHeader &h) const;
+    const float *trackRange(int track) const {return ranges.data() + track * 2 * comps;}
+    void decodeKey(const TrackHeader &h, const float *range, int key, float *value) const;
+    void decodeControls(const TrackHeader &h, const float *range, int segment, float *c1, float *c2) const;
+
+    Animator::Channel channel;
+    int comps;
+    std::vector<TrackHeader> headers;
+    std::vector<quint16> times;//tick of every key
+    std::vector<quint8> values;
+    std::vector<float> ranges;//min and step of every component of every track
+};
+
+#endif // ANIMATIONCLIP_H
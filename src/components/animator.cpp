@@ -0,0 +1,508 @@
+#include "animator.h"
+#include "animationclip.h"
+#include <QtConcurrentMap>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ANIM_X86
+#include <immintrin.h>
+#endif
+
+// The same split as in CpuCuller: SSE is part of x86-64, AVX2 is compiled in
+// separately and picked at runtime.
+#if defined(ANIM_X86) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define ANIM_SSE
+#endif
+#if defined(ANIM_X86) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define ANIM_AVX2
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// Instances per parallel job.
+static const int CHUNK_SIZE = 4096;
+// Instances whose segments are looked up before they are interpolated, small
+// enough for the lookup results to stay in L1.
+static const int BLOCK_SIZE = 256;
+
+static const float DEFAULT_VALUES[Animator::ChannelCount][4] = {
+    { 0, 0, 0, 0 }, // translation
+    { 0, 0, 0, 1 }, // rotation
+    { 1, 1, 1, 0 }, // scale
+};
+
+// Time t wrapped into the span of the keys, without the fmod() call that
+// would otherwise cost more than the rest of the lookup.
+static float loopTime(const float *times, int count, float invDuration, float t)
+{
+    const float duration = times[count - 1] - times[0];
+    const float local = t - times[0];
+    float loops = float(qint64(local * invDuration));
+    if (local < loops * duration)
+        loops -= 1.0f;
+    return qBound(times[0], times[0] + local - loops * duration, times[count - 1]);
+}
+
+// value = s^3 p0 + 3 s^2 u c1 + 3 s u^2 c2 + u^3 p1, s = 1 - u, for every
+// component, followed by a normalization for quaternions.
+static void interpolateScalar(const float *controls, int comps, const qint32 *segments, const float *us,
+                              int count, float *dst, int stride, bool normalize)
+{
+    for (int i = 0; i < count; ++i) {
+        const float u = us[i];
+        const float s = 1.0f - u;
+        const float b0 = s * s * s, b1 = 3.0f * s * s * u, b2 = 3.0f * s * u * u, b3 = u * u * u;
+        const float *p = controls + segments[i] * 4 * comps;
+        float *d = dst + i * stride;
+        float len2 = 0.0f;
+        for (int c = 0; c < comps; ++c) {
+            d[c] = b0 * p[c] + b1 * p[comps + c] + b2 * p[2 * comps + c] + b3 * p[3 * comps + c];
+            len2 += d[c] * d[c];
+        }
+        if (normalize) {
+            const float inv = 1.0f / std::sqrt(qMax(len2, 1e-12f));
+            for (int c = 0; c < comps; ++c)
+                d[c] *= inv;
+        }
+    }
+}
+
+#ifdef ANIM_SSE
+static inline __m128 gatherSse(const float *p, const int *offsets)
+{
+    return _mm_setr_ps(p[offsets[0]], p[offsets[1]], p[offsets[2]], p[offsets[3]]);
+}
+
+static void interpolateSse(const float *controls, int comps, const qint32 *segments, const float *us,
+                           int count, float *dst, int stride, bool normalize)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 u = _mm_loadu_ps(us + i);
+        const __m128 s = _mm_sub_ps(one, u);
+        const __m128 b0 = _mm_mul_ps(_mm_mul_ps(s, s), s);
+        const __m128 b1 = _mm_mul_ps(_mm_mul_ps(three, _mm_mul_ps(s, s)), u);
+        const __m128 b2 = _mm_mul_ps(_mm_mul_ps(three, s), _mm_mul_ps(u, u));
+        const __m128 b3 = _mm_mul_ps(_mm_mul_ps(u, u), u);
+        int base[4];
+        for (int k = 0; k < 4; ++k)
+            base[k] = segments[i + k] * 4 * comps;
+
+        __m128 v[4];
+        __m128 len2 = _mm_setzero_ps();
+        for (int c = 0; c < comps; ++c) {
+            const float *p = controls + c;
+            v[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b0, gatherSse(p, base)), _mm_mul_ps(b1, gatherSse(p + comps, base))),
+                              _mm_add_ps(_mm_mul_ps(b2, gatherSse(p + 2 * comps, base)),
+                                         _mm_mul_ps(b3, gatherSse(p + 3 * comps, base))));
+            len2 = _mm_add_ps(len2, _mm_mul_ps(v[c], v[c]));
+        }
+        if (normalize) {
+            const __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(len2, epsilon)));
+            for (int c = 0; c < comps; ++c)
+                v[c] = _mm_mul_ps(v[c], inv);
+        }
+
+        float out[4][4];
+        for (int c = 0; c < comps; ++c)
+            _mm_storeu_ps(out[c], v[c]);
+        for (int k = 0; k < 4; ++k) {
+            float *d = dst + (i + k) * stride;
+            for (int c = 0; c < comps; ++c)
+                d[c] = out[c][k];
+        }
+    }
+    interpolateScalar(controls, comps, segments + i, us + i, count - i, dst + i * stride, stride, normalize);
+}
+#endif
+
+#ifdef ANIM_AVX2
+TARGET_AVX2 static void interpolateAvx2(const float *controls, int comps, const qint32 *segments, const float *us,
+                                        int count, float *dst, int stride, bool normalize)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 epsilon = _mm256_set1_ps(1e-12f);
+    const __m256i segmentFloats = _mm256_set1_epi32(4 * comps);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 u = _mm256_loadu_ps(us + i);
+        const __m256 s = _mm256_sub_ps(one, u);
+        const __m256 b0 = _mm256_mul_ps(_mm256_mul_ps(s, s), s);
+        const __m256 b1 = _mm256_mul_ps(_mm256_mul_ps(three, _mm256_mul_ps(s, s)), u);
+        const __m256 b2 = _mm256_mul_ps(_mm256_mul_ps(three, s), _mm256_mul_ps(u, u));
+        const __m256 b3 = _mm256_mul_ps(_mm256_mul_ps(u, u), u);
+        const __m256i base = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(segments + i)),
+                                                segmentFloats);
+
+        __m256 v[4];
+        __m256 len2 = _mm256_setzero_ps();
+        for (int c = 0; c < comps; ++c) {
+            const float *p = controls + c;
+            v[c] = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(b0, _mm256_i32gather_ps(p, base, 4)),
+                              _mm256_mul_ps(b1, _mm256_i32gather_ps(p + comps, base, 4))),
+                _mm256_add_ps(_mm256_mul_ps(b2, _mm256_i32gather_ps(p + 2 * comps, base, 4)),
+                              _mm256_mul_ps(b3, _mm256_i32gather_ps(p + 3 * comps, base, 4))));
+            len2 = _mm256_add_ps(len2, _mm256_mul_ps(v[c], v[c]));
+        }
+        if (normalize) {
+            const __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_max_ps(len2, epsilon)));
+            for (int c = 0; c < comps; ++c)
+                v[c] = _mm256_mul_ps(v[c], inv);
+        }
+
+        float out[4][8];
+        for (int c = 0; c < comps; ++c)
+            _mm256_storeu_ps(out[c], v[c]);
+        for (int k = 0; k < 8; ++k) {
+            float *d = dst + (i + k) * stride;
+            for (int c = 0; c < comps; ++c)
+                d[c] = out[c][k];
+        }
+    }
+    interpolateScalar(controls, comps, segments + i, us + i, count - i, dst + i * stride, stride, normalize);
+}
+#endif
+
+Animator::Animator()
+    : isa(CpuCuller::bestIsa())
+{
+    clear();
+}
+
+Animator::~Animator() {}
+
+void Animator::resize(int count)
+{
+    for (std::vector<Track> &t : tracks)
+        t.resize(count);
+}
+
+void Animator::clear()
+{
+    for (int channel = 0; channel < ChannelCount; ++channel) {
+        tracks[channel].clear();
+        ChannelData &data = channels[channel];
+        data.times.clear();
+        data.controls.clear();
+        // segment 0 holds the default for instances without a track
+        for (int j = 0; j < 4; ++j)
+            data.controls.insert(data.controls.end(), DEFAULT_VALUES[channel],
+                                 DEFAULT_VALUES[channel] + componentCount(Channel(channel)));
+        if (clips[channel])
+            clips[channel]->clear();
+    }
+}
+
+void Animator::setCompression(float errorBound)
+{
+    const int count = size();
+    for (int channel = 0; channel < ChannelCount; ++channel)
+        clips[channel].reset(errorBound > 0.0f ? new AnimationClip(Channel(channel)) : nullptr);
+    compressionError = errorBound;
+    clear();
+    resize(count);
+}
+
+quint64 Animator::byteSize(Channel channel) const
+{
+    const quint64 trackBytes = tracks[channel].size() * sizeof(Track);
+    if (clips[channel])
+        return trackBytes + clips[channel]->byteSize();
+    return trackBytes + (channels[channel].times.size() + channels[channel].controls.size()) * sizeof(float);
+}
+
+// The keys of a replaced track stay in the channel until clear().
+void Animator::setTrack(int instance, Channel channel, const QVector<Key> &keys)
+{
+    Track &track = tracks[channel][instance];
+    track = Track();
+    if (keys.isEmpty())
+        return;
+    if (clips[channel]) {
+        track.keyCount = int(keys.size());
+        track.clipTrack = clips[channel]->addTrack(keys, compressionError);
+        return;
+    }
+
+    ChannelData &data = channels[channel];
+    const int comps = componentCount(channel);
+    track.firstKey = int(data.times.size());
+    track.keyCount = int(keys.size());
+    track.firstSegment = int(data.controls.size()) / (4 * comps);
+    for (const Key &key : keys)
+        data.times.push_back(key.time);
+    const float duration = keys.last().time - keys.first().time;
+    track.invDuration = duration > 0.0f ? 1.0f / duration : 0.0f;
+
+    QVector<Key> k = keys;
+    if (channel == Rotation)
+        alignRotations(&k);
+
+    // A single key is a segment from the key to itself.
+    const int segmentCount = qMax(1, int(k.size()) - 1);
+    for (int s = 0; s < segmentCount; ++s) {
+        float p[16];
+        segmentControls(k[s], k[qMin(s + 1, int(k.size()) - 1)], comps, p);
+        data.controls.insert(data.controls.end(), p, p + 4 * comps);
+    }
+}
+
+// q and -q are the same rotation, interpolating towards the one in the same
+// hemisphere as the previous key takes the short way round.
+void Animator::alignRotations(QVector<Key> *keys)
+{
+    for (int i = 1; i < keys->size(); ++i) {
+        Key &key = (*keys)[i];
+        const Key &prev = keys->at(i - 1);
+        float dot = 0.0f;
+        for (int c = 0; c < 4; ++c)
+            dot += key.value[c] * prev.value[c];
+        if (dot < 0.0f) {
+            for (int c = 0; c < 4; ++c) {
+                key.value[c] = -key.value[c];
+                key.inTangent[c] = -key.inTangent[c];
+                key.outTangent[c] = -key.outTangent[c];
+            }
+        }
+    }
+}
+
+void Animator::segmentControls(const Key &a, const Key &b, int comps, float *controls)
+{
+    const float dt = b.time - a.time;
+    float *p[4] = { controls, controls + comps, controls + 2 * comps, controls + 3 * comps };
+    for (int c = 0; c < comps; ++c) {
+        const float p0 = a.value[c];
+        const float p1 = b.value[c];
+        switch (a.interpolation) {
+        case Step:
+            p[0][c] = p[1][c] = p[2][c] = p[3][c] = p0;
+            break;
+        case Linear:
+            // evenly spaced control points make the Bezier a straight line at constant speed
+            p[0][c] = p0;
+            p[1][c] = p0 + (p1 - p0) / 3.0f;
+            p[2][c] = p0 + 2.0f * (p1 - p0) / 3.0f;
+            p[3][c] = p1;
+            break;
+        case Bezier:
+            p[0][c] = p0;
+            p[1][c] = p0 + a.outTangent[c] * dt / 3.0f;
+            p[2][c] = p1 - b.inTangent[c] * dt / 3.0f;
+            p[3][c] = p1;
+            break;
+        }
+    }
+}
+
+void Animator::evaluateRange(CpuCuller::Isa isa, Channel channel, float time, int begin, int end, float *dst, int stride)
+{
+    const ChannelData &data = channels[channel];
+    const int comps = componentCount(channel);
+    const bool normalize = channel == Rotation;
+    auto interpolate = interpolateScalar;
+    switch (isa) {
+#ifdef ANIM_AVX2
+    case CpuCuller::Avx2:
+        interpolate = interpolateAvx2;
+        break;
+#endif
+#ifdef ANIM_SSE
+    case CpuCuller::Sse:
+        interpolate = interpolateSse;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    // Compressed tracks have the segments of a block decoded into decoded,
+    // 16 KB for rotations, and interpolated from there.
+    const AnimationClip *clip = clips[channel].get();
+    float decoded[BLOCK_SIZE * 4 * 4];
+    qint32 segments[BLOCK_SIZE];
+    float us[BLOCK_SIZE];
+    for (int b = begin; b < end; b += BLOCK_SIZE) {
+        const int n = qMin(BLOCK_SIZE, end - b);
+        for (int i = 0; i < n; ++i) {
+            Track &track = tracks[channel][b + i];
+            if (clip) {
+                float *controls = decoded + i * 4 * comps;
+                segments[i] = i;
+                if (track.clipTrack < 0) {
+                    memcpy(controls, data.controls.data(), 4 * comps * sizeof(float));
+                    us[i] = 0.0f;
+                } else {
+                    us[i] = clip->segment(track.clipTrack, time, &track.hint, controls);
+                }
+                continue;
+            }
+            if (track.keyCount < 2) {
+                segments[i] = track.firstSegment;
+                us[i] = 0.0f;
+                continue;
+            }
+            const float *times = data.times.data() + track.firstKey;
+            const float t = loopTime(times, track.keyCount, track.invDuration, time);
+            const int s = findSegment(times, track.keyCount, t, track.hint);
+            track.hint = s;
+            segments[i] = track.firstSegment + s;
+            const float t0 = times[s];
+            const float t1 = times[s + 1];
+            us[i] = t1 > t0 ? qBound(0.0f, (t - t0) / (t1 - t0), 1.0f) : 0.0f;
+        }
+        interpolate(clip ? decoded : data.controls.data(), comps, segments, us, n, dst + b * stride, stride, normalize);
+    }
+}
+
+void Animator::evaluate(Channel channel, float time, float *dst, int stride)
+{
+    const int n = size();
+    const int chunkCount = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (chunkCount <= 1) {
+        evaluateRange(isa, channel, time, 0, n, dst, stride);
+        return;
+    }
+
+    // Every chunk updates the hints of its own tracks only.
+    QVector<int> chunks(chunkCount);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    QtConcurrent::blockingMap(chunks, [&](int &c) {
+        const int begin = c * CHUNK_SIZE;
+        evaluateRange(isa, channel, time, begin, qMin(n, begin + CHUNK_SIZE), dst, stride);
+    });
+}
+
+void Animator::benchmark(int count)
+{
+    const int keysPerTrack = 64;
+    const float errorBound = 0.001f;
+    static const char *const channelNames[ChannelCount] = { "translation", "rotation", "scale" };
+
+    // The same random tracks as they are and compressed.
+    Animator animator;
+    Animator compressed;
+    compressed.setCompression(errorBound);
+    animator.resize(count);
+    compressed.resize(count);
+    quint64 keyBytes[ChannelCount] = {};
+    qint64 compressNs = 0;
+    QElapsedTimer timer;
+    QRandomGenerator rng(1234);
+    auto gen = [&rng](float a, float b) {
+        return float(rng.bounded(double(b - a)) + a);
+    };
+    // Baked motion, a key every 1/30 s of some smooth movement, with the
+    // tangents of the movement, the way exported clips mostly come.
+    for (int i = 0; i < count; ++i) {
+        for (int channel = 0; channel < ChannelCount; ++channel) {
+            const float frequency = gen(0.2f, 1.0f);
+            float phase[4];
+            for (float &p : phase)
+                p = gen(0.0f, 6.283f);
+            // rotations about a fixed axis, swinging by up to 90 degrees
+            float axis[3] = { std::cos(phase[1]), std::sin(phase[1]), std::cos(phase[2]) };
+            const float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+            for (float &a : axis)
+                a /= axisLength;
+            QVector<Key> keys(keysPerTrack);
+            for (int j = 0; j < keysPerTrack; ++j) {
+                Key &key = keys[j];
+                key.time = j / 30.0f;
+                key.interpolation = Bezier;
+                const float omega = 6.283f * frequency;
+                const float w = omega * key.time;
+                if (channel == Rotation) {
+                    const float half = 0.785f * std::sin(w + phase[0]);
+                    const float halfRate = 0.785f * omega * std::cos(w + phase[0]);
+                    for (int c = 0; c < 3; ++c) {
+                        key.value[c] = axis[c] * std::sin(half);
+                        key.inTangent[c] = key.outTangent[c] = axis[c] * std::cos(half) * halfRate;
+                    }
+                    key.value[3] = std::cos(half);
+                    key.inTangent[3] = key.outTangent[3] = -std::sin(half) * halfRate;
+                } else {
+                    for (int c = 0; c < 3; ++c) {
+                        key.value[c] = (channel == Scale ? 1.0f : 0.0f) + 0.5f * std::sin(w + phase[c]);
+                        key.inTangent[c] = key.outTangent[c] = 0.5f * omega * std::cos(w + phase[c]);
+                    }
+                }
+            }
+            // time and value as floats
+            keyBytes[channel] += keys.size() * (1 + componentCount(Channel(channel))) * sizeof(float);
+            animator.setTrack(i, Channel(channel), keys);
+            timer.start();
+            compressed.setTrack(i, Channel(channel), keys);
+            compressNs += timer.nsecsElapsed();
+        }
+    }
+
+    // Time moves on by a 60 Hz frame per run, as it does when rendering.
+    std::vector<float> out(size_t(count) * 4);
+    const int runs = 60;
+    const double evaluations = double(count) * ChannelCount * runs;
+    auto measure = [&](Animator *a, CpuCuller::Isa isa, bool parallel) {
+        timer.start();
+        for (int r = 0; r < runs; ++r) {
+            for (int channel = 0; channel < ChannelCount; ++channel) {
+                if (parallel)
+                    a->evaluate(Channel(channel), r / 60.0f, out.data(), 4);
+                else
+                    a->evaluateRange(isa, Channel(channel), r / 60.0f, 0, count, out.data(), 4);
+            }
+        }
+        return evaluations / (timer.nsecsElapsed() / 1000000.0);
+    };
+    for (int i = CpuCuller::Scalar; i <= CpuCuller::bestIsa(); ++i) {
+        qDebug("Animation, %s, 1 thread: %d instances, %.0f track evaluations/ms",
+               CpuCuller::isaName(CpuCuller::Isa(i)), count, measure(&animator, CpuCuller::Isa(i), false));
+    }
+    qDebug("Animation, %s, parallel: %d instances, %.0f track evaluations/ms",
+           CpuCuller::isaName(animator.isa), count, measure(&animator, animator.isa, true));
+    qDebug("Compressed animation, %s, 1 thread: %d instances, %.0f track evaluations/ms",
+           CpuCuller::isaName(compressed.isa), count, measure(&compressed, compressed.isa, false));
+    qDebug("Compressed animation, %s, parallel: %d instances, %.0f track evaluations/ms",
+           CpuCuller::isaName(compressed.isa), count, measure(&compressed, compressed.isa, true));
+
+    std::vector<float> reference(out.size());
+    for (int channel = 0; channel < ChannelCount; ++channel) {
+        float maxError = 0.0f;
+        for (int r = 0; r < runs; ++r) {
+            animator.evaluate(Channel(channel), r / 7.0f, reference.data(), 4);
+            compressed.evaluate(Channel(channel), r / 7.0f, out.data(), 4);
+            for (size_t i = 0; i < out.size(); i += 4) {
+                // q and -q are the same rotation
+                float same = 0.0f;
+                float flipped = 0.0f;
+                for (int c = 0; c < componentCount(Channel(channel)); ++c) {
+                    same = qMax(same, std::abs(out[i + c] - reference[i + c]));
+                    flipped = qMax(flipped, std::abs(out[i + c] + reference[i + c]));
+                }
+                maxError = qMax(maxError, channel == Rotation ? qMin(same, flipped) : same);
+            }
+        }
+        const double mb = 1024.0 * 1024.0;
+        qDebug("Compressed %s: %.1f MB of keys, %.1f MB as segments, %.1f MB compressed, "
+               "%.1fx smaller than the keys, largest error %g",
+               channelNames[channel], keyBytes[channel] / mb, animator.byteSize(Channel(channel)) / mb,
+               compressed.byteSize(Channel(channel)) / mb,
+               double(keyBytes[channel]) / compressed.byteSize(Channel(channel)), maxError);
+    }
+    qDebug("Compressed %d tracks in %.0f ms", count * ChannelCount, compressNs / 1000000.0);
+}
@@ -0,0 +1,140 @@
+#ifndef ANIMATOR_H
+#define ANIMATOR_H
+
+#include "cpuculler.h"
+#include <QVector>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+class AnimationClip;
+
+/**
+ * @brief Keyframe tracks for translation, rotation and scale, one track per
+ * instance and channel. Every segment between two keys is stored as the four
+ * control points of a cubic Bezier, whatever its interpolation, so that all
+ * instances are evaluated by the same branchless kernel: the segment of every
+ * track is found first, starting from the one found the frame before, then 8
+ * (AVX2) or 4 (SSE) instances are interpolated per iteration and written to
+ * the destination, chunks of instances in parallel. With compression the
+ * tracks are kept as AnimationClip instead, which decodes the current segment
+ * of a block of tracks at a time into an L1 sized buffer for the kernel.
+*/
+class Animator
+{
+public:
+    enum Channel{Translation, Rotation, Scale, ChannelCount};
+    enum Interpolation{Step, Linear, Bezier};
+
+    struct Key{
+        float time=0;//seconds
+        float value[4]={};//x, y, z, and w for rotations
+        Interpolation interpolation=Linear;//of the segment to the next key
+        //Bezier only, slopes in units per second arriving at and leaving the key
+        float inTangent[4]={};
+        float outTangent[4]={};
+    };
+
+    Animator();
+    ~Animator();
+
+    //instances without a track of a channel keep its default, 0 for
+    //translation, the identity for rotation and 1 for scale
+    void resize(int count);
+    int size() const {return int(tracks[Translation].size());}
+    void clear();
+    /**
+     * @brief replace the track of an instance, the keys in ascending time,
+     * rotations as unit quaternions. Tracks loop from their first to their
+     * last key, a single key holds its value.
+    */
+    void setTrack(int instance, Channel channel, const QVector<Key> &keys);
+    /**
+     * @brief store the tracks set from now on in quantized, refitted clips,
+     * see AnimationClip. Clears the tracks set before.
+     * @param errorBound largest deviation from the keys, 0 keeps them as they are
+    */
+    void setCompression(float errorBound);
+    //bytes of track data of a channel
+    quint64 byteSize(Channel channel) const;
+
+    /**
+     * @brief evaluate the tracks of a channel at time and write the values,
+     * component c of instance i to dst[i * stride + c], stride in floats
+    */
+    void evaluate(Channel channel, float time, float *dst, int stride);
+
+    static int componentCount(Channel channel) {return channel==Rotation ? 4 : 3;}
+    template<typename T>
+    static int findSegment(const T *times, int count, float t, int hint);
+    static void alignRotations(QVector<Key> *keys);
+    //p0, c1, c2 and p1 of the Bezier from key a to key b, comps floats each
+    static void segmentControls(const Key &a, const Key &b, int comps, float *controls);
+    //animate random tracks with every instruction set and log track evaluations
+    //per millisecond, then the same for compressed tracks with their size
+    static void benchmark(int count);
+
+private:
+    struct Track{
+        int firstKey=0;//into ChannelData::times
+        int keyCount=0;
+        int firstSegment=0;//into ChannelData::controls, 0 is the default value
+        int hint=0;//segment found last time, relative to firstSegment
+        float invDuration=0;//1 / (last key time - first key time), 0 if they are the same
+        int clipTrack=-1;//with compression, the track in the channel's clip
+    };
+    struct ChannelData{
+        std::vector<float> times;
+        std::vector<float> controls;//p0, c1, c2, p1 of every segment, componentCount() floats each
+    };
+
+    void evaluateRange(CpuCuller::Isa isa, Channel channel, float time, int begin, int end, float *dst, int stride);
+
+    std::vector<Track> tracks[ChannelCount];
+    ChannelData channels[ChannelCount];
+    std::unique_ptr<AnimationClip> clips[ChannelCount];//with compression only
+    float compressionError=0;
+    CpuCuller::Isa isa;
+};
+
+// Index of the segment [times[s], times[s + 1]) holding t, count >= 2. From one
+// frame to the next playback mostly stays in the segment found before or moves
+// on to the next one, so the search starts at hint and gallops outwards,
+// which takes a compare or two then and O(log n) for any jump.
+template<typename T>
+int Animator::findSegment(const T *times, int count, float t, int hint)
+{
+    const int last = count - 2;
+    hint = qBound(0, hint, last);
+    int lo;
+    int hi;
+    if (t >= times[hint]) {
+        if (hint == last || t < times[hint + 1])
+            return hint;
+        lo = hint + 1;
+        if (lo == last)
+            return last;
+        int step = 1;
+        hi = lo + 1;
+        while (hi < count - 1 && times[hi] <= t) {
+            lo = hi;
+            step *= 2;
+            hi = qMin(lo + step, count - 1);
+        }
+    } else {
+        if (hint == 0)
+            return 0;
+        hi = hint;
+        int step = 1;
+        lo = hi - 1;
+        while (lo > 0 && times[lo] > t) {
+            hi = lo;
+            step *= 2;
+            lo = qMax(hi - step, 0);
+        }
+    }
+    // times[lo] <= t, and t < times[hi] unless hi is the last key
+    return int(std::upper_bound(times + lo + 1, times + hi, t) - times) - 1;
+}
+
+#endif // ANIMATOR_H
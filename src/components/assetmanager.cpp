@@ -0,0 +1,46 @@
+#include "assetmanager.h"
+
+// Loads are mostly waiting for the disk, more threads than that only make
+// them compete for it.
+static const int IO_THREAD_COUNT = 2;
+
+AssetManager::AssetManager()
+{
+    pool.setMaxThreadCount(IO_THREAD_COUNT);
+}
+
+AssetManager *AssetManager::instance()
+{
+    static AssetManager manager;
+    return &manager;
+}
+
+void AssetManager::setMaxThreadCount(int count)
+{
+    pool.setMaxThreadCount(qMax(1, count));
+}
+
+void AssetManager::post(std::function<void()> callback)
+{
+    QMutexLocker lock(&mutex);
+    completed.append(std::move(callback));
+}
+
+int AssetManager::processCompleted()
+{
+    QVector<std::function<void()>> callbacks;
+    {
+        QMutexLocker lock(&mutex);
+        callbacks.swap(completed);
+        // drop the keys of assets nobody holds anymore
+        for (auto it = cache.begin(); it != cache.end(); ) {
+            if (it.value().isNull())
+                it = cache.erase(it);
+            else
+                ++it;
+        }
+    }
+    for (const std::function<void()> &callback : std::as_const(callbacks))
+        callback();
+    return int(callbacks.size());
+}
@@ -0,0 +1,179 @@
+#ifndef ASSETMANAGER_H
+#define ASSETMANAGER_H
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QVector>
+#include <QWaitCondition>
+#include <functional>
+
+/**
+ * @brief State shared by all handles of one asset.
+*/
+class AssetBase
+{
+public:
+    virtual ~AssetBase() {}
+    bool isLoaded() const {return loaded.loadAcquire();}
+
+protected:
+    friend class AssetManager;
+    template<class T> friend class AssetHandle;
+
+    QAtomicInt loaded;
+    QMutex mutex;
+    QWaitCondition done;
+};
+
+template<class T>
+class AssetData : public AssetBase
+{
+public:
+    T value;
+    QVector<std::function<void(const T &)>> callbacks;//handed to the manager once loaded
+};
+
+/**
+ * @brief Reference counted handle to an asset loading in the background. The
+ * asset is freed with its last handle, a load that has not started by then is
+ * skipped.
+*/
+template<class T>
+class AssetHandle
+{
+public:
+    bool isNull() const {return !d;}
+    bool isLoaded() const {return d && d->isLoaded();}
+    //nullptr until loaded, never blocks
+    const T *data() const {return isLoaded() ? &d->value : nullptr;}
+    //blocks until loaded, not for threads that must keep going
+    const T &wait() const;
+    //callback runs in AssetManager::processCompleted() once the asset is loaded,
+    //on the next call already if it is loaded
+    void whenLoaded(std::function<void(const T &)> callback) const;
+    void reset() {d.reset();}
+
+    //handle to a value that is already there, e.g. created in place
+    static AssetHandle<T> fromValue(const T &value);
+
+private:
+    friend class AssetManager;
+    QSharedPointer<AssetData<T>> d;
+};
+
+/**
+ * @brief Loads assets on a small pool of I/O threads. Requests are served by
+ * priority, requests with the same key share one load, and completion
+ * callbacks are collected until the consumer picks them up with
+ * processCompleted(), typically the render thread handing the data to its
+ * upload queue at the start of a frame.
+*/
+class AssetManager
+{
+public:
+    enum Priority{Low, Normal, High};
+
+    static AssetManager *instance();
+
+    void setMaxThreadCount(int count);
+    int pendingCount() const {return pending.loadRelaxed();}
+
+    //an empty key never shares, load runs on an I/O thread
+    template<class T>
+    AssetHandle<T> request(const QString &key, Priority priority, std::function<T()> load);
+
+    //run the callbacks of everything that finished loading since the last call,
+    //returns how many ran
+    int processCompleted();
+    //queue a callback for processCompleted()
+    void post(std::function<void()> callback);
+
+private:
+    AssetManager();
+
+    template<class T>
+    void complete(const QSharedPointer<AssetData<T>> &d, T &&value);
+
+    QThreadPool pool;
+    QMutex mutex;
+    QHash<QString, QWeakPointer<AssetBase>> cache;
+    QVector<std::function<void()>> completed;
+    QAtomicInt pending;
+};
+
+template<class T>
+const T &AssetHandle<T>::wait() const
+{
+    Q_ASSERT(d);
+    QMutexLocker lock(&d->mutex);
+    while (!d->isLoaded())
+        d->done.wait(&d->mutex);
+    return d->value;
+}
+
+template<class T>
+AssetHandle<T> AssetHandle<T>::fromValue(const T &value)
+{
+    AssetHandle<T> handle;
+    handle.d.reset(new AssetData<T>);
+    handle.d->value = value;
+    handle.d->loaded.storeRelease(1);
+    return handle;
+}
+
+template<class T>
+void AssetHandle<T>::whenLoaded(std::function<void(const T &)> callback) const
+{
+    Q_ASSERT(d);
+    QMutexLocker lock(&d->mutex);
+    if (d->isLoaded()) {
+        QSharedPointer<AssetData<T>> data = d;
+        AssetManager::instance()->post([data, callback]() { callback(data->value); });
+    } else {
+        d->callbacks.append(callback);
+    }
+}
+
+template<class T>
+AssetHandle<T> AssetManager::request(const QString &key, Priority priority, std::function<T()> load)
+{
+    AssetHandle<T> handle;
+    QMutexLocker lock(&mutex);
+    if (!key.isEmpty()) {
+        handle.d = qSharedPointerDynamicCast<AssetData<T>>(cache.value(key).toStrongRef());
+        if (handle.d)
+            return handle;
+    }
+    handle.d.reset(new AssetData<T>);
+    if (!key.isEmpty())
+        cache.insert(key, handle.d);
+    lock.unlock();
+
+    pending.ref();
+    QWeakPointer<AssetData<T>> weak = handle.d;
+    pool.start([this, weak, load]() {
+        if (QSharedPointer<AssetData<T>> d = weak.toStrongRef())
+            complete(d, load());
+        pending.deref();
+    }, priority);
+    return handle;
+}
+
+template<class T>
+void AssetManager::complete(const QSharedPointer<AssetData<T>> &d, T &&value)
+{
+    QMutexLocker lock(&d->mutex);
+    d->value = std::move(value);
+    // The callbacks are queued before the asset counts as loaded, so whoever
+    // sees it loaded gets them from the next processCompleted(). The queued
+    // callbacks keep the asset alive until they ran.
+    for (const std::function<void(const T &)> &callback : std::as_const(d->callbacks))
+        post([d, callback]() { callback(d->value); });
+    d->callbacks.clear();
+    d->loaded.storeRelease(1);
+    d->done.wakeAll();
+}
+
+#endif // ASSETMANAGER_H
@@ -0,0 +1,265 @@
+#include "cpuculler.h"
+#include <QtConcurrentMap>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QVector>
+#include <QDebug>
+#include <numeric>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CULL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// SSE is part of x86-64, AVX2 is compiled in separately and picked at runtime.
+#if defined(CULL_X86) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define CULL_SSE
+#endif
+#if defined(CULL_X86) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define CULL_AVX2
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// Instances per parallel job.
+static const int CHUNK_SIZE = 16384;
+
+// Frustum planes as (nx, ny, nz, d), normals pointing inwards, the same as
+// GpuCuller uses. The mesh bounds are folded into d, so that an instance is
+// visible if n.t + d >= 0 for all planes, t being its translation.
+static void cullPlanes(const QMatrix4x4 &viewProj, const float *meshBounds, float *planes)
+{
+    const QVector4D r0 = viewProj.row(0), r1 = viewProj.row(1), r2 = viewProj.row(2), r3 = viewProj.row(3);
+    const QVector4D p[6] = { r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2 };
+    const QVector3D center((meshBounds[0] + meshBounds[3]) * 0.5f,
+                           (meshBounds[1] + meshBounds[4]) * 0.5f,
+                           (meshBounds[2] + meshBounds[5]) * 0.5f);
+    const QVector3D extents((meshBounds[3] - meshBounds[0]) * 0.5f,
+                            (meshBounds[4] - meshBounds[1]) * 0.5f,
+                            (meshBounds[5] - meshBounds[2]) * 0.5f);
+    for (int i = 0; i < 6; ++i) {
+        const QVector3D n = p[i].toVector3D();
+        const QVector3D absN(qAbs(n.x()), qAbs(n.y()), qAbs(n.z()));
+        planes[i * 4] = n.x();
+        planes[i * 4 + 1] = n.y();
+        planes[i * 4 + 2] = n.z();
+        planes[i * 4 + 3] = p[i].w() + QVector3D::dotProduct(n, center) + QVector3D::dotProduct(absN, extents);
+    }
+}
+
+static int cullScalar(const float *planes, const float *xs, const float *ys, const float *zs,
+                      int begin, int end, quint32 *visible)
+{
+    int n = 0;
+    for (int i = begin; i < end; ++i) {
+        bool inside = true;
+        for (int p = 0; p < 6; ++p) {
+            const float *pl = planes + p * 4;
+            inside &= pl[0] * xs[i] + pl[1] * ys[i] + pl[2] * zs[i] + pl[3] >= 0.0f;
+        }
+        // always written, only kept when visible
+        visible[n] = quint32(i);
+        n += inside;
+    }
+    return n;
+}
+
+#ifdef CULL_SSE
+static int cullSse(const float *planes, const float *xs, const float *ys, const float *zs,
+                   int begin, int end, quint32 *visible)
+{
+    __m128 pl[24];
+    for (int i = 0; i < 24; ++i)
+        pl[i] = _mm_set1_ps(planes[i]);
+    const __m128 zero = _mm_setzero_ps();
+
+    int n = 0;
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        const __m128 x = _mm_loadu_ps(xs + i);
+        const __m128 y = _mm_loadu_ps(ys + i);
+        const __m128 z = _mm_loadu_ps(zs + i);
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p) {
+            const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pl[p * 4], x), _mm_mul_ps(pl[p * 4 + 1], y)),
+                                        _mm_add_ps(_mm_mul_ps(pl[p * 4 + 2], z), pl[p * 4 + 3]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, zero));
+        }
+        const int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; ++k) {
+            visible[n] = quint32(i + k);
+            n += (mask >> k) & 1;
+        }
+    }
+    return n + cullScalar(planes, xs, ys, zs, i, end, visible + n);
+}
+#endif
+
+#ifdef CULL_AVX2
+TARGET_AVX2 static int cullAvx2(const float *planes, const float *xs, const float *ys, const float *zs,
+                                int begin, int end, quint32 *visible)
+{
+    __m256 pl[24];
+    for (int i = 0; i < 24; ++i)
+        pl[i] = _mm256_set1_ps(planes[i]);
+    const __m256 zero = _mm256_setzero_ps();
+
+    int n = 0;
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        const __m256 x = _mm256_loadu_ps(xs + i);
+        const __m256 y = _mm256_loadu_ps(ys + i);
+        const __m256 z = _mm256_loadu_ps(zs + i);
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p) {
+            const __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pl[p * 4], x), _mm256_mul_ps(pl[p * 4 + 1], y)),
+                                           _mm256_add_ps(_mm256_mul_ps(pl[p * 4 + 2], z), pl[p * 4 + 3]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, zero, _CMP_GE_OQ));
+        }
+        const int mask = _mm256_movemask_ps(inside);
+        for (int k = 0; k < 8; ++k) {
+            visible[n] = quint32(i + k);
+            n += (mask >> k) & 1;
+        }
+    }
+    return n + cullScalar(planes, xs, ys, zs, i, end, visible + n);
+}
+#endif
+
+CpuCuller::CpuCuller()
+    : isa(bestIsa())
+{
+}
+
+void CpuCuller::resize(int count)
+{
+    xs.resize(count);
+    ys.resize(count);
+    zs.resize(count);
+}
+
+CpuCuller::Isa CpuCuller::bestIsa()
+{
+#if defined(CULL_AVX2) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = info[2] & (1 << 27);
+    const bool avx = info[2] & (1 << 28);
+    __cpuidex(info, 7, 0);
+    const bool avx2 = info[1] & (1 << 5);
+    // the OS has to save the ymm registers too
+    if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6)
+        return Avx2;
+#elif defined(CULL_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return Avx2;
+#endif
+#ifdef CULL_SSE
+    return Sse;
+#else
+    return Scalar;
+#endif
+}
+
+const char *CpuCuller::isaName(Isa isa)
+{
+    switch (isa) {
+    case Avx2:
+        return "AVX2";
+    case Sse:
+        return "SSE";
+    default:
+        return "scalar";
+    }
+}
+
+int CpuCuller::cullRange(Isa isa, const float *planes, int begin, int end, quint32 *visible) const
+{
+    switch (isa) {
+#ifdef CULL_AVX2
+    case Avx2:
+        return cullAvx2(planes, xs.data(), ys.data(), zs.data(), begin, end, visible);
+#endif
+#ifdef CULL_SSE
+    case Sse:
+        return cullSse(planes, xs.data(), ys.data(), zs.data(), begin, end, visible);
+#endif
+    default:
+        return cullScalar(planes, xs.data(), ys.data(), zs.data(), begin, end, visible);
+    }
+}
+
+int CpuCuller::cull(const QMatrix4x4 &viewProj, const float *meshBounds, quint32 *visible) const
+{
+    float planes[24];
+    cullPlanes(viewProj, meshBounds, planes);
+
+    const int n = size();
+    const int chunkCount = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (chunkCount <= 1)
+        return cullRange(isa, planes, 0, n, visible);
+
+    // Every chunk writes its indices to its own part of visible, the parts are
+    // moved together afterwards.
+    QVector<int> chunks(chunkCount);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    std::vector<int> counts(chunkCount);
+    QtConcurrent::blockingMap(chunks, [&](int &c) {
+        const int begin = c * CHUNK_SIZE;
+        counts[c] = cullRange(isa, planes, begin, qMin(n, begin + CHUNK_SIZE), visible + begin);
+    });
+
+    int total = counts[0];
+    for (int c = 1; c < chunkCount; ++c) {
+        memmove(visible + total, visible + c * CHUNK_SIZE, counts[c] * sizeof(quint32));
+        total += counts[c];
+    }
+    return total;
+}
+
+void CpuCuller::benchmark(int count)
+{
+    CpuCuller culler;
+    culler.resize(count);
+    QRandomGenerator rng(1234);
+    for (int i = 0; i < count; ++i) {
+        const float t[] = { float(rng.bounded(200.0) - 100.0), float(rng.bounded(200.0) - 100.0),
+                            float(rng.bounded(200.0) - 100.0) };
+        culler.setPosition(i, t);
+    }
+
+    QMatrix4x4 viewProj;
+    viewProj.perspective(45.0f, 16.0f / 9.0f, 0.01f, 1000.0f);
+    viewProj.lookAt(QVector3D(0, 0, 20), QVector3D(0, 0, 0), QVector3D(0, 1, 0));
+    const float bounds[] = { -1, -1, -1, 1, 1, 1 };
+    float planes[24];
+    cullPlanes(viewProj, bounds, planes);
+    std::vector<quint32> visible(count);
+
+    const int runs = 20;
+    QElapsedTimer timer;
+    for (int i = Scalar; i <= bestIsa(); ++i) {
+        int n = 0;
+        timer.start();
+        for (int r = 0; r < runs; ++r)
+            n = culler.cullRange(Isa(i), planes, 0, count, visible.data());
+        const double ns = double(timer.nsecsElapsed()) / runs;
+        qDebug("CPU culling, %s, 1 thread: %d instances, %d visible, %.3f instances/ns",
+               isaName(Isa(i)), count, n, count / ns);
+    }
+
+    int n = 0;
+    timer.start();
+    for (int r = 0; r < runs; ++r)
+        n = culler.cull(viewProj, bounds, visible.data());
+    const double ns = double(timer.nsecsElapsed()) / runs;
+    qDebug("CPU culling, %s, parallel: %d instances, %d visible, %.3f instances/ns",
+           isaName(culler.isa), count, n, count / ns);
+}
@@ -0,0 +1,48 @@
+#ifndef CPUCULLER_H
+#define CPUCULLER_H
+
+#include <QMatrix4x4>
+#include <vector>
+
+/**
+ * @brief Frustum culling of item instances on the CPU, for devices where the
+ * compute pre-pass is not an option. The instance positions are kept as
+ * separate x, y and z arrays so that 8 (AVX2) or 4 (SSE) instances are tested
+ * per iteration, chunks of instances are culled in parallel.
+*/
+class CpuCuller
+{
+public:
+    enum Isa{Scalar,Sse,Avx2};
+
+    CpuCuller();
+
+    void resize(int count);
+    int size() const {return int(xs.size());}
+    void setPosition(int i, const float *translate) {xs[i]=translate[0]; ys[i]=translate[1]; zs[i]=translate[2];}
+
+    /**
+     * @brief write the indices of the instances whose translated mesh bounds
+     * intersect the frustum to visible, in ascending order
+     * @param meshBounds bounds of the mesh after the model transform, minX, minY, minZ, maxX, maxY, maxZ
+     * @param visible room for size() indices
+     * @return number of visible instances
+    */
+    int cull(const QMatrix4x4 &viewProj, const float *meshBounds, quint32 *visible) const;
+
+    //the widest instruction set this CPU supports
+    static Isa bestIsa();
+    static const char *isaName(Isa isa);
+    //cull random instances with every instruction set and log instances per nanosecond
+    static void benchmark(int count);
+
+private:
+    int cullRange(Isa isa, const float *planes, int begin, int end, quint32 *visible) const;
+
+    std::vector<float> xs;
+    std::vector<float> ys;
+    std::vector<float> zs;
+    Isa isa;
+};
+
+#endif // CPUCULLER_H
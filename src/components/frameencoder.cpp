@@ -0,0 +1,75 @@
+#include "frameencoder.h"
+#include <QDir>
+#include <QFile>
+#include <QImageWriter>
+#include <QSaveFile>
+
+FrameEncoder::FrameEncoder(const QString &directory, const QByteArray &fmt, int threadCount, int maxQueued)
+    : dir(directory),
+    format(fmt.toLower()),
+    queueSlots(qMax(1, maxQueued))
+{
+    pool.setMaxThreadCount(qMax(1, threadCount));
+    if (!supportedFormats().contains(format))
+        error = QString("Unsupported frame format %1").arg(QString::fromLatin1(format));
+    else if (!QDir().mkpath(dir))
+        error = QString("Failed to create %1").arg(dir);
+}
+
+FrameEncoder::~FrameEncoder()
+{
+    finish();
+}
+
+QList<QByteArray> FrameEncoder::supportedFormats()
+{
+    QList<QByteArray> formats = QImageWriter::supportedImageFormats();
+    formats.prepend("raw");
+    return formats;
+}
+
+void FrameEncoder::encode(int index, const QImage &image)
+{
+    queueSlots.acquire();
+    pool.start([this, index, image]() {
+        if (write(index, image))
+            written.ref();
+        else
+            failed.ref();
+        queueSlots.release();
+    });
+}
+
+void FrameEncoder::finish()
+{
+    pool.waitForDone();
+}
+
+bool FrameEncoder::write(int index, const QImage &image) const
+{
+    const QString fn = QDir(dir).filePath(QString("frame_%1.%2").arg(index, 5, 10, QLatin1Char('0'))
+                                          .arg(QString::fromLatin1(format == "raw" ? "rgba" : format)));
+    if (format == "raw") {
+        // tightly packed rows, the size is the one the frames were rendered at
+        QSaveFile f(fn);
+        if (!f.open(QIODevice::WriteOnly)) {
+            qWarning("Failed to open %s", qPrintable(fn));
+            return false;
+        }
+        const qsizetype rowBytes = qsizetype(image.width()) * 4;
+        for (int y = 0; y < image.height(); ++y)
+            f.write(reinterpret_cast<const char *>(image.constScanLine(y)), rowBytes);
+        if (!f.commit()) {
+            qWarning("Failed to write %s", qPrintable(fn));
+            return false;
+        }
+        return true;
+    }
+
+    QImageWriter writer(fn, format);
+    if (!writer.write(image)) {
+        qWarning("Failed to write %s: %s", qPrintable(fn), qPrintable(writer.errorString()));
+        return false;
+    }
+    return true;
+}
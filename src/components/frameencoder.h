@@ -0,0 +1,46 @@
+#ifndef FRAMEENCODER_H
+#define FRAMEENCODER_H
+
+#include <QImage>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QAtomicInt>
+
+/**
+ * @brief Writes rendered frames to numbered files on encoder threads, so that
+ * compressing one frame overlaps rendering and reading back the next ones.
+ * encode() blocks once maxQueued frames are waiting, which keeps a renderer
+ * that outruns the disk from piling up images.
+*/
+class FrameEncoder
+{
+public:
+    //format is "raw" for the bare RGBA8 pixels or anything QImageWriter supports, e.g. "png"
+    FrameEncoder(const QString &dir, const QByteArray &format, int threadCount, int maxQueued);
+    ~FrameEncoder();
+
+    //empty when the directory and format are usable
+    QString errorString() const {return error;}
+
+    void encode(int index, const QImage &image);
+    //block until every frame handed to encode() is written
+    void finish();
+
+    int writtenCount() const {return written.loadRelaxed();}
+    int failedCount() const {return failed.loadRelaxed();}
+
+    static QList<QByteArray> supportedFormats();
+
+private:
+    bool write(int index, const QImage &image) const;
+
+    QString dir;
+    QByteArray format;
+    QString error;
+    QThreadPool pool;
+    QSemaphore queueSlots;
+    QAtomicInt written;
+    QAtomicInt failed;
+};
+
+#endif // FRAMEENCODER_H
@@ -1,12 +1,24 @@
 #include "glview.h"
 #include<QDebug>
 
+// Points drawn per frame at most, however large the cloud is.
+static const qint64 DEFAULT_POINT_BUDGET = 3000000;
+// Octree nodes are refined until their points are this close on screen.
+static const float MIN_POINT_PIXELS = 1.5f;
+// GPU buffers the visible nodes are streamed into.
+static const int POINT_SLOT_COUNT = 384;
+// Limits the upload cost of a single frame, the rest follows in later frames.
+static const int MAX_NODE_UPLOADS_PER_FRAME = 16;
+
 GLView::GLView(QWidget *parent):QOpenGLWidget(parent){
     m_xRotate = -30.0;
     m_zRotate = 100.0;
     m_xTrans = 0.0;
     m_yTrans = 0.0;
     m_zoom = 45.0;
+    m_pointCount = 0;
+    m_frameIndex = 0;
+    m_pointBudget = DEFAULT_POINT_BUDGET;
 }
 
 GLView::~GLView(){
@@ -17,8 +29,11 @@ GLView::~GLView(){
     glDeleteBuffers(1, &m_VBO_Axis);
     glDeleteVertexArrays(1, &m_VAO_Axis);
 
-    glDeleteBuffers(1, &m_VBO_Point);
-    glDeleteVertexArrays(1, &m_VAO_Point);
+    for (PointSlot &slot : m_pointSlots)
+    {
+        glDeleteBuffers(1, &slot.vbo);
+        glDeleteVertexArrays(1, &slot.vao);
+    }
 
     m_shaderProgramMesh.release();
     m_shaderProgramAxis.release();
@@ -30,40 +45,13 @@ GLView::~GLView(){
 
 
 void GLView::updatePoints(const QVector<QVector3D> &points){
-    m_pointData.clear();
-    for(auto vector3D : points)
-    {
-        m_pointData.push_back(vector3D.x());
-        m_pointData.push_back(vector3D.y());
-        m_pointData.push_back(vector3D.z());
-        m_pointData.push_back(1);
-    }
+    m_pointCloud.setPoints(points);
 }
 
 void GLView::loadCsvFile(const QString &path)
 {
-    m_pointData.clear();
-    // QFile inFile(path);
-    QFile inFile(path);
-    if (inFile.open(QIODevice::ReadOnly))
-    {
-        qDebug()<<"successfully read\n";
-        QTextStream stream_text(&inFile);
-        while (!stream_text.atEnd())
-        {
-            QString line = stream_text.readLine();
-            QStringList strSplit = line.split(",");
-
-            double x = strSplit.value(0).toDouble();
-            double y = strSplit.value(1).toDouble();
-            double z = strSplit.value(2).toDouble();
-            m_pointData.push_back(x);
-            m_pointData.push_back(y);
-            m_pointData.push_back(z);
-            m_pointData.push_back(1);
-        }
-        inFile.close();
-    }
+    if (m_pointCloud.load(path))
+        qDebug()<<"successfully read"<<m_pointCloud.size()<<"points";
 }
 
 void GLView::initializeGL(){
@@ -95,7 +83,9 @@ void GLView::initializeGL(){
     m_shaderProgramPoint.link();
 
     m_vertexCount = drawMeshline(2.0, 16);
-    m_pointCount = drawPointdata(m_pointData);
+    m_pointCount = drawPointdata(m_pointCloud);
+    // the octree keeps its own reordered copy of the points
+    m_pointCloud.clear();
     qDebug() << "point_count" << m_pointCount;
     drawCooraxis(4.0);
 }
@@ -154,9 +144,8 @@ void GLView::paintGL(){
 
     //画点云
     m_shaderProgramPoint.bind();
-    glBindVertexArray(m_VAO_Point);
     glPointSize(1.0f);
-    glDrawArrays(GL_POINTS, 0, m_pointCount);
+    drawPointNodes(view * model, projection);
 }
 
 
@@ -292,30 +281,113 @@ void GLView::drawCooraxis(float length){
     glBindVertexArray(0);
 }
 
-unsigned int GLView::drawPointdata(std::vector<float> &pointVertexs){
-    unsigned int point_count = 0;
+unsigned int GLView::drawPointdata(const PointCloud &pointCloud){
+    // Only the LOD hierarchy is kept, the nodes are uploaded on demand by
+    // drawPointNodes().
+    m_pointOctree.build(pointCloud);
+    m_nodeSlot.assign(m_pointOctree.nodes().size(), -1);
 
-    glGenVertexArrays(1, &m_VAO_Point);
-    glGenBuffers(1, &m_VBO_Point);
+    m_pointSlots.resize(POINT_SLOT_COUNT);
+    for (PointSlot &slot : m_pointSlots)
+    {
+        glGenVertexArrays(1, &slot.vao);
+        glGenBuffers(1, &slot.vbo);
 
-    glBindVertexArray(m_VAO_Point);
+        glBindVertexArray(slot.vao);
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_VBO_Point);
-    glBufferData(GL_ARRAY_BUFFER, pointVertexs.size() * sizeof(float), &pointVertexs[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, slot.vbo);
 
-    // 位置属性
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)0);
-    glEnableVertexAttribArray(0);
+        // 位置属性
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PointVertex), (void *)offsetof(PointVertex, x));
+        glEnableVertexAttribArray(0);
 
-    // 颜色属性
-    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+        // 强度属性
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(PointVertex), (void *)offsetof(PointVertex, intensity));
+        glEnableVertexAttribArray(1);
+
+        // 颜色属性
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PointVertex), (void *)offsetof(PointVertex, r));
+        glEnableVertexAttribArray(2);
+    }
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     glBindVertexArray(0);
 
-    point_count = (unsigned int)pointVertexs.size() / 4;
+    return (unsigned int)m_pointOctree.pointCount();
+}
+
+int GLView::residentPointSlot(int node, int *uploadsLeft){
+    int slotIndex = m_nodeSlot[node];
+    if (slotIndex < 0)
+    {
+        if (*uploadsLeft == 0)
+            return -1;
 
-    return point_count;
+        // Reuse the least recently drawn slot that is not part of this frame.
+        for (int i = 0; i < int(m_pointSlots.size()); ++i)
+        {
+            const PointSlot &slot = m_pointSlots[i];
+            if (slot.lastUsedFrame == m_frameIndex && slot.node >= 0)
+                continue;
+            if (slotIndex < 0 || slot.node < 0 || slot.lastUsedFrame < m_pointSlots[slotIndex].lastUsedFrame)
+                slotIndex = i;
+            if (slot.node < 0)
+                break;
+        }
+        if (slotIndex < 0)
+            return -1;
+
+        PointSlot &slot = m_pointSlots[slotIndex];
+        if (slot.node >= 0)
+            m_nodeSlot[slot.node] = -1;
+
+        const PointOctreeNode &n = m_pointOctree.nodes()[node];
+        const qint64 bytes = n.count * qint64(sizeof(PointVertex));
+        const PointVertex *data = m_pointOctree.points() + n.first;
+        glBindBuffer(GL_ARRAY_BUFFER, slot.vbo);
+        if (bytes > slot.capacity)
+        {
+            glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_STATIC_DRAW);
+            slot.capacity = bytes;
+        }
+        else
+        {
+            glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        slot.node = node;
+        m_nodeSlot[node] = slotIndex;
+        --*uploadsLeft;
+    }
+    m_pointSlots[slotIndex].lastUsedFrame = m_frameIndex;
+    return slotIndex;
+}
+
+void GLView::drawPointNodes(const QMatrix4x4 &modelView, const QMatrix4x4 &projection){
+    ++m_frameIndex;
+    m_pointOctree.traverse(modelView, projection, height(), m_pointBudget, MIN_POINT_PIXELS, &m_visibleNodes);
+
+    int uploadsLeft = MAX_NODE_UPLOADS_PER_FRAME;
+    bool pending = false;
+    for (int node : m_visibleNodes)
+    {
+        const int slot = residentPointSlot(node, &uploadsLeft);
+        if (slot < 0)
+        {
+            // Only the upload limit clears up with the next frame. With every
+            // slot taken by a visible node, repainting would not help.
+            if (uploadsLeft == 0)
+                pending = true;
+            continue;
+        }
+        glBindVertexArray(m_pointSlots[slot].vao);
+        glDrawArrays(GL_POINTS, 0, (GLsizei)m_pointOctree.nodes()[node].count);
+    }
+    glBindVertexArray(0);
+
+    // Keep streaming until every selected node is resident.
+    if (pending)
+        update();
 }
@@ -15,6 +15,8 @@
 #include<QPainter>
 #include<QMouseEvent>
 #include<QFile>
+#include "pointcloud.h"
+#include "pointoctree.h"
 
 // #include "opengllib_global.h"
 
@@ -43,7 +45,9 @@ protected:
 
     virtual unsigned int drawMeshline(float size, int count);
     virtual void drawCooraxis(float length);
-    virtual unsigned int drawPointdata(std::vector<float> &pointVertexs);
+    virtual unsigned int drawPointdata(const PointCloud &pointCloud);
+    void drawPointNodes(const QMatrix4x4 &modelView, const QMatrix4x4 &projection);
+    int residentPointSlot(int node, int *uploadsLeft);
 
     QOpenGLShaderProgram m_shaderProgramMesh;
     QOpenGLShaderProgram m_shaderProgramAxis;
@@ -55,12 +59,24 @@ protected:
     unsigned int m_VBO_Axis;
     unsigned int m_VAO_Axis;
 
-    unsigned int m_VBO_Point;
-    unsigned int m_VAO_Point;
-
-    std::vector<float> m_pointData;
+    PointCloud m_pointCloud;
+    PointOctree m_pointOctree;
     unsigned int m_pointCount;
 
+    // Pool of GPU buffers the visible octree nodes are streamed into.
+    struct PointSlot{
+        unsigned int vao=0;
+        unsigned int vbo=0;
+        qint64 capacity=0;//bytes
+        int node=-1;
+        quint64 lastUsedFrame=0;
+    };
+    std::vector<PointSlot> m_pointSlots;
+    std::vector<int> m_nodeSlot;//node -> slot, -1 when not resident
+    std::vector<int> m_visibleNodes;
+    quint64 m_frameIndex;
+    qint64 m_pointBudget;
+
     unsigned int m_vertexCount;
 
     float m_xRotate;
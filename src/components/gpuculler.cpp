@@ -0,0 +1,383 @@
+#include "gpuculler.h"
+#include <QVulkanDeviceFunctions>
+#include <cstddef>
+
+static const uint32_t WORKGROUP_SIZE = 64; // see cull.comp
+static const uint32_t BINDING_COUNT = 5;
+static const uint32_t COMMAND_BINDING = 2; // at the dynamic offset of the draw
+static const VkDeviceSize INSTANCE_SIZE = 3 * sizeof(float); // diffuse adjust
+static const VkDeviceSize TRANSFORM_SIZE = 8 * sizeof(float); // rotation, translation, scale
+// the largest minStorageBufferOffsetAlignment the spec allows
+static const VkDeviceSize TRANSFORM_ALIGNMENT = 256;
+// draw commands are bound at dynamic offsets, so they are that far apart too
+static const VkDeviceSize COMMAND_STRIDE = 256;
+static_assert(GpuCuller::MAX_DRAWS * COMMAND_STRIDE <= 65536, "The draw commands are reset with one vkCmdUpdateBuffer");
+
+// 128 bytes, the smallest maxPushConstantsSize there is
+struct CullPushConstants{
+    float planes[6][4];
+    float center[3];
+    uint32_t first;
+    float extents[3];
+    uint32_t count;
+};
+
+// Gribb-Hartmann planes of the view frustum in world space, normals pointing
+// inwards. The near plane is z >= 0 because of the Vulkan depth range.
+static void frustumPlanes(const QMatrix4x4 &viewProj, float planes[6][4])
+{
+    const QVector4D r0 = viewProj.row(0), r1 = viewProj.row(1), r2 = viewProj.row(2), r3 = viewProj.row(3);
+    const QVector4D p[6] = { r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2 };
+    for (int i = 0; i < 6; ++i) {
+        planes[i][0] = p[i].x();
+        planes[i][1] = p[i].y();
+        planes[i][2] = p[i].z();
+        planes[i][3] = p[i].w();
+    }
+}
+
+GpuCuller::GpuCuller() {}
+
+void GpuCuller::create(QVulkanDeviceFunctions *f, VkDevice device, VkPipelineCache cache, VkShaderModule shader,
+                       int frameCount, uint32_t hostVisibleMemoryIndex, uint32_t deviceLocalMemoryIndex)
+{
+    devFuncs = f;
+    dev = device;
+    hostVisibleIndex = hostVisibleMemoryIndex;
+    deviceLocalIndex = deviceLocalMemoryIndex;
+
+    VkDescriptorPoolSize descPoolSizes[] = {
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (BINDING_COUNT - 1) * uint32_t(frameCount) },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, uint32_t(frameCount) }
+    };
+    VkDescriptorPoolCreateInfo descPoolInfo;
+    memset(&descPoolInfo, 0, sizeof(descPoolInfo));
+    descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descPoolInfo.maxSets = uint32_t(frameCount);
+    descPoolInfo.poolSizeCount = 2;
+    descPoolInfo.pPoolSizes = descPoolSizes;
+    VkResult err = devFuncs->vkCreateDescriptorPool(dev, &descPoolInfo, nullptr, &descPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create culling descriptor pool: %d", err);
+
+    VkDescriptorSetLayoutBinding layoutBindings[BINDING_COUNT];
+    for (uint32_t i = 0; i < BINDING_COUNT; ++i) {
+        layoutBindings[i] = { i, i == COMMAND_BINDING ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+                                                      : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                              1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr };
+    }
+    VkDescriptorSetLayoutCreateInfo descLayoutInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        nullptr,
+        0,
+        BINDING_COUNT,
+        layoutBindings
+    };
+    err = devFuncs->vkCreateDescriptorSetLayout(dev, &descLayoutInfo, nullptr, &descSetLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create culling descriptor set layout: %d", err);
+
+    descSets.resize(frameCount);
+    QVector<VkDescriptorSetLayout> layouts(frameCount, descSetLayout);
+    VkDescriptorSetAllocateInfo descSetAllocInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        nullptr,
+        descPool,
+        uint32_t(frameCount),
+        layouts.constData()
+    };
+    err = devFuncs->vkAllocateDescriptorSets(dev, &descSetAllocInfo, descSets.data());
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate culling descriptor sets: %d", err);
+
+    VkPushConstantRange pcr = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants) };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo;
+    memset(&pipelineLayoutInfo, 0, sizeof(pipelineLayoutInfo));
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pcr;
+    err = devFuncs->vkCreatePipelineLayout(dev, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create culling pipeline layout: %d", err);
+
+    pipeline = createPipeline(cache, shader);
+    if (!pipeline)
+        qFatal("Failed to create culling pipeline");
+
+    // The draw commands are rewritten by every dispatch, they only need to live
+    // in device-local memory.
+    if (!createBuffer(MAX_DRAWS * COMMAND_STRIDE,
+                      VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                      | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                      deviceLocalIndex, &cmdBuf, &cmdMem))
+        qFatal("Failed to create indirect draw buffer");
+
+    if (!createBuffer(frameCount * MAX_DRAWS * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      hostVisibleIndex, &statsBuf, &statsMem))
+        qFatal("Failed to create culling statistics buffer");
+    err = devFuncs->vkMapMemory(dev, statsMem, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&statsMapped));
+    if (err != VK_SUCCESS)
+        qFatal("Failed to map memory: %d", err);
+    statsDrawCount.fill(0, frameCount);
+}
+
+VkPipeline GpuCuller::createPipeline(VkPipelineCache cache, VkShaderModule shader) const
+{
+    VkComputePipelineCreateInfo pipelineInfo;
+    memset(&pipelineInfo, 0, sizeof(pipelineInfo));
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = {
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        nullptr,
+        0,
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        shader,
+        "main",
+        nullptr
+    };
+    pipelineInfo.layout = pipelineLayout;
+    VkPipeline p = VK_NULL_HANDLE;
+    VkResult err = devFuncs->vkCreateComputePipelines(dev, cache, 1, &pipelineInfo, nullptr, &p);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create culling pipeline: %d", err);
+        return VK_NULL_HANDLE;
+    }
+    return p;
+}
+
+VkPipeline GpuCuller::replacePipeline(VkPipeline p)
+{
+    VkPipeline old = pipeline;
+    pipeline = p;
+    return old;
+}
+
+void GpuCuller::destroy()
+{
+    if (!dev)
+        return;
+
+    if (pipeline) {
+        devFuncs->vkDestroyPipeline(dev, pipeline, nullptr);
+        pipeline = VK_NULL_HANDLE;
+    }
+
+    if (pipelineLayout) {
+        devFuncs->vkDestroyPipelineLayout(dev, pipelineLayout, nullptr);
+        pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (descSetLayout) {
+        devFuncs->vkDestroyDescriptorSetLayout(dev, descSetLayout, nullptr);
+        descSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (descPool) {
+        devFuncs->vkDestroyDescriptorPool(dev, descPool, nullptr);
+        descPool = VK_NULL_HANDLE;
+        descSets.clear();
+    }
+
+    VkBuffer bufs[] = { visibleBuf, cmdBuf, statsBuf };
+    VkDeviceMemory mems[] = { visibleMem, cmdMem, statsMem };
+    for (int i = 0; i < 3; ++i) {
+        if (bufs[i])
+            devFuncs->vkDestroyBuffer(dev, bufs[i], nullptr);
+        if (mems[i])
+            devFuncs->vkFreeMemory(dev, mems[i], nullptr);
+    }
+    visibleBuf = cmdBuf = statsBuf = VK_NULL_HANDLE;
+    visibleMem = cmdMem = statsMem = VK_NULL_HANDLE;
+    statsMapped = nullptr;
+    statsDrawCount.clear();
+    capacity = 0;
+    transformOffset = 0;
+
+    dev = VK_NULL_HANDLE;
+}
+
+bool GpuCuller::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, uint32_t memIndex,
+                             VkBuffer *buf, VkDeviceMemory *mem)
+{
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = size;
+    bufInfo.usage = usage;
+    VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, buf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create buffer: %d", err);
+
+    VkMemoryRequirements memReq;
+    devFuncs->vkGetBufferMemoryRequirements(dev, *buf, &memReq);
+    VkMemoryAllocateInfo memAllocInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        nullptr,
+        memReq.size,
+        memIndex
+    };
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, mem);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to allocate %llu bytes for culling: %d", (unsigned long long) memReq.size, err);
+        devFuncs->vkDestroyBuffer(dev, *buf, nullptr);
+        *buf = VK_NULL_HANDLE;
+        return false;
+    }
+    err = devFuncs->vkBindBufferMemory(dev, *buf, *mem, 0);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind buffer memory: %d", err);
+    return true;
+}
+
+void GpuCuller::ensureCapacity(int n, VkBuffer *oldBuf, VkDeviceMemory *oldMem)
+{
+    *oldBuf = VK_NULL_HANDLE;
+    *oldMem = VK_NULL_HANDLE;
+    if (n <= capacity)
+        return;
+
+    // the transforms start at an offset any device can bind storage at
+    const VkDeviceSize offset = (VkDeviceSize(n) * INSTANCE_SIZE + TRANSFORM_ALIGNMENT - 1) & ~(TRANSFORM_ALIGNMENT - 1);
+    VkBuffer buf;
+    VkDeviceMemory mem;
+    if (!createBuffer(offset + VkDeviceSize(n) * TRANSFORM_SIZE,
+                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                      deviceLocalIndex, &buf, &mem))
+        qFatal("Failed to create visible instance buffer");
+
+    *oldBuf = visibleBuf;
+    *oldMem = visibleMem;
+    visibleBuf = buf;
+    visibleMem = mem;
+    capacity = n;
+    transformOffset = offset;
+}
+
+VkDeviceSize GpuCuller::visibleTransformSize() const
+{
+    return VkDeviceSize(capacity) * TRANSFORM_SIZE;
+}
+
+VkDeviceSize GpuCuller::drawCommandOffset(int draw)
+{
+    return VkDeviceSize(draw) * COMMAND_STRIDE;
+}
+
+uint32_t GpuCuller::visibleCount(int frame) const
+{
+    uint32_t count = 0;
+    for (int i = 0; i < statsDrawCount.value(frame); ++i)
+        count += statsMapped[frame * MAX_DRAWS + i];
+    return count;
+}
+
+void GpuCuller::record(VkCommandBuffer cb, int frame, VkBuffer instances, VkDeviceSize instanceOffset,
+                       VkDeviceSize instanceTransformOffset, int instanceCount, const QVector<Draw> &draws,
+                       const QMatrix4x4 &viewProj)
+{
+    Q_ASSERT(instanceCount <= capacity && draws.size() <= MAX_DRAWS);
+    const int drawCount = int(draws.size());
+
+    // This frame slot's descriptor set is not used by any pending frame.
+    // The transform ranges stop at the instances, the rest of the buffer may
+    // be beyond maxStorageBufferRange.
+    VkDescriptorBufferInfo bufInfo[] = {
+        { instances, instanceOffset, instanceTransformOffset - instanceOffset },
+        { visibleBuf, 0, transformOffset },
+        { cmdBuf, 0, sizeof(VkDrawIndexedIndirectCommand) },
+        { instances, instanceTransformOffset, VkDeviceSize(qMax(instanceCount, 1)) * TRANSFORM_SIZE },
+        { visibleBuf, transformOffset, visibleTransformSize() }
+    };
+    VkWriteDescriptorSet descWrite[BINDING_COUNT];
+    memset(descWrite, 0, sizeof(descWrite));
+    for (uint32_t i = 0; i < BINDING_COUNT; ++i) {
+        descWrite[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descWrite[i].dstSet = descSets[frame];
+        descWrite[i].dstBinding = i;
+        descWrite[i].descriptorCount = 1;
+        descWrite[i].descriptorType = i == COMMAND_BINDING ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+                                                           : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descWrite[i].pBufferInfo = &bufInfo[i];
+    }
+    devFuncs->vkUpdateDescriptorSets(dev, BINDING_COUNT, descWrite, 0, nullptr);
+
+    // The previous frame may still be drawing from the draw commands and the
+    // visible instances, wait for that before overwriting them.
+    devFuncs->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                                   | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                   VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                   0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+    // instanceCount is the second member of both command layouts, that is
+    // all the shader touches. The visible instances of a draw start where
+    // its instances do.
+    statsDrawCount[frame] = drawCount;
+    if (!drawCount)
+        return;
+    QByteArray initialCmds(drawCount * COMMAND_STRIDE, 0);
+    for (int i = 0; i < drawCount; ++i) {
+        const Draw &d = draws[i];
+        char *p = initialCmds.data() + drawCommandOffset(i);
+        if (d.indexed) {
+            const VkDrawIndexedIndirectCommand cmd = { d.elementCount, 0, 0, 0, uint32_t(d.first) };
+            memcpy(p, &cmd, sizeof(cmd));
+        } else {
+            const VkDrawIndirectCommand cmd = { d.elementCount, 0, 0, uint32_t(d.first) };
+            memcpy(p, &cmd, sizeof(cmd));
+        }
+    }
+    devFuncs->vkCmdUpdateBuffer(cb, cmdBuf, 0, initialCmds.size(), initialCmds.constData());
+
+    VkMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    devFuncs->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                   0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    // One dispatch per draw, with its command at a dynamic offset. They write
+    // disjoint ranges, so nothing has to wait in between.
+    CullPushConstants pc;
+    frustumPlanes(viewProj, pc.planes);
+    devFuncs->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    for (int i = 0; i < drawCount; ++i) {
+        const Draw &d = draws[i];
+        if (!d.count)
+            continue;
+        for (int c = 0; c < 3; ++c) {
+            pc.center[c] = (d.bounds[c] + d.bounds[c + 3]) * 0.5f;
+            pc.extents[c] = (d.bounds[c + 3] - d.bounds[c]) * 0.5f;
+        }
+        pc.first = uint32_t(d.first);
+        pc.count = uint32_t(d.count);
+        const uint32_t cmdOffset = uint32_t(drawCommandOffset(i));
+        devFuncs->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1,
+                                          &descSets[frame], 1, &cmdOffset);
+        devFuncs->vkCmdPushConstants(cb, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+        devFuncs->vkCmdDispatch(cb, (uint32_t(d.count) + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+    }
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+                            | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    devFuncs->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                   VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                                   | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                   0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    // Keep the visible counts where the CPU can read them once the frame is done.
+    QVector<VkBufferCopy> regions(drawCount);
+    for (int i = 0; i < drawCount; ++i) {
+        regions[i] = { drawCommandOffset(i) + offsetof(VkDrawIndirectCommand, instanceCount),
+                       (VkDeviceSize(frame) * MAX_DRAWS + i) * sizeof(uint32_t), sizeof(uint32_t) };
+    }
+    devFuncs->vkCmdCopyBuffer(cb, cmdBuf, statsBuf, uint32_t(drawCount), regions.constData());
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    devFuncs->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                                   0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
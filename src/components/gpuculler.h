@@ -0,0 +1,96 @@
+#ifndef GPUCULLER_H
+#define GPUCULLER_H
+
+#include <QVulkanInstance>
+#include <QMatrix4x4>
+#include <QVector>
+
+class QVulkanDeviceFunctions;
+
+/**
+ * @brief Compute pre-pass that tests the bounds of every item instance against
+ * the view frustum and compacts the visible ones into a buffer of their own,
+ * the attributes first and the transforms at visibleTransformOffset().
+ * Every item batch keeps its instance range and gets a draw command of its own,
+ * drawn through vkCmdDrawIndirect, or vkCmdDrawIndexedIndirect for indexed
+ * meshes, with the count the shader wrote.
+ * Only core Vulkan 1.0 features are used, so this runs on lavapipe as well.
+*/
+class GpuCuller
+{
+public:
+    //the instances [first, first + count) drawn with one mesh
+    struct Draw{
+        int first;
+        int count;
+        bool indexed;//a VkDrawIndexedIndirectCommand instead of a VkDrawIndirectCommand
+        uint32_t elementCount;//indices per instance when indexed, vertices otherwise
+        float bounds[6];//of the mesh after the model transform, minX, minY, minZ, maxX, maxY, maxZ
+    };
+    //draws a single record() takes
+    static const int MAX_DRAWS = 256;
+
+    GpuCuller();
+
+    void create(QVulkanDeviceFunctions *f, VkDevice dev, VkPipelineCache cache, VkShaderModule shader,
+                int frameCount, uint32_t hostVisibleMemoryIndex, uint32_t deviceLocalMemoryIndex);
+    void destroy();
+    bool isValid() const {return pipeline!=VK_NULL_HANDLE;}
+
+    //another pipeline for the same layout, e.g. from an edited shader, may run on any thread
+    VkPipeline createPipeline(VkPipelineCache cache, VkShaderModule shader) const;
+    //returns the previous pipeline for the caller to destroy once no frame uses it
+    VkPipeline replacePipeline(VkPipeline p);
+
+    //make room for capacity visible instances, a replaced buffer is handed out
+    //through oldBuf/oldMem for the caller to release once no frame uses it anymore
+    void ensureCapacity(int capacity, VkBuffer *oldBuf, VkDeviceMemory *oldMem);
+
+    /**
+     * @brief record the culling dispatches, must be outside of a render pass
+     * @param instances 3 floats of attributes per instance from instanceOffset,
+     * followed by the transforms at instanceTransformOffset, 8 floats each, see
+     * color_phong.vert
+     * @param instanceCount instances of all draws
+     * @param draws at most MAX_DRAWS, each gets the command at drawCommandOffset()
+    */
+    void record(VkCommandBuffer cb, int frame, VkBuffer instances, VkDeviceSize instanceOffset,
+                VkDeviceSize instanceTransformOffset, int instanceCount, const QVector<Draw> &draws,
+                const QMatrix4x4 &viewProj);
+
+    VkBuffer visibleInstances() const {return visibleBuf;}
+    VkDeviceSize visibleTransformOffset() const {return transformOffset;}
+    //bytes of transforms from visibleTransformOffset()
+    VkDeviceSize visibleTransformSize() const;
+    VkBuffer drawCommand() const {return cmdBuf;}
+    static VkDeviceSize drawCommandOffset(int draw);
+    //result of the last dispatches recorded for the frame slot, valid once its fence has been waited for
+    uint32_t visibleCount(int frame) const;
+
+private:
+    bool createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, uint32_t memIndex, VkBuffer *buf, VkDeviceMemory *mem);
+
+    QVulkanDeviceFunctions *devFuncs=nullptr;
+    VkDevice dev=VK_NULL_HANDLE;
+    uint32_t hostVisibleIndex=0;
+    uint32_t deviceLocalIndex=0;
+
+    VkDescriptorPool descPool=VK_NULL_HANDLE;
+    VkDescriptorSetLayout descSetLayout=VK_NULL_HANDLE;
+    QVector<VkDescriptorSet> descSets;//one per frame in flight, rewritten every frame
+    VkPipelineLayout pipelineLayout=VK_NULL_HANDLE;
+    VkPipeline pipeline=VK_NULL_HANDLE;
+
+    int capacity=0;
+    VkBuffer visibleBuf=VK_NULL_HANDLE;//attributes, then the transforms
+    VkDeviceSize transformOffset=0;
+    VkDeviceMemory visibleMem=VK_NULL_HANDLE;
+    VkBuffer cmdBuf=VK_NULL_HANDLE;//VkDrawIndirectCommand or VkDrawIndexedIndirectCommand per draw
+    VkDeviceMemory cmdMem=VK_NULL_HANDLE;
+    VkBuffer statsBuf=VK_NULL_HANDLE;//visible count per draw and frame slot, host visible
+    VkDeviceMemory statsMem=VK_NULL_HANDLE;
+    uint32_t *statsMapped=nullptr;
+    QVector<int> statsDrawCount;//draws of the last record() per frame slot
+};
+
+#endif // GPUCULLER_H
@@ -0,0 +1,277 @@
+#include "gpuprofiler.h"
+#include <QVulkanDeviceFunctions>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <algorithm>
+
+static const int HISTORY_SIZE = 1024; // frames kept for the summary and the trace
+static const int SUMMARY_FRAMES = 60; // averaged in summary()
+static const int STATS_PER_QUERY = 2; // vertex, fragment invocations
+
+static const char *const PASS_NAMES[GpuProfiler::PassCount] = { "frame", "cull", "floor", "items" };
+
+GpuProfiler::GpuProfiler() {}
+
+void GpuProfiler::create(QVulkanDeviceFunctions *f, VkDevice device, const VkPhysicalDeviceProperties *props,
+                         uint32_t timestampValidBits, bool statistics, int frameCount, int maxJobs)
+{
+    devFuncs = f;
+    dev = device;
+    if (!timestampValidBits || props->limits.timestampPeriod <= 0) {
+        qWarning("No timestamps on the graphics queue, GPU profiling disabled");
+        return;
+    }
+    timestampMask = timestampValidBits >= 64 ? ~quint64(0) : (quint64(1) << timestampValidBits) - 1;
+    timestampPeriod = props->limits.timestampPeriod;
+    jobsPerFrame = maxJobs;
+    timestampsPerFrame = 4 + 2 * maxJobs;
+
+    VkQueryPoolCreateInfo poolInfo;
+    memset(&poolInfo, 0, sizeof(poolInfo));
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = uint32_t(frameCount * timestampsPerFrame);
+    VkResult err = devFuncs->vkCreateQueryPool(dev, &poolInfo, nullptr, &timestampPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create timestamp query pool: %d", err);
+
+    if (statistics) {
+        poolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        poolInfo.queryCount = uint32_t(frameCount * maxJobs);
+        poolInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+                                      | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+        err = devFuncs->vkCreateQueryPool(dev, &poolInfo, nullptr, &statsPool);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create pipeline statistics query pool: %d", err);
+    }
+
+    frameSlots.resize(frameCount);
+    for (Slot &slot : frameSlots)
+        slot.jobPass.fill(-1, maxJobs);
+}
+
+void GpuProfiler::destroy()
+{
+    if (!dev)
+        return;
+
+    if (timestampPool) {
+        devFuncs->vkDestroyQueryPool(dev, timestampPool, nullptr);
+        timestampPool = VK_NULL_HANDLE;
+    }
+    if (statsPool) {
+        devFuncs->vkDestroyQueryPool(dev, statsPool, nullptr);
+        statsPool = VK_NULL_HANDLE;
+    }
+    frameSlots.clear();
+    dev = VK_NULL_HANDLE;
+}
+
+void GpuProfiler::beginFrame(VkCommandBuffer cb, int frame, quint64 frameNumber)
+{
+    if (!isValid())
+        return;
+
+    Slot &slot = frameSlots[frame];
+    if (slot.pending)
+        fetch(frame);
+
+    slot.frameNumber = frameNumber;
+    slot.pending = true;
+    std::fill(std::begin(slot.passUsed), std::end(slot.passUsed), false);
+    slot.jobPass.fill(-1);
+
+    devFuncs->vkCmdResetQueryPool(cb, timestampPool, timestampIndex(frame, 0), uint32_t(timestampsPerFrame));
+    if (statsPool)
+        devFuncs->vkCmdResetQueryPool(cb, statsPool, uint32_t(frame * jobsPerFrame), uint32_t(jobsPerFrame));
+    beginPass(cb, frame, Frame);
+}
+
+void GpuProfiler::endFrame(VkCommandBuffer cb, int frame)
+{
+    endPass(cb, frame, Frame);
+}
+
+void GpuProfiler::beginPass(VkCommandBuffer cb, int frame, Pass pass)
+{
+    if (!isValid())
+        return;
+    Q_ASSERT(pass == Frame || pass == Cull);
+    frameSlots[frame].passUsed[pass] = true;
+    devFuncs->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, timestampIndex(frame, 2 * pass));
+}
+
+void GpuProfiler::endPass(VkCommandBuffer cb, int frame, Pass pass)
+{
+    if (!isValid())
+        return;
+    devFuncs->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, timestampIndex(frame, 2 * pass + 1));
+}
+
+void GpuProfiler::beginJob(VkCommandBuffer cb, int frame, int job, Pass pass)
+{
+    if (!isValid())
+        return;
+    // each job only touches its own entries
+    frameSlots[frame].jobPass[job] = pass;
+    devFuncs->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, timestampIndex(frame, 4 + 2 * job));
+    if (statsPool)
+        devFuncs->vkCmdBeginQuery(cb, statsPool, uint32_t(frame * jobsPerFrame + job), 0);
+}
+
+void GpuProfiler::endJob(VkCommandBuffer cb, int frame, int job)
+{
+    if (!isValid())
+        return;
+    if (statsPool)
+        devFuncs->vkCmdEndQuery(cb, statsPool, uint32_t(frame * jobsPerFrame + job));
+    devFuncs->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, timestampIndex(frame, 4 + 2 * job + 1));
+}
+
+// The fence of the slot has been waited for, so the results are there. No
+// WAIT flag all the same, a query that is not available just drops the frame.
+void GpuProfiler::fetch(int frame)
+{
+    Slot &slot = frameSlots[frame];
+    slot.pending = false;
+
+    FrameResult result;
+    result.frame = slot.frameNumber;
+    auto ns = [this](quint64 ticks) { return quint64(double(ticks & timestampMask) * timestampPeriod); };
+    auto range = [this, frame, &ns](int query, PassResult *pass) {
+        quint64 ts[2];
+        if (devFuncs->vkGetQueryPoolResults(dev, timestampPool, timestampIndex(frame, query), 2, sizeof(ts), ts,
+                                            sizeof(quint64), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+            return false;
+        pass->beginNs = ns(ts[0]);
+        pass->endNs = ns(ts[1]);
+        return true;
+    };
+
+    for (int pass : { Frame, Cull }) {
+        if (slot.passUsed[pass] && !range(2 * pass, &result.passes[pass]))
+            return;
+        result.passes[pass].valid = slot.passUsed[pass];
+    }
+
+    for (int job = 0; job < jobsPerFrame; ++job) {
+        const int pass = slot.jobPass[job];
+        if (pass < 0)
+            continue;
+        PassResult jobResult;
+        if (!range(4 + 2 * job, &jobResult))
+            return;
+        quint64 stats[STATS_PER_QUERY] = {};
+        if (statsPool && devFuncs->vkGetQueryPoolResults(dev, statsPool, uint32_t(frame * jobsPerFrame + job), 1,
+                                                         sizeof(stats), stats, sizeof(stats), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+            return;
+
+        // the jobs of a pass run one after another, so the pass spans all of them
+        PassResult &p = result.passes[pass];
+        p.beginNs = p.valid ? qMin(p.beginNs, jobResult.beginNs) : jobResult.beginNs;
+        p.endNs = p.valid ? qMax(p.endNs, jobResult.endNs) : jobResult.endNs;
+        p.vertexInvocations += stats[0];
+        p.fragmentInvocations += stats[1];
+        p.valid = true;
+    }
+
+    publish(result);
+}
+
+void GpuProfiler::publish(const FrameResult &result)
+{
+    QMutexLocker lock(&mutex);
+    if (history.size() < HISTORY_SIZE) {
+        history.append(result);
+    } else {
+        history[historyNext] = result;
+        historyNext = (historyNext + 1) % HISTORY_SIZE;
+    }
+}
+
+QString GpuProfiler::summary() const
+{
+    double ms[PassCount] = {};
+    quint64 vertices[PassCount] = {};
+    quint64 fragments[PassCount] = {};
+    int counts[PassCount] = {};
+    {
+        QMutexLocker lock(&mutex);
+        const int n = qMin(int(history.size()), SUMMARY_FRAMES);
+        for (int i = 0; i < n; ++i) {
+            // newest first
+            const int index = (historyNext - 1 - i + 2 * int(history.size())) % int(history.size());
+            const FrameResult &r = history[index];
+            for (int pass = 0; pass < PassCount; ++pass) {
+                if (!r.passes[pass].valid)
+                    continue;
+                ms[pass] += (r.passes[pass].endNs - r.passes[pass].beginNs) / 1000000.0;
+                vertices[pass] += r.passes[pass].vertexInvocations;
+                fragments[pass] += r.passes[pass].fragmentInvocations;
+                ++counts[pass];
+            }
+        }
+    }
+    if (!counts[Frame])
+        return QStringLiteral("No GPU timings yet");
+
+    QString s = QString("GPU, average of the last %1 frames\n").arg(counts[Frame]);
+    for (int pass = 0; pass < PassCount; ++pass) {
+        if (!counts[pass])
+            continue;
+        s += QString("%1 %2 ms").arg(QLatin1String(PASS_NAMES[pass]), -6).arg(ms[pass] / counts[pass], 8, 'f', 3);
+        if (hasStatistics() && (pass == Floor || pass == Items))
+            s += QString("  VS %1  FS %2").arg(vertices[pass] / counts[pass]).arg(fragments[pass] / counts[pass]);
+        s += '\n';
+    }
+    return s;
+}
+
+// Chrome's about:tracing / Perfetto format, one complete event per pass with
+// the GPU clock in microseconds.
+bool GpuProfiler::writeChromeTrace(const QString &fileName) const
+{
+    QJsonArray events;
+    {
+        QMutexLocker lock(&mutex);
+        for (int i = 0; i < history.size(); ++i) {
+            // oldest first
+            const FrameResult &r = history[(historyNext + i) % history.size()];
+            for (int pass = 0; pass < PassCount; ++pass) {
+                const PassResult &p = r.passes[pass];
+                if (!p.valid)
+                    continue;
+                QJsonObject args;
+                args["frame"] = qint64(r.frame);
+                if (hasStatistics() && (pass == Floor || pass == Items)) {
+                    args["vertexInvocations"] = qint64(p.vertexInvocations);
+                    args["fragmentInvocations"] = qint64(p.fragmentInvocations);
+                }
+                QJsonObject e;
+                e["name"] = PASS_NAMES[pass];
+                e["cat"] = "gpu";
+                e["ph"] = "X";
+                e["ts"] = p.beginNs / 1000.0;
+                e["dur"] = (p.endNs - p.beginNs) / 1000.0;
+                e["pid"] = 1;
+                // the frame on a track of its own, the passes nest below it
+                e["tid"] = pass == Frame ? 1 : 2;
+                e["args"] = args;
+                events.append(e);
+            }
+        }
+    }
+
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("Failed to open %s", qPrintable(fileName));
+        return false;
+    }
+    QJsonObject root;
+    root["traceEvents"] = events;
+    root["displayTimeUnit"] = "ms";
+    f.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    return f.commit();
+}
@@ -0,0 +1,90 @@
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include <QVulkanInstance>
+#include <QMutex>
+#include <QVector>
+
+class QVulkanDeviceFunctions;
+
+/**
+ * @brief Timestamp and pipeline statistics queries around the passes of a
+ * frame. Every frame slot has its own range of queries, the results of a slot
+ * are fetched when it comes around again, after the target has waited for its
+ * fence, so reading them never stalls. Passes recorded into several secondary
+ * command buffers get a pair of timestamps and a statistics query per job,
+ * which are merged into one entry per pass.
+*/
+class GpuProfiler
+{
+public:
+    enum Pass{Frame, Cull, Floor, Items, PassCount};
+
+    struct PassResult{
+        bool valid=false;
+        quint64 beginNs=0;//GPU clock
+        quint64 endNs=0;
+        quint64 vertexInvocations=0;//Floor and Items only, with statistics support
+        quint64 fragmentInvocations=0;
+    };
+    struct FrameResult{
+        quint64 frame=0;//Renderer frame counter
+        PassResult passes[PassCount];
+    };
+
+    GpuProfiler();
+
+    /**
+     * @param timestampValidBits of the queue the frames are submitted to, 0 disables the timestamps
+     * @param statistics whether the pipelineStatisticsQuery feature is enabled
+     * @param maxJobs secondary command buffers per frame at most
+    */
+    void create(QVulkanDeviceFunctions *f, VkDevice dev, const VkPhysicalDeviceProperties *props,
+                uint32_t timestampValidBits, bool statistics, int frameCount, int maxJobs);
+    void destroy();
+    bool isValid() const {return timestampPool!=VK_NULL_HANDLE;}
+    bool hasStatistics() const {return statsPool!=VK_NULL_HANDLE;}
+
+    //primary command buffer, outside of a render pass: fetch the results the
+    //slot holds from concurrentFrameCount frames ago and reset its queries
+    void beginFrame(VkCommandBuffer cb, int frame, quint64 frameNumber);
+    void endFrame(VkCommandBuffer cb, int frame);
+    //a pass recorded into the primary command buffer
+    void beginPass(VkCommandBuffer cb, int frame, Pass pass);
+    void endPass(VkCommandBuffer cb, int frame, Pass pass);
+    //a secondary command buffer, may be called from several threads for different jobs
+    void beginJob(VkCommandBuffer cb, int frame, int job, Pass pass);
+    void endJob(VkCommandBuffer cb, int frame, int job);
+
+    //safe to call from any thread
+    QString summary() const;
+    bool writeChromeTrace(const QString &fileName) const;
+
+private:
+    struct Slot{
+        quint64 frameNumber=0;
+        bool pending=false;//queries written, results not fetched yet
+        bool passUsed[PassCount]={};
+        QVector<int> jobPass;//Pass of every job, -1 if unused
+    };
+
+    uint32_t timestampIndex(int frame, int query) const {return uint32_t(frame * timestampsPerFrame + query);}
+    void fetch(int frame);
+    void publish(const FrameResult &result);
+
+    QVulkanDeviceFunctions *devFuncs=nullptr;
+    VkDevice dev=VK_NULL_HANDLE;
+    VkQueryPool timestampPool=VK_NULL_HANDLE;
+    VkQueryPool statsPool=VK_NULL_HANDLE;
+    int timestampsPerFrame=0;//frame and cull pairs, then one pair per job
+    int jobsPerFrame=0;
+    quint64 timestampMask=0;
+    double timestampPeriod=1;//ns per tick
+    QVector<Slot> frameSlots;
+
+    mutable QMutex mutex;
+    QVector<FrameResult> history;//ring of the last HISTORY_SIZE frames
+    int historyNext=0;
+};
+
+#endif // GPUPROFILER_H
@@ -0,0 +1,58 @@
+#include "inputqueue.h"
+#include <chrono>
+
+InputQueue::InputQueue() {}
+
+bool InputQueue::push(InputEvent::Type type, float value)
+{
+    return push({ type, value, now() });
+}
+
+bool InputQueue::push(const InputEvent &e)
+{
+    const quint32 h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == CAPACITY)
+        return false;
+    events[h & (CAPACITY - 1)] = e;
+    // publishes the event written above to the consumer
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+void InputQueue::post(InputEvent::Type type, float value)
+{
+    flush();
+    // behind a pending event of the same type, so that its order stays
+    if (!hasPending[type] && push(type, value))
+        return;
+    InputEvent &p = pending[type];
+    if (!hasPending[type])
+        p = { type, 0.0f, now() };
+    p.value = type == InputEvent::SpawnMesh ? value : p.value + value;
+    hasPending[type] = true;
+}
+
+void InputQueue::flush()
+{
+    for (int type = 0; type < InputEvent::TypeCount; ++type) {
+        if (hasPending[type] && push(pending[type]))
+            hasPending[type] = false;
+    }
+}
+
+bool InputQueue::pop(InputEvent *e)
+{
+    const quint32 t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+        return false;
+    *e = events[t & (CAPACITY - 1)];
+    // hands the slot back to the producer
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+qint64 InputQueue::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,54 @@
+#ifndef INPUTQUEUE_H
+#define INPUTQUEUE_H
+
+#include <QtGlobal>
+#include <atomic>
+
+struct InputEvent{
+    enum Type{Yaw,Pitch,Walk,Strafe,AddInstances,SpawnMesh,TypeCount};
+    Type type;
+    float value;
+    qint64 timestamp;//InputQueue::now() at the time of the push
+};
+
+/**
+ * @brief Lock-free single producer, single consumer ring of input events. The
+ * GUI thread pushes, the render worker drains it at the start of every frame,
+ * neither of them ever waits for the other. While the ring is full, post()
+ * folds the events into one pending event per type instead of dropping them.
+*/
+class InputQueue
+{
+public:
+    InputQueue();
+
+    //producer side, false if the queue is full
+    bool push(InputEvent::Type type, float value);
+    //producer side, never drops: the deltas of a type add up and the last
+    //SpawnMesh wins while the queue is full, until post() or flush() gets them in
+    void post(InputEvent::Type type, float value);
+    //producer side, moves the pending events into the queue as far as there is room
+    void flush();
+    //consumer side, false if the queue is empty
+    bool pop(InputEvent *e);
+
+    //monotonic clock of InputEvent::timestamp, in nanoseconds
+    static qint64 now();
+
+private:
+    bool push(const InputEvent &e);
+
+    static const quint32 CAPACITY=4096;//power of two
+
+    //producer only, timestamp of the first event folded in
+    InputEvent pending[InputEvent::TypeCount];
+    bool hasPending[InputEvent::TypeCount]={};
+
+    InputEvent events[CAPACITY];
+    //free running counters, head is only written by the producer and tail only
+    //by the consumer, kept on separate cache lines
+    alignas(64) std::atomic<quint32> head{0};
+    alignas(64) std::atomic<quint32> tail{0};
+};
+
+#endif // INPUTQUEUE_H
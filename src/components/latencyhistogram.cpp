@@ -0,0 +1,58 @@
+#include "latencyhistogram.h"
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::add(qint64 ns)
+{
+    ns = qMax(ns, qint64(0));
+    quint64 us = quint64(ns / 1000);
+    int bucket = 0;
+    while (us && bucket < BUCKET_COUNT - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    ++buckets[bucket];
+    ++samples;
+    totalNs += ns;
+    maxNs = qMax(maxNs, ns);
+}
+
+void LatencyHistogram::reset()
+{
+    std::fill(std::begin(buckets), std::end(buckets), 0);
+    samples = 0;
+    totalNs = 0;
+    maxNs = 0;
+}
+
+qint64 LatencyHistogram::percentile(double fraction) const
+{
+    if (!samples)
+        return 0;
+    const quint64 rank = qMax(quint64(1), quint64(fraction * samples + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return qMin((qint64(1) << i) * 1000, maxNs);
+    }
+    return maxNs;
+}
+
+QString LatencyHistogram::summary() const
+{
+    if (!samples)
+        return QStringLiteral("no samples");
+    QString s = QString::asprintf("%llu samples, mean %.2f ms, p50 <= %.2f ms, p95 <= %.2f ms, p99 <= %.2f ms, max %.2f ms\n",
+                                  (unsigned long long) samples, totalNs / 1e6 / samples,
+                                  percentile(0.5) / 1e6, percentile(0.95) / 1e6, percentile(0.99) / 1e6, maxNs / 1e6);
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        if (buckets[i])
+            s += QString::asprintf("  < %8lld us: %llu\n", qint64(1) << i, (unsigned long long) buckets[i]);
+    }
+    return s;
+}
@@ -0,0 +1,35 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QString>
+
+/**
+ * @brief Histogram with power of two buckets in microseconds, cheap enough to
+ * feed every frame. Percentiles are reported as the upper bound of the bucket
+ * they fall into.
+*/
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void add(qint64 ns);
+    void reset();
+
+    quint64 count() const {return samples;}
+    qint64 maximum() const {return maxNs;}
+    //upper bound of the bucket holding the given fraction of the samples, in ns
+    qint64 percentile(double fraction) const;
+    QString summary() const;
+
+private:
+    //bucket 0 holds everything below 1us, bucket i [2^(i-1), 2^i) us
+    static const int BUCKET_COUNT=32;
+
+    quint64 buckets[BUCKET_COUNT];
+    quint64 samples=0;
+    qint64 totalNs=0;
+    qint64 maxNs=0;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -1,59 +1,340 @@
 #include "mesh.h"
-#include <QtConcurrentRun>
+#include "meshindexer.h"
 #include <QFile>
+#include <QSaveFile>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <atomic>
 
-Mesh::Mesh() {}
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(Q_OS_MACOS)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
 
-void Mesh::load(const QString &fn){
-    reset();
-    maybeRunning = true;
+static const int HEADER_SIZE = 4 + 4 + 6 * 4;//format, vertexCount, aabb
+static const int INDEXED_HEADER_SIZE = HEADER_SIZE + 4 + 4;//format 2 adds indexCount, indexSize
+
+static std::atomic<bool> verboseLoading{false};
+
+static int headerSize(const MeshData &md){
+    return md.isIndexed() ? INDEXED_HEADER_SIZE : HEADER_SIZE;
+}
+
+//resident set size of the whole process in KB, and the part of it that is not
+//file backed where the system tells, -1 otherwise, used to compare the two load paths
+static qint64 residentKb(qint64 *privateKb){
+    *privateKb = -1;
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return qint64(pmc.WorkingSetSize / 1024);
+    return 0;
+#elif defined(Q_OS_MACOS)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+        return 0;
+    return qint64(info.resident_size / 1024);
+#else
+    //pages: size, resident, shared (file backed), ...
+    QFile statm("/proc/self/statm");
+    if(!statm.open(QIODevice::ReadOnly))
+        return 0;
+    const QList<QByteArray> pages = statm.readAll().split(' ');
+    if(pages.size() < 3)
+        return 0;
+    const qint64 pageKb = sysconf(_SC_PAGESIZE) / 1024;
+    *privateKb = (pages[1].toLongLong() - pages[2].toLongLong()) * pageKb;
+    return pages[1].toLongLong() * pageKb;
+#endif
+}
+
+//whether every index of md, stored at p, refers to one of its vertices
+static bool indicesInRange(const char *p, const MeshData &md){
+    quint32 largest = 0;
+    if(md.indexSize == 2){
+        for(int i = 0; i < md.indexCount; ++i){
+            quint16 index;
+            memcpy(&index, p + i * 2, 2);
+            largest = qMax<quint32>(largest, index);
+        }
+    }else{
+        for(int i = 0; i < md.indexCount; ++i){
+            quint32 index;
+            memcpy(&index, p + i * 4, 4);
+            largest = qMax(largest, index);
+        }
+    }
+    return largest < quint32(md.vertexCount);
+}
+
+/**
+ * @brief validate the .buf header and indices in place
+ * @return false if the header is malformed, the payload is truncated or an
+ * index is out of range
+*/
+static bool parseHeader(const char *p, qint64 size, MeshData *md, const QString &fn){
+    if(size < HEADER_SIZE){
+        qWarning("Truncated header in %s", qPrintable(fn));
+        return false;
+    }
+    quint32 format;
     /**
-     * @brief high-level multithread based on available threads in thread pool
-     * @param function/lambda
+     * @brief copy n bytes content start from source to destin
+     * @return void *destin
+     * @param void *destin
+     * @param void *source
+     * @param usigned n
     */
-    future=QtConcurrent::run([fn](){
-        MeshData md;
-        QFile infile(fn);
-        if(!infile.open(QIODevice::ReadOnly)){
-            qWarning("Failed to open %s", qPrintable(fn));
-            return md;
+    memcpy(&format,p,4);
+    if(format != 1 && format != 2){
+        qWarning("Invalid format in %s", qPrintable(fn));
+        return false;
+    }
+    int ofs = 4;//offset
+    memcpy(&md->vertexCount, p+ofs, 4);
+    ofs += 4;
+    memcpy(md->aabb,p+ofs,6 * 4);
+    ofs += 6 * 4;
+    if(format == 2){
+        if(size < INDEXED_HEADER_SIZE){
+            qWarning("Truncated header in %s", qPrintable(fn));
+            return false;
         }
-        QByteArray buf = infile.readAll();
-        const char *p = buf.constData();
-        quint32 format;
-        /**
-         * @brief copy n bytes content start from source to destin
-         * @return void *destin
-         * @param void *destin
-         * @param void *source
-         * @param usigned n
-        */
-        memcpy(&format,p,4);
-        if(format != 1){
-            qWarning("Invalid format in %s", qPrintable(fn));
-            return md;
-        }
-        int ofs = 4;//offset
-        memcpy(&md.vertexCount, p+ofs, 4);
+        memcpy(&md->indexCount, p+ofs, 4);
         ofs += 4;
-        memcpy(md.aabb,p+ofs,6 * 4);
-        ofs += 6 * 4;
-        const int byteCount = md.vertexCount * 8 * 4;
-        md.geom.resize(byteCount);//geom:x,y,z,u,v,nx,ny,nz
-        memcpy(md.geom.data(), p + ofs, byteCount);
+        memcpy(&md->indexSize, p+ofs, 4);
+        if(md->indexCount <= 0 || md->indexCount % 3 || (md->indexSize != 2 && md->indexSize != 4)){
+            qWarning("Invalid indices in %s", qPrintable(fn));
+            md->indexCount = md->indexSize = 0;
+            return false;
+        }
+    }
+    if(md->vertexCount <= 0 || size - headerSize(*md) < md->geomByteCount() + md->indexByteCount()){
+        qWarning("Invalid vertex count %d in %s", md->vertexCount, qPrintable(fn));
+        md->vertexCount = 0;
+        return false;
+    }
+    //the indices go to the GPU as they are, one past the vertices reads out of bounds there
+    if(md->isIndexed() && !indicesInRange(p + headerSize(*md) + md->geomByteCount(), *md)){
+        qWarning("Index out of range in %s", qPrintable(fn));
+        md->vertexCount = 0;
+        return false;
+    }
+    return true;
+}
+
+//legacy path: read the whole file, then copy the payload into MeshData::geom
+static MeshData loadCopy(const QString &fn){
+    MeshData md;
+    QFile infile(fn);
+    if(!infile.open(QIODevice::ReadOnly)){
+        qWarning("Failed to open %s", qPrintable(fn));
+        return md;
+    }
+    QByteArray buf = infile.readAll();
+    if(!parseHeader(buf.constData(), buf.size(), &md, fn))
+        return md;
+    const qint64 byteCount = md.geomByteCount();
+    md.geom.resize(byteCount);//geom:x,y,z,u,v,nx,ny,nz
+    memcpy(md.geom.data(), buf.constData() + headerSize(md), byteCount);
+    if(md.isIndexed()){
+        md.indices.resize(md.indexByteCount());
+        memcpy(md.indices.data(), buf.constData() + headerSize(md) + byteCount, md.indexByteCount());
+    }
+    return md;
+}
+
+//zero-copy path: map the file and hand out a pointer to the payload, the
+//consumer copies it straight into its destination (e.g. mapped Vulkan memory)
+static MeshData loadMapped(const QString &fn){
+    MeshData md;
+    QSharedPointer<QFile> infile(new QFile(fn));
+    if(!infile->open(QIODevice::ReadOnly)){
+        qWarning("Failed to open %s", qPrintable(fn));
+        return md;
+    }
+    const qint64 size = infile->size();
+    uchar *p = size >= HEADER_SIZE ? infile->map(0, size) : nullptr;
+    if(!p){
+        qWarning("Failed to map %s, falling back to reading it", qPrintable(fn));
+        return loadCopy(fn);
+    }
+    if(!parseHeader(reinterpret_cast<const char *>(p), size, &md, fn))
+        return md;
+    md.mappedFile = infile;
+    md.mapped = p + headerSize(md);
+    if(md.isIndexed())
+        md.mappedIndices = md.mapped + md.geomByteCount();
+    return md;
+}
+
+Mesh::Mesh() {}
+
+// Replaces the standard vertices with the given layout. Whatever still points
+// into the file mapping is copied first, the mapping is dropped afterwards.
+static void convertVertices(MeshData *md, VertexFormat::Id id){
+    if(!md->isValid() || md->vertexFormat == id)
+        return;
+    const VertexFormat &format = VertexFormat::get(id);
+    md->geom = format.encode(reinterpret_cast<const float *>(md->geomData()), md->vertexCount, md->aabb);
+    if(md->mappedIndices)
+        md->indices = QByteArray(md->indexData(), md->indexByteCount());
+    md->mapped = nullptr;
+    md->mappedIndices = nullptr;
+    md->mappedFile.reset();
+    md->vertexFormat = id;
+}
+
+void Mesh::load(const QString &fn, VertexFormat::Id vertexFormat, AssetManager::Priority priority){
+    reset();
+    // KEYFRAME_MESH_LOADER=copy selects the old readAll()+memcpy path, see
+    // benchmark() for how the two compare.
+    const bool copy = qgetenv("KEYFRAME_MESH_LOADER") == "copy";
+    //the same file in the same layout is only loaded once
+    const QString key = fn + QLatin1Char('#') + QLatin1String(VertexFormat::get(vertexFormat).name());
+    asset = AssetManager::instance()->request<MeshData>(key, priority, [fn, copy, vertexFormat](){
+        MeshData md = copy ? loadCopy(fn) : loadMapped(fn);
+        //flat triangle lists get welded and reordered here, convert them
+        //offline with bufindex to skip this
+        MeshIndexer::buildIndexed(&md, fn);
+        convertVertices(&md, vertexFormat);
         return md;
     });
 }
 
-MeshData *Mesh::data(){
-    //future.result() will block current thread until the function bind on it is completed
-    if(maybeRunning &&! meshData.isValid()) meshData = future.result();
-    return &meshData;
+void Mesh::setVerbose(bool verbose){
+    verboseLoading.store(verbose, std::memory_order_relaxed);
+}
+
+bool Mesh::isVerbose(){
+    return verboseLoading.load(std::memory_order_relaxed);
+}
+
+//reads a byte of every cache line, like copying the payload into a buffer does
+static void touch(const char *p, qint64 size){
+    static volatile uchar sink;
+    uchar sum = 0;
+    for(qint64 i = 0; i < size; i += 64)
+        sum += uchar(p[i]);
+    sink = sum;
+}
+
+// Every run loads the file, indexes it if it is a flat triangle list and reads
+// the payload as the upload would, with the process memory sampled around it.
+// The data is dropped between runs.
+void Mesh::benchmark(const QString &fn){
+    const int runs = 10;
+    for(bool copy : {false, true}){
+        qint64 totalNs = 0;
+        qint64 residentGrowth = 0;
+        qint64 privateGrowth = -1;
+        int vertexCount = 0;
+        int indexCount = 0;
+        for(int r = 0; r < runs; ++r){
+            qint64 privateBefore, privateAfter;
+            const qint64 before = residentKb(&privateBefore);
+            QElapsedTimer timer;
+            timer.start();
+            MeshData md = copy ? loadCopy(fn) : loadMapped(fn);
+            MeshIndexer::buildIndexed(&md, fn);
+            if(!md.isValid())
+                return;
+            touch(md.geomData(), md.geomByteCount());
+            touch(md.indexData(), md.indexByteCount());
+            totalNs += timer.nsecsElapsed();
+            const qint64 after = residentKb(&privateAfter);
+            residentGrowth = qMax(residentGrowth, after - before);
+            if(privateBefore >= 0)
+                privateGrowth = qMax(privateGrowth, privateAfter - privateBefore);
+            vertexCount = md.vertexCount;
+            indexCount = md.indexCount;
+        }
+        qDebug("Mesh load via %s: %s, %d vertices, %d indices in %.3f ms, resident set up to %lld KB larger, "
+               "%lld KB of it private",
+               copy ? "copy" : "map", qPrintable(fn), vertexCount, indexCount, totalNs / 1000000.0 / runs,
+               residentGrowth, privateGrowth);
+    }
+}
+
+bool Mesh::save(const QString &fn, const MeshData &md){
+    if(!md.isValid() || !md.isIndexed() || md.vertexFormat != VertexFormat::Standard){
+        qWarning("Only indexed meshes in the standard vertex format can be saved, %s not written", qPrintable(fn));
+        return false;
+    }
+    QByteArray header(INDEXED_HEADER_SIZE, Qt::Uninitialized);
+    char *p = header.data();
+    const quint32 format = 2;
+    memcpy(p, &format, 4);
+    memcpy(p + 4, &md.vertexCount, 4);
+    memcpy(p + 8, md.aabb, 6 * 4);
+    memcpy(p + HEADER_SIZE, &md.indexCount, 4);
+    memcpy(p + HEADER_SIZE + 4, &md.indexSize, 4);
+
+    QSaveFile f(fn);
+    if(!f.open(QIODevice::WriteOnly)
+        || f.write(header) != header.size()
+        || f.write(md.geomData(), md.geomByteCount()) != md.geomByteCount()
+        || f.write(md.indexData(), md.indexByteCount()) != md.indexByteCount()
+        || !f.commit()){
+        qWarning("Failed to write %s", qPrintable(fn));
+        return false;
+    }
+    return true;
+}
+
+MeshData Mesh::placeholder(VertexFormat::Id vertexFormat){
+    //outward normal and the two axes spanning each face, counter-clockwise seen from outside
+    static const float faces[6][9] = {
+        { 1, 0, 0,   0, 1, 0,   0, 0, 1},
+        {-1, 0, 0,   0, 1, 0,   0, 0,-1},
+        { 0, 1, 0,   0, 0, 1,   1, 0, 0},
+        { 0,-1, 0,   0, 0,-1,   1, 0, 0},
+        { 0, 0, 1,   1, 0, 0,   0, 1, 0},
+        { 0, 0,-1,  -1, 0, 0,   0, 1, 0}
+    };
+    static const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+
+    MeshData md;
+    md.vertexCount = 24;
+    md.geom.resize(md.geomByteCount());
+    float *v = reinterpret_cast<float *>(md.geom.data());
+    for(int f = 0; f < 6; ++f){
+        const float *n = faces[f], *s = faces[f] + 3, *t = faces[f] + 6;
+        for(int c = 0; c < 4; ++c){
+            for(int i = 0; i < 3; ++i)
+                *v++ = 0.5f * (n[i] + corners[c][0] * s[i] + corners[c][1] * t[i]);
+            *v++ = 0.5f * (corners[c][0] + 1.0f);
+            *v++ = 0.5f * (corners[c][1] + 1.0f);
+            for(int i = 0; i < 3; ++i)
+                *v++ = n[i];
+        }
+    }
+    md.indexCount = 36;
+    md.indexSize = 2;
+    md.indices.resize(md.indexByteCount());
+    quint16 *idx = reinterpret_cast<quint16 *>(md.indices.data());
+    for(quint16 f = 0; f < 6; ++f){
+        const quint16 quad[6] = {0, 1, 2, 0, 2, 3};
+        for(int i = 0; i < 6; ++i)
+            *idx++ = f * 4 + quad[i];
+    }
+    const float aabb[6] = {-0.5f, 0.5f, -0.5f, 0.5f, -0.5f, 0.5f};
+    memcpy(md.aabb, aabb, sizeof(aabb));
+    convertVertices(&md, vertexFormat);
+    return md;
+}
+
+const MeshData *Mesh::data(){
+    static const MeshData empty;
+    return asset.isNull() ? &empty : &asset.wait();
 }
 
 void Mesh::reset(){
-    //data() return the pointer of meshData, * dereference this pointer
-    //MeshData() create a empty data and assign it to meshData
-    *data() = MeshData();
-    maybeRunning = false;
+    //the data stays alive for whoever else holds a handle to it
+    asset.reset();
 }
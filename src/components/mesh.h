@@ -2,27 +2,59 @@
 #define MESH_H
 
 #include <QString>
-#include <QFuture>
+#include <QSharedPointer>
+#include "vertexformat.h"
+#include "assetmanager.h"
+
+class QFile;
 
 struct MeshData{
     bool isValid() const {return vertexCount>0;}
+    bool isIndexed() const {return indexCount>0;}
+    //vertex payload, either inside the mapped file or inside geom
+    const char *geomData() const {return mapped ? reinterpret_cast<const char *>(mapped) : geom.constData();}
+    qint64 geomByteCount() const {return qint64(vertexCount) * VertexFormat::get(vertexFormat).stride();}
+    //index payload, either inside the mapped file or inside indices
+    const char *indexData() const {return mappedIndices ? reinterpret_cast<const char *>(mappedIndices) : indices.constData();}
+    qint64 indexByteCount() const {return qint64(indexCount) * indexSize;}
     int vertexCount=0;
-    float aabb[6];
-    QByteArray geom;//x,y,z,u,v,nx,ny,nz
+    float aabb[6];//minX, maxX, minY, maxY, minZ, maxZ
+    QByteArray geom;//x,y,z,u,v,nx,ny,nz, left empty when the payload is served from the mapping
+    VertexFormat::Id vertexFormat=VertexFormat::Standard;//layout of the payload, files are always Standard
+    int indexCount=0;
+    int indexSize=0;//2 or 4 bytes per index, 0 when not indexed
+    QByteArray indices;//left empty when the payload is served from the mapping
+    QSharedPointer<QFile> mappedFile;//keeps the mapping alive for as long as the data is shared
+    const uchar *mapped=nullptr;
+    const uchar *mappedIndices=nullptr;
 };
 
 class Mesh
 {
 public:
     Mesh();
-    void load(const QString &fn);
-    MeshData *data();
+    //format 1 files are indexed while loading, format 2 files already are,
+    //the vertices are converted to vertexFormat at the end
+    void load(const QString &fn, VertexFormat::Id vertexFormat = VertexFormat::Standard,
+              AssetManager::Priority priority = AssetManager::Normal);
+    //write md as an indexed format 2 file, the vertices must be in the standard layout
+    static bool save(const QString &fn, const MeshData &md);
+    //unit cube to draw while a mesh is still loading
+    static MeshData placeholder(VertexFormat::Id vertexFormat = VertexFormat::Standard);
+    //blocks until loaded, the render thread goes through handle() instead
+    const MeshData *data();
     bool isValid(){return data()->isValid();}
+    const AssetHandle<MeshData> &handle() const {return asset;}
     void reset();
+    //log the indexing statistics of every mesh, off unless the renderer
+    //debugs or a tool asks for it
+    static void setVerbose(bool verbose);
+    static bool isVerbose();
+    //load fn through the mapped and the copying path and log the load time and
+    //how much the resident set grows, the private part is -1 where the system does not tell
+    static void benchmark(const QString &fn);
 private:
-    bool maybeRunning=false;
-    QFuture<MeshData> future;
-    MeshData meshData;
+    AssetHandle<MeshData> asset;
 };
 
 #endif // MESH_H
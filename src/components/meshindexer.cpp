@@ -0,0 +1,233 @@
+#include "meshindexer.h"
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <QDebug>
+#include <cstring>
+
+static const int FLOATS_PER_VERTEX = 8;//x,y,z,u,v,nx,ny,nz
+static const quint32 EMPTY_SLOT = 0xFFFFFFFFu;
+
+//FNV-1a over the raw bytes, vertices are only welded when bitwise identical
+static quint32 hashVertex(const float *v){
+    const uchar *p = reinterpret_cast<const uchar *>(v);
+    quint32 h = 2166136261u;
+    for(size_t i = 0; i < FLOATS_PER_VERTEX * sizeof(float); ++i)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// Only the input vertex of every distinct one is kept, the vertices
+// themselves stay where they are until optimizeVertexFetch() copies them.
+void MeshIndexer::weld(const float *vertices, int vertexCount, std::vector<quint32> *firsts, std::vector<quint32> *indices){
+    firsts->clear();
+    indices->resize(vertexCount);
+
+    // open addressing table of unique vertex indices, at most half full
+    quint32 tableSize = 1;
+    while(tableSize < quint32(vertexCount) * 2)
+        tableSize *= 2;
+    std::vector<quint32> table(tableSize, EMPTY_SLOT);
+
+    const size_t vertexBytes = FLOATS_PER_VERTEX * sizeof(float);
+    quint32 uniqueCount = 0;
+    for(int i = 0; i < vertexCount; ++i){
+        const float *v = vertices + size_t(i) * FLOATS_PER_VERTEX;
+        quint32 slot = hashVertex(v) & (tableSize - 1);
+        while(table[slot] != EMPTY_SLOT
+              && memcmp(vertices + size_t((*firsts)[table[slot]]) * FLOATS_PER_VERTEX, v, vertexBytes) != 0)
+            slot = (slot + 1) & (tableSize - 1);
+        if(table[slot] == EMPTY_SLOT){
+            table[slot] = uniqueCount++;
+            firsts->push_back(quint32(i));
+        }
+        (*indices)[i] = table[slot];
+    }
+}
+
+void MeshIndexer::optimizeVertexCache(quint32 *indices, int indexCount, int vertexCount, int cacheSize){
+    const int triangleCount = indexCount / 3;
+    if(!triangleCount)
+        return;
+
+    // triangles using every vertex, as offsets into one array
+    std::vector<int> adjacencyStart(vertexCount + 1, 0);
+    for(int i = 0; i < indexCount; ++i)
+        ++adjacencyStart[indices[i] + 1];
+    for(int v = 0; v < vertexCount; ++v)
+        adjacencyStart[v + 1] += adjacencyStart[v];
+    std::vector<int> adjacency(indexCount);
+    std::vector<int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for(int i = 0; i < indexCount; ++i)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> live(vertexCount);
+    for(int v = 0; v < vertexCount; ++v)
+        live[v] = adjacencyStart[v + 1] - adjacencyStart[v];
+
+    std::vector<int> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<int> deadEnd;
+    std::vector<int> candidates;
+    std::vector<quint32> output;
+    output.reserve(indexCount);
+
+    int time = cacheSize + 1;
+    int cursor = 1;
+    int fanning = 0;
+    while(fanning >= 0){
+        // emit all remaining triangles around the fanning vertex
+        candidates.clear();
+        for(int a = adjacencyStart[fanning]; a < adjacencyStart[fanning + 1]; ++a){
+            const int t = adjacency[a];
+            if(emitted[t])
+                continue;
+            emitted[t] = true;
+            for(int k = 0; k < 3; ++k){
+                const int v = int(indices[t * 3 + k]);
+                output.push_back(quint32(v));
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if(time - cacheTime[v] > cacheSize)
+                    cacheTime[v] = time++;
+            }
+        }
+
+        // the candidate that is still in the cache and stays there longest
+        // while its remaining triangles are emitted
+        int next = -1;
+        int bestPriority = -1;
+        for(int v : candidates){
+            if(live[v] <= 0)
+                continue;
+            int priority = 0;
+            if(time - cacheTime[v] + 2 * live[v] <= cacheSize)
+                priority = time - cacheTime[v];
+            if(priority > bestPriority){
+                bestPriority = priority;
+                next = v;
+            }
+        }
+
+        // otherwise go back to a recently used vertex, or the next one in input order
+        while(next < 0 && !deadEnd.empty()){
+            const int d = deadEnd.back();
+            deadEnd.pop_back();
+            if(live[d] > 0)
+                next = d;
+        }
+        while(next < 0 && cursor < vertexCount){
+            if(live[cursor] > 0)
+                next = cursor;
+            ++cursor;
+        }
+        fanning = next;
+    }
+
+    Q_ASSERT(int(output.size()) == triangleCount * 3);
+    memcpy(indices, output.data(), output.size() * sizeof(quint32));
+}
+
+int MeshIndexer::optimizeVertexFetch(const float *vertices, const std::vector<quint32> &firsts,
+                                     quint32 *indices, int indexCount, float *out){
+    std::vector<quint32> remap(firsts.size(), EMPTY_SLOT);
+    quint32 next = 0;
+    for(int i = 0; i < indexCount; ++i){
+        quint32 &r = remap[indices[i]];
+        if(r == EMPTY_SLOT){
+            r = next++;
+            memcpy(out + size_t(r) * FLOATS_PER_VERTEX, vertices + size_t(firsts[indices[i]]) * FLOATS_PER_VERTEX,
+                   FLOATS_PER_VERTEX * sizeof(float));
+        }
+        indices[i] = r;
+    }
+    return int(next);
+}
+
+int MeshIndexer::simulateVertexCache(const quint32 *indices, int indexCount, int vertexCount, int cacheSize){
+    // FIFO: a vertex is evicted after cacheSize further misses
+    std::vector<int> insertedAt(vertexCount, -1);
+    int misses = 0;
+    for(int i = 0; i < indexCount; ++i){
+        int &at = insertedAt[indices[i]];
+        if(at < 0 || misses - at >= cacheSize){
+            at = misses;
+            ++misses;
+        }
+    }
+    return misses;
+}
+
+bool MeshIndexer::buildIndexed(MeshData *md, const QString &name){
+    if(!md->isValid() || md->isIndexed() || md->vertexFormat != VertexFormat::Standard)
+        return md->isValid();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    const int inputCount = md->vertexCount;
+    const float *input = reinterpret_cast<const float *>(md->geomData());
+    std::vector<quint32> firsts;
+    std::vector<quint32> indices;
+    weld(input, inputCount, &firsts, &indices);
+    const int indexCount = int(indices.size());
+    const int weldedCount = int(firsts.size());
+    const int weldedInvocations = simulateVertexCache(indices.data(), indexCount, weldedCount, CACHE_SIZE);
+
+    optimizeVertexCache(indices.data(), indexCount, weldedCount, CACHE_SIZE);
+
+    // The vertices are copied from the input straight into a mapped
+    // temporary file, laid out like the payload of a format 2 file, so that
+    // apart from the index tables nothing of the mesh is on the heap. Only
+    // when no temporary file can be mapped do they go to the heap.
+    const int indexSize = weldedCount <= 0xFFFF ? 2 : 4;
+    const qint64 geomBytes = qint64(weldedCount) * FLOATS_PER_VERTEX * sizeof(float);
+    const qint64 indexBytes = qint64(indexCount) * indexSize;
+    QSharedPointer<QTemporaryFile> file(new QTemporaryFile);
+    uchar *out = nullptr;
+    if(file->open() && file->resize(geomBytes + indexBytes))
+        out = file->map(0, geomBytes + indexBytes);
+    QByteArray geom;
+    QByteArray indexBuf;
+    uchar *geomOut = out;
+    uchar *indexOut = out ? out + geomBytes : nullptr;
+    if(!out){
+        qWarning("Failed to map a temporary file for %s, indexing it on the heap", qPrintable(name));
+        file.reset();
+        geom.resize(geomBytes);
+        indexBuf.resize(indexBytes);
+        geomOut = reinterpret_cast<uchar *>(geom.data());
+        indexOut = reinterpret_cast<uchar *>(indexBuf.data());
+    }
+
+    const int vertexCount = optimizeVertexFetch(input, firsts, indices.data(), indexCount,
+                                                reinterpret_cast<float *>(geomOut));
+    Q_ASSERT(vertexCount == weldedCount);
+    const int optimizedInvocations = simulateVertexCache(indices.data(), indexCount, vertexCount, CACHE_SIZE);
+    if(indexSize == 2){
+        for(int i = 0; i < indexCount; ++i){
+            const quint16 index = quint16(indices[i]);
+            memcpy(indexOut + i * 2, &index, 2);
+        }
+    }else{
+        memcpy(indexOut, indices.data(), indexBytes);
+    }
+
+    // drops the input, mapped or read
+    md->geom = geom;
+    md->indices = indexBuf;
+    md->mappedFile = file;
+    md->mapped = file ? geomOut : nullptr;
+    md->mappedIndices = file ? indexOut : nullptr;
+    md->vertexCount = vertexCount;
+    md->indexCount = indexCount;
+    md->indexSize = indexSize;
+
+    // A non-indexed draw runs the vertex shader once per vertex.
+    if(Mesh::isVerbose())
+        qDebug("Indexed %s in %.3f ms: %d -> %d vertices, %d-bit indices, VS invocations %d -> %d welded -> %d optimized "
+               "(ACMR %.3f, cache size %d)",
+               qPrintable(name), timer.nsecsElapsed() / 1000000.0, inputCount, vertexCount, md->indexSize * 8,
+               inputCount, weldedInvocations, optimizedInvocations, optimizedInvocations / (indexCount / 3.0), CACHE_SIZE);
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef MESHINDEXER_H
+#define MESHINDEXER_H
+
+#include "mesh.h"
+#include <vector>
+
+/**
+ * @brief Turns the flat triangle lists of format 1 .buf files into indexed
+ * geometry: identical vertices are welded, the triangles are reordered for the
+ * post-transform vertex cache (Tipsify) and the vertices for fetch locality.
+*/
+class MeshIndexer
+{
+public:
+    //cache size the triangle order is optimized for and the statistics are simulated with
+    static const int CACHE_SIZE = 32;
+
+    //index and optimize md in place, the result is served from a mapped temporary file,
+    //logs the vertex shader invocations before and after if Mesh::isVerbose()
+    static bool buildIndexed(MeshData *md, const QString &name);
+
+    //distinct vertices of a triangle list of 8 floats per vertex as the input vertex
+    //each first appears at, one index per input vertex
+    static void weld(const float *vertices, int vertexCount, std::vector<quint32> *firsts, std::vector<quint32> *indices);
+    //Tipsify (Sander et al. 2007), reorders the triangles in place
+    static void optimizeVertexCache(quint32 *indices, int indexCount, int vertexCount, int cacheSize);
+    //renumber the welded vertices in the order of first use and copy them from the
+    //input vertices to out in that order, returns the new vertex count
+    static int optimizeVertexFetch(const float *vertices, const std::vector<quint32> &firsts,
+                                   quint32 *indices, int indexCount, float *out);
+    //vertex shader invocations of an indexed draw with a FIFO cache of the given size
+    static int simulateVertexCache(const quint32 *indices, int indexCount, int vertexCount, int cacheSize);
+};
+
+#endif // MESHINDEXER_H
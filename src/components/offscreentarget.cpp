@@ -0,0 +1,610 @@
+#include "offscreentarget.h"
+#include "renderer.h"
+#include "frameencoder.h"
+#include <QVulkanFunctions>
+#include <QImage>
+
+// Frames in flight, and with that readback buffers. One more than
+// QVulkanWindow's default, so that the GPU stays busy while the oldest frame
+// is copied out.
+static const int FRAME_SLOT_COUNT = 3;
+
+OffscreenTarget::OffscreenTarget(QVulkanInstance *instance, const QSize &sz, bool dbg, QObject *parent)
+    : QObject(parent),
+    inst(instance),
+    size(sz),
+    debug(dbg)
+{
+    memset(&physDevProps, 0, sizeof(physDevProps));
+    memset(&memProps, 0, sizeof(memProps));
+}
+
+OffscreenTarget::~OffscreenTarget()
+{
+    release();
+}
+
+bool OffscreenTarget::start(int instanceCount, int count, FrameEncoder *frameEncoder)
+{
+    if (!createDevice())
+        return false;
+
+    encoder = frameEncoder;
+    frameCount = count;
+    submittedCount = collectedCount = 0;
+
+    // Same order of calls as QVulkanWindow makes them.
+    renderer = new Renderer(this, instanceCount);
+    renderer->preInitResources();
+    depthFormat = findDepthFormat();
+    createRenderPass();
+    createSlots();
+    createQueryPool();
+    renderer->initResources();
+    renderer->initSwapChainResources();
+    // Exported frames must not show the placeholder mesh or clear-only frames.
+    renderer->waitForAssets();
+
+    if (debug)
+        qDebug("Rendering %d frames of %dx%d offscreen on %s", frameCount, size.width(), size.height(),
+               physDevProps.deviceName);
+    requestUpdate();
+    return true;
+}
+
+bool OffscreenTarget::createDevice()
+{
+    QVulkanFunctions *f = inst->functions();
+
+    uint32_t count = 0;
+    f->vkEnumeratePhysicalDevices(inst->vkInstance(), &count, nullptr);
+    if (!count) {
+        qWarning("No Vulkan physical device");
+        return false;
+    }
+    QVector<VkPhysicalDevice> physDevs(count);
+    f->vkEnumeratePhysicalDevices(inst->vkInstance(), &count, physDevs.data());
+    // the same variable QVulkanWindow picks the device by
+    int index = qEnvironmentVariableIntValue("QT_VK_PHYSICAL_DEVICE_INDEX");
+    if (index < 0 || index >= int(count))
+        index = 0;
+    physDev = physDevs[index];
+    f->vkGetPhysicalDeviceProperties(physDev, &physDevProps);
+    f->vkGetPhysicalDeviceMemoryProperties(physDev, &memProps);
+
+    uint32_t familyCount = 0;
+    f->vkGetPhysicalDeviceQueueFamilyProperties(physDev, &familyCount, nullptr);
+    QVector<VkQueueFamilyProperties> families(familyCount);
+    f->vkGetPhysicalDeviceQueueFamilyProperties(physDev, &familyCount, families.data());
+    queueFamilyIndex = UINT32_MAX;
+    for (uint32_t i = 0; i < familyCount; ++i) {
+        if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            queueFamilyIndex = i;
+            break;
+        }
+    }
+    if (queueFamilyIndex == UINT32_MAX) {
+        qWarning("No graphics queue on %s", physDevProps.deviceName);
+        return false;
+    }
+    const uint32_t validBits = families[queueFamilyIndex].timestampValidBits;
+    timestampMask = validBits >= 64 ? ~quint64(0) : (quint64(1) << validBits) - 1;
+
+    const float priority = 0;
+    VkDeviceQueueCreateInfo queueInfo;
+    memset(&queueInfo, 0, sizeof(queueInfo));
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = queueFamilyIndex;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &priority;
+
+    // No swapchain, so no extensions. The features are what QVulkanWindow
+    // enables, everything supported but robust buffer access.
+    VkPhysicalDeviceFeatures features;
+    f->vkGetPhysicalDeviceFeatures(physDev, &features);
+    features.robustBufferAccess = VK_FALSE;
+    VkDeviceCreateInfo devInfo;
+    memset(&devInfo, 0, sizeof(devInfo));
+    devInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    devInfo.queueCreateInfoCount = 1;
+    devInfo.pQueueCreateInfos = &queueInfo;
+    devInfo.pEnabledFeatures = &features;
+    VkResult err = f->vkCreateDevice(physDev, &devInfo, nullptr, &dev);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create device: %d", err);
+        return false;
+    }
+    devFuncs = inst->deviceFunctions(dev);
+    devFuncs->vkGetDeviceQueue(dev, queueFamilyIndex, 0, &queue);
+
+    // Like QVulkanWindow: host visible and coherent, cached if possible, and
+    // the first device local type.
+    hostVisibleMemIndex = memoryType(UINT32_MAX, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                     | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    if (hostVisibleMemIndex == UINT32_MAX)
+        hostVisibleMemIndex = memoryType(UINT32_MAX, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    deviceLocalMemIndex = memoryType(UINT32_MAX, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (hostVisibleMemIndex == UINT32_MAX || deviceLocalMemIndex == UINT32_MAX)
+        qFatal("No suitable memory types on %s", physDevProps.deviceName);
+    return true;
+}
+
+uint32_t OffscreenTarget::memoryType(uint32_t typeBits, VkMemoryPropertyFlags flags) const
+{
+    for (uint32_t i = 0; i < memProps.memoryTypeCount; ++i) {
+        if ((typeBits & (1u << i)) && (memProps.memoryTypes[i].propertyFlags & flags) == flags)
+            return i;
+    }
+    return UINT32_MAX;
+}
+
+VkFormat OffscreenTarget::findDepthFormat() const
+{
+    const VkFormat candidates[] = {
+        VK_FORMAT_D24_UNORM_S8_UINT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_D16_UNORM_S8_UINT
+    };
+    for (VkFormat format : candidates) {
+        VkFormatProperties props;
+        inst->functions()->vkGetPhysicalDeviceFormatProperties(physDev, format, &props);
+        if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+            return format;
+    }
+    qFatal("No depth-stencil format on %s", physDevProps.deviceName);
+    return VK_FORMAT_UNDEFINED;
+}
+
+QList<int> OffscreenTarget::supportedSampleCounts()
+{
+    const VkSampleCountFlags counts = physDevProps.limits.framebufferColorSampleCounts
+                                      & physDevProps.limits.framebufferDepthSampleCounts;
+    QList<int> result;
+    for (int c = 1; c <= 64; c *= 2) {
+        if (counts & VkSampleCountFlags(c))
+            result.append(c);
+    }
+    return result;
+}
+
+void OffscreenTarget::setSampleCount(int count)
+{
+    if (!supportedSampleCounts().contains(count)) {
+        qWarning("Unsupported sample count %d", count);
+        return;
+    }
+    // the flag bits are the counts themselves
+    sampleCount = VkSampleCountFlagBits(count);
+}
+
+QMatrix4x4 OffscreenTarget::clipCorrectionMatrix()
+{
+    // Y down and Z in [0, 1], the same as QVulkanWindow applies.
+    return QMatrix4x4(1.0f, 0.0f, 0.0f, 0.0f,
+                      0.0f, -1.0f, 0.0f, 0.0f,
+                      0.0f, 0.0f, 0.5f, 0.5f,
+                      0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+// Attachments in the order of QVulkanWindow's default render pass, color,
+// depth, and the multisample color resolved into the first, so that the
+// Renderer's clear values and pipelines fit either. The single sample color
+// ends up ready for the readback copy.
+void OffscreenTarget::createRenderPass()
+{
+    const bool msaa = sampleCount > VK_SAMPLE_COUNT_1_BIT;
+
+    VkAttachmentDescription attDesc[3];
+    memset(attDesc, 0, sizeof(attDesc));
+    attDesc[0].format = colorFormat;
+    attDesc[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attDesc[0].loadOp = msaa ? VK_ATTACHMENT_LOAD_OP_DONT_CARE : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attDesc[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attDesc[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attDesc[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attDesc[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attDesc[0].finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+    attDesc[1].format = depthFormat;
+    attDesc[1].samples = sampleCount;
+    attDesc[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attDesc[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attDesc[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attDesc[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attDesc[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attDesc[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    attDesc[2].format = colorFormat;
+    attDesc[2].samples = sampleCount;
+    attDesc[2].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attDesc[2].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attDesc[2].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attDesc[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attDesc[2].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attDesc[2].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colorRef = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference dsRef = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference msaaRef = { 2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+
+    VkSubpassDescription subpassDesc;
+    memset(&subpassDesc, 0, sizeof(subpassDesc));
+    subpassDesc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpassDesc.colorAttachmentCount = 1;
+    subpassDesc.pColorAttachments = msaa ? &msaaRef : &colorRef;
+    subpassDesc.pResolveAttachments = msaa ? &colorRef : nullptr;
+    subpassDesc.pDepthStencilAttachment = &dsRef;
+
+    // The attachments of a slot are only reused after its fence, what needs
+    // ordering is the render pass against the readback copy that follows.
+    VkSubpassDependency dependency;
+    memset(&dependency, 0, sizeof(dependency));
+    dependency.srcSubpass = 0;
+    dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    VkRenderPassCreateInfo rpInfo;
+    memset(&rpInfo, 0, sizeof(rpInfo));
+    rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rpInfo.attachmentCount = msaa ? 3 : 2;
+    rpInfo.pAttachments = attDesc;
+    rpInfo.subpassCount = 1;
+    rpInfo.pSubpasses = &subpassDesc;
+    rpInfo.dependencyCount = 1;
+    rpInfo.pDependencies = &dependency;
+    VkResult err = devFuncs->vkCreateRenderPass(dev, &rpInfo, nullptr, &renderPass);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create render pass: %d", err);
+}
+
+void OffscreenTarget::createQueryPool()
+{
+    if (!timestampMask) {
+        qWarning("No timestamps on the graphics queue of %s, GPU times are not measured", physDevProps.deviceName);
+        return;
+    }
+    VkQueryPoolCreateInfo poolInfo;
+    memset(&poolInfo, 0, sizeof(poolInfo));
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = uint32_t(2 * frameSlots.size());
+    VkResult err = devFuncs->vkCreateQueryPool(dev, &poolInfo, nullptr, &queryPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create query pool: %d", err);
+}
+
+void OffscreenTarget::createImage(Image *img, VkFormat format, VkSampleCountFlagBits samples,
+                                  VkImageUsageFlags usage, VkImageAspectFlags aspect)
+{
+    VkImageCreateInfo imageInfo;
+    memset(&imageInfo, 0, sizeof(imageInfo));
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = uint32_t(size.width());
+    imageInfo.extent.height = uint32_t(size.height());
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = samples;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = usage;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkResult err = devFuncs->vkCreateImage(dev, &imageInfo, nullptr, &img->image);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create image: %d", err);
+
+    VkMemoryRequirements memReq;
+    devFuncs->vkGetImageMemoryRequirements(dev, img->image, &memReq);
+    VkMemoryAllocateInfo memAllocInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        nullptr,
+        memReq.size,
+        memoryType(memReq.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &img->mem);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate image memory: %d", err);
+    err = devFuncs->vkBindImageMemory(dev, img->image, img->mem, 0);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind image memory: %d", err);
+
+    VkImageViewCreateInfo viewInfo;
+    memset(&viewInfo, 0, sizeof(viewInfo));
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = img->image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.layerCount = 1;
+    err = devFuncs->vkCreateImageView(dev, &viewInfo, nullptr, &img->view);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create image view: %d", err);
+}
+
+void OffscreenTarget::destroyImage(Image *img)
+{
+    if (img->view)
+        devFuncs->vkDestroyImageView(dev, img->view, nullptr);
+    if (img->image)
+        devFuncs->vkDestroyImage(dev, img->image, nullptr);
+    if (img->mem)
+        devFuncs->vkFreeMemory(dev, img->mem, nullptr);
+    *img = Image();
+}
+
+void OffscreenTarget::createSlots()
+{
+    const bool msaa = sampleCount > VK_SAMPLE_COUNT_1_BIT;
+    const VkDeviceSize readbackSize = VkDeviceSize(size.width()) * size.height() * 4;
+
+    frameSlots.resize(FRAME_SLOT_COUNT);
+    for (Slot &slot : frameSlots) {
+        createImage(&slot.color, colorFormat, VK_SAMPLE_COUNT_1_BIT,
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+        if (msaa)
+            createImage(&slot.msaaColor, colorFormat, sampleCount,
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+        createImage(&slot.depth, depthFormat, sampleCount,
+                    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                    VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT);
+
+        const VkImageView views[3] = { slot.color.view, slot.depth.view, slot.msaaColor.view };
+        VkFramebufferCreateInfo fbInfo;
+        memset(&fbInfo, 0, sizeof(fbInfo));
+        fbInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fbInfo.renderPass = renderPass;
+        fbInfo.attachmentCount = msaa ? 3 : 2;
+        fbInfo.pAttachments = views;
+        fbInfo.width = uint32_t(size.width());
+        fbInfo.height = uint32_t(size.height());
+        fbInfo.layers = 1;
+        VkResult err = devFuncs->vkCreateFramebuffer(dev, &fbInfo, nullptr, &slot.framebuffer);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create framebuffer: %d", err);
+
+        VkCommandPoolCreateInfo poolInfo;
+        memset(&poolInfo, 0, sizeof(poolInfo));
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = queueFamilyIndex;
+        err = devFuncs->vkCreateCommandPool(dev, &poolInfo, nullptr, &slot.cmdPool);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create command pool: %d", err);
+
+        VkCommandBufferAllocateInfo cmdBufInfo = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, slot.cmdPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1
+        };
+        err = devFuncs->vkAllocateCommandBuffers(dev, &cmdBufInfo, &slot.cmdBuf);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate command buffer: %d", err);
+
+        // signaled, the first wait for a slot returns right away
+        VkFenceCreateInfo fenceInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, VK_FENCE_CREATE_SIGNALED_BIT };
+        err = devFuncs->vkCreateFence(dev, &fenceInfo, nullptr, &slot.fence);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create fence: %d", err);
+
+        VkBufferCreateInfo bufInfo;
+        memset(&bufInfo, 0, sizeof(bufInfo));
+        bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufInfo.size = readbackSize;
+        bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &slot.readbackBuf);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create readback buffer: %d", err);
+
+        VkMemoryRequirements memReq;
+        devFuncs->vkGetBufferMemoryRequirements(dev, slot.readbackBuf, &memReq);
+        VkMemoryAllocateInfo memAllocInfo = {
+            VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            nullptr,
+            memReq.size,
+            hostVisibleMemIndex
+        };
+        err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &slot.readbackMem);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate readback memory: %d", err);
+        err = devFuncs->vkBindBufferMemory(dev, slot.readbackBuf, slot.readbackMem, 0);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to bind readback buffer memory: %d", err);
+        quint8 *p;
+        err = devFuncs->vkMapMemory(dev, slot.readbackMem, 0, readbackSize, 0, reinterpret_cast<void **>(&p));
+        if (err != VK_SUCCESS)
+            qFatal("Failed to map readback memory: %d", err);
+        slot.readback = p;
+    }
+    current = 0;
+}
+
+void OffscreenTarget::destroySlots()
+{
+    for (Slot &slot : frameSlots) {
+        if (slot.readbackMem)
+            devFuncs->vkFreeMemory(dev, slot.readbackMem, nullptr);
+        if (slot.readbackBuf)
+            devFuncs->vkDestroyBuffer(dev, slot.readbackBuf, nullptr);
+        if (slot.fence)
+            devFuncs->vkDestroyFence(dev, slot.fence, nullptr);
+        if (slot.cmdPool)
+            devFuncs->vkDestroyCommandPool(dev, slot.cmdPool, nullptr);
+        if (slot.framebuffer)
+            devFuncs->vkDestroyFramebuffer(dev, slot.framebuffer, nullptr);
+        destroyImage(&slot.color);
+        destroyImage(&slot.msaaColor);
+        destroyImage(&slot.depth);
+    }
+    frameSlots.clear();
+}
+
+void OffscreenTarget::requestUpdate()
+{
+    if (updateQueued || submittedCount >= frameCount)
+        return;
+    updateQueued = true;
+    QMetaObject::invokeMethod(this, &OffscreenTarget::beginFrame, Qt::QueuedConnection);
+}
+
+void OffscreenTarget::beginFrame()
+{
+    updateQueued = false;
+    if (inFrame || !renderer || submittedCount >= frameCount)
+        return;
+
+    Slot &slot = frameSlots[current];
+    devFuncs->vkWaitForFences(dev, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+    if (slot.frameIndex >= 0)
+        collect(slot);
+    devFuncs->vkResetFences(dev, 1, &slot.fence);
+    devFuncs->vkResetCommandPool(dev, slot.cmdPool, 0);
+
+    VkCommandBufferBeginInfo beginInfo;
+    memset(&beginInfo, 0, sizeof(beginInfo));
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult err = devFuncs->vkBeginCommandBuffer(slot.cmdBuf, &beginInfo);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to begin frame command buffer: %d", err);
+
+    if (queryPool) {
+        devFuncs->vkCmdResetQueryPool(slot.cmdBuf, queryPool, uint32_t(2 * current), 2);
+        devFuncs->vkCmdWriteTimestamp(slot.cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, uint32_t(2 * current));
+    }
+
+    if (frameStarted)
+        frameStarted(submittedCount);
+    inFrame = true;
+    frameTimer.start();
+    renderer->startNextFrame();
+}
+
+void OffscreenTarget::frameReady()
+{
+    Q_ASSERT(inFrame);
+    inFrame = false;
+    Slot &slot = frameSlots[current];
+    slot.recordNs = frameTimer.nsecsElapsed();
+
+    if (encoder)
+        recordReadback(slot);
+    if (queryPool)
+        devFuncs->vkCmdWriteTimestamp(slot.cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, uint32_t(2 * current + 1));
+
+    frameTimer.restart();
+    VkResult err = devFuncs->vkEndCommandBuffer(slot.cmdBuf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end frame command buffer: %d", err);
+
+    VkSubmitInfo submitInfo;
+    memset(&submitInfo, 0, sizeof(submitInfo));
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &slot.cmdBuf;
+    err = devFuncs->vkQueueSubmit(queue, 1, &submitInfo, slot.fence);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to submit frame: %d", err);
+    slot.submitNs = frameTimer.nsecsElapsed();
+
+    slot.frameIndex = submittedCount++;
+    current = (current + 1) % int(frameSlots.size());
+
+    if (submittedCount == frameCount)
+        QMetaObject::invokeMethod(this, &OffscreenTarget::shutdown, Qt::QueuedConnection);
+}
+
+void OffscreenTarget::recordReadback(Slot &slot)
+{
+    VkBufferImageCopy region;
+    memset(&region, 0, sizeof(region));
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = uint32_t(size.width());
+    region.imageExtent.height = uint32_t(size.height());
+    region.imageExtent.depth = 1;
+    devFuncs->vkCmdCopyImageToBuffer(slot.cmdBuf, slot.color.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                     slot.readbackBuf, 1, &region);
+
+    VkBufferMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = slot.readbackBuf;
+    barrier.size = VK_WHOLE_SIZE;
+    devFuncs->vkCmdPipelineBarrier(slot.cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                                   0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+// The slot's fence has signaled.
+void OffscreenTarget::collect(Slot &slot)
+{
+    if (frameTimed) {
+        FrameTimes times = { slot.frameIndex, slot.recordNs, slot.submitNs, -1 };
+        const int slotIndex = int(&slot - frameSlots.data());
+        quint64 ts[2];
+        if (queryPool && devFuncs->vkGetQueryPoolResults(dev, queryPool, uint32_t(2 * slotIndex), 2, sizeof(ts), ts,
+                                                         sizeof(quint64), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            const quint64 ticks = ((ts[1] & timestampMask) - (ts[0] & timestampMask)) & timestampMask;
+            times.gpuNs = qint64(double(ticks) * physDevProps.limits.timestampPeriod);
+        }
+        frameTimed(times);
+    }
+
+    if (encoder) {
+        // The encoder may take its time, the readback buffer is needed again
+        // in a moment.
+        QImage image(size, QImage::Format_RGBA8888);
+        const qsizetype rowBytes = qsizetype(size.width()) * 4;
+        for (int y = 0; y < size.height(); ++y)
+            memcpy(image.scanLine(y), slot.readback + y * rowBytes, size_t(rowBytes));
+        encoder->encode(slot.frameIndex, image);
+    }
+    slot.frameIndex = -1;
+    ++collectedCount;
+}
+
+void OffscreenTarget::shutdown()
+{
+    release();
+    emit finished();
+}
+
+void OffscreenTarget::release()
+{
+    if (!dev)
+        return;
+
+    devFuncs->vkDeviceWaitIdle(dev);
+    // oldest first, current is the slot submitted longest ago
+    for (int i = 0; i < frameSlots.size(); ++i) {
+        Slot &slot = frameSlots[(current + i) % frameSlots.size()];
+        if (slot.frameIndex >= 0)
+            collect(slot);
+    }
+
+    if (renderer) {
+        renderer->releaseSwapChainResources();
+        renderer->releaseResources();
+        delete renderer;
+        renderer = nullptr;
+    }
+
+    destroySlots();
+    if (queryPool) {
+        devFuncs->vkDestroyQueryPool(dev, queryPool, nullptr);
+        queryPool = VK_NULL_HANDLE;
+    }
+    if (renderPass) {
+        devFuncs->vkDestroyRenderPass(dev, renderPass, nullptr);
+        renderPass = VK_NULL_HANDLE;
+    }
+    devFuncs->vkDestroyDevice(dev, nullptr);
+    inst->resetDeviceFunctions(dev);
+    dev = VK_NULL_HANDLE;
+    devFuncs = nullptr;
+}
@@ -0,0 +1,148 @@
+#ifndef OFFSCREENTARGET_H
+#define OFFSCREENTARGET_H
+
+#include <QObject>
+#include <QVector>
+#include <QElapsedTimer>
+#include <functional>
+#include "rendertarget.h"
+
+class Renderer;
+class FrameEncoder;
+class QVulkanDeviceFunctions;
+
+/**
+ * @brief Drives a Renderer without a window: frames are rendered into
+ * offscreen images on a device of its own, so no surface or swapchain is
+ * involved. Every frame slot has a host-visible readback buffer the image is
+ * copied into at the end of the frame, the copy is picked up when the slot
+ * comes around again, which keeps the GPU concurrentFrameCount() frames ahead
+ * of the readback. The pixels go to a FrameEncoder, the timings of every
+ * frame, GPU time from timestamp queries included, to a callback.
+*/
+class OffscreenTarget : public QObject, public RenderTarget
+{
+    Q_OBJECT
+
+public:
+    OffscreenTarget(QVulkanInstance *inst, const QSize &size, bool dbg, QObject *parent = nullptr);
+    ~OffscreenTarget();
+
+    struct FrameTimes{
+        int frameIndex;
+        qint64 recordNs;//startNextFrame() until frameReady()
+        qint64 submitNs;//ending and submitting the command buffer
+        qint64 gpuNs;//between timestamps around the frame, -1 without timestamp support
+    };
+    //called right before a frame is started, e.g. to post input for it
+    void setFrameStartCallback(std::function<void(int frameIndex)> callback) {frameStarted = std::move(callback);}
+    //called once the GPU has completed a frame, in frame order
+    void setFrameTimesCallback(std::function<void(const FrameTimes &)> callback) {frameTimed = std::move(callback);}
+
+    //render frameCount frames with instanceCount instances and hand them to
+    //encoder, or only time them without one, finished() is emitted once all
+    //of them have completed
+    bool start(int instanceCount, int frameCount, FrameEncoder *encoder);
+    int renderedCount() const {return collectedCount;}
+    Renderer *frameRenderer() const {return renderer;}
+
+    // RenderTarget
+    QVulkanInstance *vulkanInstance() const override {return inst;}
+    VkPhysicalDevice physicalDevice() const override {return physDev;}
+    VkDevice device() const override {return dev;}
+    const VkPhysicalDeviceProperties *physicalDeviceProperties() const override {return &physDevProps;}
+    VkQueue graphicsQueue() const override {return queue;}
+    uint32_t graphicsQueueFamilyIndex() const override {return queueFamilyIndex;}
+    uint32_t hostVisibleMemoryIndex() const override {return hostVisibleMemIndex;}
+    uint32_t deviceLocalMemoryIndex() const override {return deviceLocalMemIndex;}
+    QList<int> supportedSampleCounts() override;
+    void setSampleCount(int sampleCount) override;
+    VkSampleCountFlagBits sampleCountFlagBits() const override {return sampleCount;}
+    VkRenderPass defaultRenderPass() const override {return renderPass;}
+    QMatrix4x4 clipCorrectionMatrix() override;
+    int concurrentFrameCount() const override {return int(frameSlots.size());}
+    int currentFrame() const override {return current;}
+    VkCommandBuffer currentCommandBuffer() const override {return frameSlots[current].cmdBuf;}
+    VkFramebuffer currentFramebuffer() const override {return frameSlots[current].framebuffer;}
+    QSize swapChainImageSize() const override {return size;}
+    void frameReady() override;
+    void requestUpdate() override;
+    bool isDebugEnabled() const override {return debug;}
+
+signals:
+    void finished();
+
+private:
+    struct Image{
+        VkImage image=VK_NULL_HANDLE;
+        VkDeviceMemory mem=VK_NULL_HANDLE;
+        VkImageView view=VK_NULL_HANDLE;
+    };
+    struct Slot{
+        Image color;//single sample, the one read back
+        Image msaaColor;
+        Image depth;
+        VkFramebuffer framebuffer=VK_NULL_HANDLE;
+        VkCommandPool cmdPool=VK_NULL_HANDLE;
+        VkCommandBuffer cmdBuf=VK_NULL_HANDLE;
+        VkFence fence=VK_NULL_HANDLE;
+        VkBuffer readbackBuf=VK_NULL_HANDLE;
+        VkDeviceMemory readbackMem=VK_NULL_HANDLE;
+        const quint8 *readback=nullptr;//persistently mapped
+        int frameIndex=-1;//frame waiting in readbackBuf, -1 if none
+        qint64 recordNs=0;
+        qint64 submitNs=0;
+    };
+
+    bool createDevice();
+    uint32_t memoryType(uint32_t typeBits, VkMemoryPropertyFlags flags) const;
+    VkFormat findDepthFormat() const;
+    void createRenderPass();
+    void createQueryPool();
+    void createImage(Image *img, VkFormat format, VkSampleCountFlagBits samples,
+                     VkImageUsageFlags usage, VkImageAspectFlags aspect);
+    void destroyImage(Image *img);
+    void createSlots();
+    void destroySlots();
+    void beginFrame();
+    void recordReadback(Slot &slot);
+    void collect(Slot &slot);
+    void shutdown();
+    void release();
+
+    QVulkanInstance *inst;
+    QSize size;
+    bool debug;
+    Renderer *renderer=nullptr;
+    FrameEncoder *encoder=nullptr;
+
+    VkPhysicalDevice physDev=VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties physDevProps;
+    VkPhysicalDeviceMemoryProperties memProps;
+    VkDevice dev=VK_NULL_HANDLE;
+    QVulkanDeviceFunctions *devFuncs=nullptr;
+    VkQueue queue=VK_NULL_HANDLE;
+    uint32_t queueFamilyIndex=0;
+    uint32_t hostVisibleMemIndex=0;
+    uint32_t deviceLocalMemIndex=0;
+    VkSampleCountFlagBits sampleCount=VK_SAMPLE_COUNT_1_BIT;
+    VkFormat colorFormat=VK_FORMAT_R8G8B8A8_UNORM;
+    VkFormat depthFormat=VK_FORMAT_UNDEFINED;
+    VkRenderPass renderPass=VK_NULL_HANDLE;
+    VkQueryPool queryPool=VK_NULL_HANDLE;//two timestamps per slot
+    quint64 timestampMask=0;//valid bits of the graphics queue's timestamps
+
+    std::function<void(int)> frameStarted;
+    std::function<void(const FrameTimes &)> frameTimed;
+    QElapsedTimer frameTimer;
+
+    QVector<Slot> frameSlots;
+    int current=0;
+    int frameCount=0;
+    int submittedCount=0;
+    int collectedCount=0;
+    bool updateQueued=false;
+    bool inFrame=false;
+};
+
+#endif // OFFSCREENTARGET_H
@@ -0,0 +1,362 @@
+#include "pointcloud.h"
+#include <QtConcurrentMap>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <charconv>
+
+// Chunks smaller than this are not worth a task of their own.
+static const qint64 MIN_CHUNK_BYTES = 1 << 20;
+
+// Default attributes for rows that only carry positions, matches the old
+// constant point color of point.vert.
+static const PointVertex DEFAULT_VERTEX = {0, 0, 0, 0, 128, 255, 255, 255};
+
+// Sidecar cache: this header followed by pointCount interleaved PointVertex.
+static const char CACHE_MAGIC[4] = {'K', 'F', 'P', 'C'};
+static const quint32 CACHE_VERSION = 1;
+
+struct PointCacheHeader{
+    char magic[4];
+    quint32 version;
+    qint64 sourceSize;//size and mtime of the CSV file the cache was built from
+    qint64 sourceMtime;
+    qint64 pointCount;
+    float aabb[6];
+    quint32 stride;
+    quint32 reserved;
+};
+static_assert(sizeof(PointCacheHeader) == 64, "the payload must stay 8-byte aligned");
+
+struct CsvChunk{
+    const char *begin;
+    const char *end;
+    qint64 firstPoint=0;//first slot of this chunk in the output array
+    qint64 lineCount=0;//upper bound of the points in this chunk
+    qint64 parsed=0;
+    float bounds[6];
+};
+
+static inline bool isBlank(char c){
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * @brief parse one decimal number starting at p, locale independent
+ * @return the position after the number, nullptr if there is none
+*/
+static const char *parseNumber(const char *p, const char *end, float *out){
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    if(p < end && *p == '+')
+        ++p;
+    std::from_chars_result res = std::from_chars(p, end, *out);
+    return res.ec == std::errc() ? res.ptr : nullptr;
+#else
+    // libc++ ships <charconv> without the floating point overloads
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    double v = 0.0;
+    int digits = 0;
+    while(p < end && unsigned(*p - '0') < 10){
+        v = v * 10.0 + (*p++ - '0');
+        ++digits;
+    }
+    if(p < end && *p == '.'){
+        ++p;
+        double scale = 0.1;
+        while(p < end && unsigned(*p - '0') < 10){
+            v += (*p++ - '0') * scale;
+            scale *= 0.1;
+            ++digits;
+        }
+    }
+    if(!digits)
+        return nullptr;
+    if(p < end && (*p == 'e' || *p == 'E')){
+        const char *q = p + 1;
+        bool negativeExp = false;
+        if(q < end && (*q == '-' || *q == '+'))
+            negativeExp = *q++ == '-';
+        int e = 0;
+        const char *expStart = q;
+        while(q < end && unsigned(*q - '0') < 10)
+            e = e * 10 + (*q++ - '0');
+        if(q != expStart){
+            v *= std::pow(10.0, negativeExp ? -e : e);
+            p = q;
+        }
+    }
+    *out = float(negative ? -v : v);
+    return p;
+#endif
+}
+
+/**
+ * @brief parse the fields of one line into v
+ * @return false for lines without at least x, y and z (headers, blank lines)
+*/
+static bool parseLine(const char *p, const char *end, PointVertex *v){
+    float values[7];
+    int n = 0;
+    while(n < 7){
+        while(p < end && isBlank(*p))
+            ++p;
+        if(p == end)
+            break;
+        p = parseNumber(p, end, &values[n]);
+        if(!p)
+            break;
+        ++n;
+        while(p < end && isBlank(*p))
+            ++p;
+        if(p < end && *p == ',')
+            ++p;
+    }
+    if(n < 3)
+        return false;
+    *v = DEFAULT_VERTEX;
+    v->x = values[0];
+    v->y = values[1];
+    v->z = values[2];
+    if(n > 3)
+        v->intensity = values[3];
+    if(n >= 7){
+        v->r = quint8(qBound(0.0f, values[4], 255.0f));
+        v->g = quint8(qBound(0.0f, values[5], 255.0f));
+        v->b = quint8(qBound(0.0f, values[6], 255.0f));
+    }
+    return true;
+}
+
+static void resetAabb(float *b){
+    b[0] = b[1] = b[2] = std::numeric_limits<float>::max();
+    b[3] = b[4] = b[5] = std::numeric_limits<float>::lowest();
+}
+
+static void mergeAabb(float *b, const float *other){
+    for(int i = 0; i < 3; ++i){
+        b[i] = qMin(b[i], other[i]);
+        b[i + 3] = qMax(b[i + 3], other[i + 3]);
+    }
+}
+
+PointCloud::PointCloud(){
+    resetBounds();
+}
+
+void PointCloud::clear(){
+    std::vector<PointVertex>().swap(pointData);
+    mapped = nullptr;
+    mappedCount = 0;
+    mappedFile.reset();
+    resetBounds();
+}
+
+void PointCloud::resetBounds(){
+    resetAabb(bounds);
+}
+
+void PointCloud::growBounds(const PointVertex &v){
+    const float b[6] = {v.x, v.y, v.z, v.x, v.y, v.z};
+    mergeAabb(bounds, b);
+}
+
+void PointCloud::setPoints(const QVector<QVector3D> &positions){
+    clear();
+    pointData.resize(positions.size());
+    for(qsizetype i = 0; i < positions.size(); ++i){
+        PointVertex &v = pointData[i];
+        v = DEFAULT_VERTEX;
+        v.x = positions[i].x();
+        v.y = positions[i].y();
+        v.z = positions[i].z();
+        growBounds(v);
+    }
+}
+
+QString PointCloud::cachePathFor(const QString &csvPath){
+    return csvPath + QStringLiteral(".kfpc");
+}
+
+bool PointCloud::load(const QString &csvPath){
+    const QString cachePath = cachePathFor(csvPath);
+    if(loadCache(cachePath, csvPath))
+        return true;
+    if(!loadCsv(csvPath))
+        return false;
+    writeCache(cachePath, csvPath);
+    return true;
+}
+
+bool PointCloud::loadCache(const QString &cachePath, const QString &csvPath){
+    clear();
+    const QFileInfo source(csvPath);
+    QSharedPointer<QFile> inFile(new QFile(cachePath));
+    if(!source.exists() || !inFile->open(QIODevice::ReadOnly))
+        return false;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    const qint64 fileSize = inFile->size();
+    if(fileSize < qint64(sizeof(PointCacheHeader)))
+        return false;
+    const uchar *p = inFile->map(0, fileSize);
+    if(!p)
+        return false;
+    PointCacheHeader header;
+    memcpy(&header, p, sizeof(header));
+    if(memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != CACHE_VERSION
+        || header.stride != sizeof(PointVertex) || header.pointCount < 0
+        || header.pointCount > (fileSize - qint64(sizeof(header))) / qint64(sizeof(PointVertex))){
+        qWarning("Ignoring invalid point cache %s", qPrintable(cachePath));
+        return false;
+    }
+    if(header.sourceSize != source.size()
+        || header.sourceMtime != source.lastModified().toMSecsSinceEpoch()){
+        qDebug("Point cache %s is stale", qPrintable(cachePath));
+        return false;
+    }
+
+    mappedFile = inFile;
+    mapped = reinterpret_cast<const PointVertex *>(p + sizeof(header));
+    mappedCount = header.pointCount;
+    memcpy(bounds, header.aabb, sizeof(bounds));
+
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    const double megabytes = fileSize / (1024.0 * 1024.0);
+    qDebug("Mapped %lld points from %s (%.1f MB) in %.3f ms",
+           mappedCount, qPrintable(cachePath), megabytes, seconds * 1000.0);
+    return true;
+}
+
+bool PointCloud::writeCache(const QString &cachePath, const QString &csvPath) const{
+    const QFileInfo source(csvPath);
+    PointCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.sourceSize = source.size();
+    header.sourceMtime = source.lastModified().toMSecsSinceEpoch();
+    header.pointCount = size();
+    memcpy(header.aabb, bounds, sizeof(bounds));
+    header.stride = sizeof(PointVertex);
+
+    // QSaveFile only replaces the old cache once everything has been written,
+    // so an interrupted write never leaves a truncated cache behind.
+    QSaveFile outFile(cachePath);
+    if(!outFile.open(QIODevice::WriteOnly)){
+        qWarning("Failed to create point cache %s", qPrintable(cachePath));
+        return false;
+    }
+    const qint64 payloadSize = size() * qint64(sizeof(PointVertex));
+    if(outFile.write(reinterpret_cast<const char *>(&header), sizeof(header)) != qint64(sizeof(header))
+        || outFile.write(reinterpret_cast<const char *>(points()), payloadSize) != payloadSize
+        || !outFile.commit()){
+        qWarning("Failed to write point cache %s", qPrintable(cachePath));
+        return false;
+    }
+    return true;
+}
+
+bool PointCloud::loadCsv(const QString &path){
+    clear();
+    QFile inFile(path);
+    if(!inFile.open(QIODevice::ReadOnly)){
+        qWarning("Failed to open %s", qPrintable(path));
+        return false;
+    }
+    const qint64 fileSize = inFile.size();
+    if(fileSize <= 0)
+        return false;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QByteArray fallback;
+    const char *data = reinterpret_cast<const char *>(inFile.map(0, fileSize));
+    if(!data){
+        qWarning("Failed to map %s, falling back to reading it", qPrintable(path));
+        fallback = inFile.readAll();
+        data = fallback.constData();
+    }
+    const char *end = data + fileSize;
+
+    // Split the file into roughly equal chunks, each ending right after a newline.
+    const int taskCount = qMax(1, QThread::idealThreadCount()) * 4;
+    const int chunkCount = int(qBound<qint64>(1, fileSize / MIN_CHUNK_BYTES, taskCount));
+    std::vector<CsvChunk> chunks;
+    chunks.reserve(chunkCount);
+    const char *p = data;
+    for(int i = 0; i < chunkCount && p < end; ++i){
+        const char *chunkEnd = end;
+        if(i < chunkCount - 1){
+            const char *target = qMax(p, data + fileSize * (i + 1) / chunkCount);
+            const void *nl = memchr(target, '\n', end - target);
+            chunkEnd = nl ? static_cast<const char *>(nl) + 1 : end;
+        }
+        CsvChunk chunk;
+        chunk.begin = p;
+        chunk.end = chunkEnd;
+        chunks.push_back(chunk);
+        p = chunkEnd;
+    }
+
+    // Pass 1: count the lines of every chunk to size the output once.
+    QtConcurrent::blockingMap(chunks, [](CsvChunk &c){
+        c.lineCount = std::count(c.begin, c.end, '\n');
+        if(c.end[-1] != '\n')
+            ++c.lineCount;
+    });
+    qint64 total = 0;
+    for(CsvChunk &c : chunks){
+        c.firstPoint = total;
+        total += c.lineCount;
+    }
+    pointData.resize(total);
+
+    // Pass 2: every chunk parses into its own slice of the array.
+    PointVertex *out = pointData.data();
+    QtConcurrent::blockingMap(chunks, [out](CsvChunk &c){
+        resetAabb(c.bounds);
+        PointVertex *v = out + c.firstPoint;
+        const char *line = c.begin;
+        while(line < c.end){
+            const void *nl = memchr(line, '\n', c.end - line);
+            const char *lineEnd = nl ? static_cast<const char *>(nl) : c.end;
+            if(parseLine(line, lineEnd, v)){
+                const float b[6] = {v->x, v->y, v->z, v->x, v->y, v->z};
+                mergeAabb(c.bounds, b);
+                ++v;
+            }
+            line = lineEnd + 1;
+        }
+        c.parsed = v - (out + c.firstPoint);
+    });
+
+    // Close the gaps left by skipped lines (headers, blank lines).
+    qint64 count = 0;
+    for(const CsvChunk &c : chunks){
+        if(c.firstPoint != count && c.parsed)
+            memmove(out + count, out + c.firstPoint, c.parsed * sizeof(PointVertex));
+        count += c.parsed;
+        mergeAabb(bounds, c.bounds);
+    }
+    pointData.resize(count);
+
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    const double megabytes = fileSize / (1024.0 * 1024.0);
+    qDebug("Parsed %lld points from %s (%.1f MB) in %.1f ms on %d chunks, %.1f MB/s",
+           count, qPrintable(path), megabytes, seconds * 1000.0, int(chunks.size()),
+           seconds > 0 ? megabytes / seconds : 0.0);
+    return count > 0;
+}
@@ -0,0 +1,53 @@
+#ifndef POINTCLOUD_H
+#define POINTCLOUD_H
+
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+#include <QSharedPointer>
+#include <vector>
+
+class QFile;
+
+//one interleaved vertex of the point cloud VBO, 20 bytes
+struct PointVertex{
+    float x, y, z;
+    float intensity;
+    quint8 r, g, b, a;
+};
+
+class PointCloud
+{
+public:
+    PointCloud();
+
+    //load from the binary sidecar cache if it is still valid, otherwise parse
+    //the CSV file and write the cache for the next run
+    bool load(const QString &csvPath);
+    //parse a "x,y,z[,intensity[,r,g,b]]" text file, commas or blanks as separators
+    bool loadCsv(const QString &path);
+    bool loadCache(const QString &cachePath, const QString &csvPath);
+    bool writeCache(const QString &cachePath, const QString &csvPath) const;
+    static QString cachePathFor(const QString &csvPath);
+    void setPoints(const QVector<QVector3D> &positions);
+    void clear();
+
+    //either the parsed array or the payload of the mapped cache file
+    const PointVertex *points() const {return mapped ? mapped : pointData.data();}
+    qint64 size() const {return mapped ? mappedCount : qint64(pointData.size());}
+    bool isEmpty() const {return size() == 0;}
+    //minX, minY, minZ, maxX, maxY, maxZ
+    const float *aabb() const {return bounds;}
+
+private:
+    void resetBounds();
+    void growBounds(const PointVertex &v);
+
+    std::vector<PointVertex> pointData;
+    QSharedPointer<QFile> mappedFile;
+    const PointVertex *mapped=nullptr;
+    qint64 mappedCount=0;
+    float bounds[6];
+};
+
+#endif // POINTCLOUD_H
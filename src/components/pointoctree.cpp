@@ -0,0 +1,229 @@
+#include "pointoctree.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <queue>
+#include <limits>
+
+// Nodes with fewer points than this are not subdivided any further.
+static const qint64 NODE_POINT_LIMIT = 32768;
+// Cells per axis of the subsampling grid of every node.
+static const int GRID_SIZE = 64;
+static const int MAX_DEPTH = 16;
+
+static inline int gridCoord(float v, float min, float invCell){
+    return qBound(0, int((v - min) * invCell), GRID_SIZE - 1);
+}
+
+static inline int octantOf(const PointVertex &p, const float *center){
+    return (p.x >= center[0] ? 1 : 0) | (p.y >= center[1] ? 2 : 0) | (p.z >= center[2] ? 4 : 0);
+}
+
+PointOctree::PointOctree() {}
+
+void PointOctree::clear(){
+    std::vector<PointOctreeNode>().swap(nodeList);
+    std::vector<PointVertex>().swap(lodPoints);
+}
+
+void PointOctree::build(const PointCloud &cloud){
+    clear();
+    const qint64 n = cloud.size();
+    if(!n)
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // The root is the bounding cube of the cloud so that every level halves
+    // the grid spacing uniformly on all axes.
+    const float *aabb = cloud.aabb();
+    const float size = qMax(qMax(aabb[3] - aabb[0], aabb[4] - aabb[1]), qMax(aabb[5] - aabb[2], 1e-6f));
+    PointOctreeNode root;
+    for(int i = 0; i < 3; ++i){
+        root.bounds[i] = aabb[i];
+        root.bounds[i + 3] = aabb[i] + size;
+    }
+    root.spacing = 0.0f;
+    root.first = 0;
+    root.count = 0;
+    root.level = 0;
+    std::fill(std::begin(root.children), std::end(root.children), -1);
+    nodeList.push_back(root);
+
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0u);
+    scratch.resize(n);
+    cellStamps.assign(GRID_SIZE * GRID_SIZE * GRID_SIZE, 0);
+    stamp = 0;
+
+    buildNode(0, 0, n, cloud.points());
+
+    lodPoints.resize(n);
+    const PointVertex *src = cloud.points();
+    for(qint64 i = 0; i < n; ++i)
+        lodPoints[i] = src[order[i]];
+
+    std::vector<quint32>().swap(order);
+    std::vector<quint32>().swap(scratch);
+    std::vector<quint32>().swap(cellStamps);
+
+    qDebug("Built point octree: %lld points, %d nodes in %.1f ms",
+           n, int(nodeList.size()), timer.nsecsElapsed() / 1e6);
+}
+
+void PointOctree::buildNode(int nodeIndex, qint64 begin, qint64 end, const PointVertex *src){
+    // nodeList grows while recursing, so never hold on to a reference across children.
+    PointOctreeNode node = nodeList[nodeIndex];
+    node.first = begin;
+
+    if(end - begin <= NODE_POINT_LIMIT || node.level >= MAX_DEPTH){
+        node.count = end - begin;
+        nodeList[nodeIndex] = node;
+        return;
+    }
+
+    // Keep the first point that falls into every grid cell. The stamp avoids
+    // clearing the whole grid for every node.
+    if(++stamp == 0){
+        std::fill(cellStamps.begin(), cellStamps.end(), 0u);
+        stamp = 1;
+    }
+    const float cellSize = (node.bounds[3] - node.bounds[0]) / GRID_SIZE;
+    const float invCell = 1.0f / cellSize;
+    qint64 selected = begin;
+    qint64 restCount = 0;
+    for(qint64 i = begin; i < end; ++i){
+        const PointVertex &p = src[order[i]];
+        const int cell = (gridCoord(p.z, node.bounds[2], invCell) * GRID_SIZE
+                          + gridCoord(p.y, node.bounds[1], invCell)) * GRID_SIZE
+                         + gridCoord(p.x, node.bounds[0], invCell);
+        if(cellStamps[cell] != stamp){
+            cellStamps[cell] = stamp;
+            order[selected++] = order[i];
+        }else{
+            scratch[restCount++] = order[i];
+        }
+    }
+    node.count = selected - begin;
+    node.spacing = cellSize;
+    nodeList[nodeIndex] = node;
+
+    // Counting sort of the remaining points into the eight octants.
+    const float center[3] = {
+        (node.bounds[0] + node.bounds[3]) * 0.5f,
+        (node.bounds[1] + node.bounds[4]) * 0.5f,
+        (node.bounds[2] + node.bounds[5]) * 0.5f
+    };
+    qint64 octantStart[9] = {};
+    for(qint64 i = 0; i < restCount; ++i)
+        ++octantStart[octantOf(src[scratch[i]], center) + 1];
+    octantStart[0] = selected;
+    for(int o = 1; o <= 8; ++o)
+        octantStart[o] += octantStart[o - 1];
+    qint64 cursor[8];
+    std::copy(octantStart, octantStart + 8, cursor);
+    for(qint64 i = 0; i < restCount; ++i)
+        order[cursor[octantOf(src[scratch[i]], center)]++] = scratch[i];
+
+    for(int o = 0; o < 8; ++o){
+        if(octantStart[o] == octantStart[o + 1])
+            continue;
+        PointOctreeNode child;
+        for(int i = 0; i < 3; ++i){
+            const bool upper = o & (1 << i);
+            child.bounds[i] = upper ? center[i] : node.bounds[i];
+            child.bounds[i + 3] = upper ? node.bounds[i + 3] : center[i];
+        }
+        child.spacing = 0.0f;
+        child.first = octantStart[o];
+        child.count = 0;
+        child.level = node.level + 1;
+        std::fill(std::begin(child.children), std::end(child.children), -1);
+        const int childIndex = int(nodeList.size());
+        nodeList.push_back(child);
+        nodeList[nodeIndex].children[o] = childIndex;
+        buildNode(childIndex, octantStart[o], octantStart[o + 1], src);
+    }
+}
+
+// Gribb-Hartmann: the planes of the view frustum in the space mvp maps from,
+// as (nx, ny, nz, d) with the normals pointing inwards.
+static void frustumPlanes(const QMatrix4x4 &mvp, QVector4D *planes){
+    const QVector4D r0 = mvp.row(0), r1 = mvp.row(1), r2 = mvp.row(2), r3 = mvp.row(3);
+    planes[0] = r3 + r0;
+    planes[1] = r3 - r0;
+    planes[2] = r3 + r1;
+    planes[3] = r3 - r1;
+    planes[4] = r3 + r2;
+    planes[5] = r3 - r2;
+}
+
+static bool intersectsFrustum(const QVector4D *planes, const float *bounds){
+    for(int i = 0; i < 6; ++i){
+        const QVector4D &pl = planes[i];
+        // the corner of the box furthest along the plane normal
+        const float x = pl.x() >= 0 ? bounds[3] : bounds[0];
+        const float y = pl.y() >= 0 ? bounds[4] : bounds[1];
+        const float z = pl.z() >= 0 ? bounds[5] : bounds[2];
+        if(pl.x() * x + pl.y() * y + pl.z() * z + pl.w() < 0)
+            return false;
+    }
+    return true;
+}
+
+void PointOctree::traverse(const QMatrix4x4 &modelView, const QMatrix4x4 &projection, int viewportHeight,
+                           qint64 pointBudget, float minPointPixels, std::vector<int> *visible) const{
+    visible->clear();
+    if(nodeList.empty())
+        return;
+
+    QVector4D planes[6];
+    frustumPlanes(projection * modelView, planes);
+    if(!intersectsFrustum(planes, nodeList[0].bounds))
+        return;
+
+    // pixels covered by one unit of length at distance one
+    const float pixelScale = projection(1, 1) * viewportHeight * 0.5f;
+    const QVector3D eye = modelView.inverted().map(QVector3D(0, 0, 0));
+    auto distanceTo = [&eye](const PointOctreeNode &node, float *radius){
+        const QVector3D center((node.bounds[0] + node.bounds[3]) * 0.5f,
+                               (node.bounds[1] + node.bounds[4]) * 0.5f,
+                               (node.bounds[2] + node.bounds[5]) * 0.5f);
+        *radius = (node.bounds[3] - node.bounds[0]) * 0.8660254f;//half the diagonal of the cube
+        return qMax((center - eye).length() - *radius, 1e-3f);
+    };
+
+    struct Candidate{
+        float priority;//projected size in pixels
+        int node;
+        bool operator<(const Candidate &other) const {return priority < other.priority;}
+    };
+    std::priority_queue<Candidate> queue;
+    queue.push({std::numeric_limits<float>::max(), 0});
+
+    qint64 points = 0;
+    while(!queue.empty()){
+        const Candidate c = queue.top();
+        queue.pop();
+        const PointOctreeNode &node = nodeList[c.node];
+        if(points + node.count > pointBudget)
+            break;
+        points += node.count;
+        visible->push_back(c.node);
+
+        float radius;
+        const float distance = distanceTo(node, &radius);
+        if(node.spacing * pixelScale / distance <= minPointPixels)
+            continue;// already as dense on screen as it needs to be
+
+        for(int child : node.children){
+            if(child < 0 || !intersectsFrustum(planes, nodeList[child].bounds))
+                continue;
+            const float childDistance = distanceTo(nodeList[child], &radius);
+            queue.push({radius * pixelScale / childDistance, child});
+        }
+    }
+}
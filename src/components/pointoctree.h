@@ -0,0 +1,59 @@
+#ifndef POINTOCTREE_H
+#define POINTOCTREE_H
+
+#include "pointcloud.h"
+#include <QMatrix4x4>
+#include <vector>
+
+struct PointOctreeNode{
+    float bounds[6];//minX, minY, minZ, maxX, maxY, maxZ, always a cube
+    float spacing;//grid cell size the points of this node were subsampled with, 0 for leaves
+    qint64 first;//first point of this node in PointOctree::points()
+    qint64 count;
+    int children[8];//-1 for empty octants
+    int level;
+};
+
+/**
+ * @brief Potree style LOD hierarchy: every node keeps one point per cell of a
+ * regular grid over its bounds, the remaining points are passed down to the
+ * children. Drawing a node and all its ancestors therefore gives a uniformly
+ * thinned out version of the cloud in that region.
+*/
+class PointOctree
+{
+public:
+    PointOctree();
+
+    void build(const PointCloud &cloud);
+    void clear();
+
+    const std::vector<PointOctreeNode> &nodes() const {return nodeList;}
+    //the points of the cloud reordered so that every node is one contiguous range
+    const PointVertex *points() const {return lodPoints.data();}
+    qint64 pointCount() const {return qint64(lodPoints.size());}
+
+    /**
+     * @brief select the nodes to draw, coarse and large-on-screen nodes first
+     * @param modelView transforms the cloud into eye space
+     * @param viewportHeight in pixels, used for the screen-space error
+     * @param pointBudget traversal stops before exceeding this many points
+     * @param minPointPixels children are only visited while the projected point spacing of their parent is larger
+    */
+    void traverse(const QMatrix4x4 &modelView, const QMatrix4x4 &projection, int viewportHeight,
+                  qint64 pointBudget, float minPointPixels, std::vector<int> *visible) const;
+
+private:
+    void buildNode(int nodeIndex, qint64 begin, qint64 end, const PointVertex *src);
+
+    std::vector<PointOctreeNode> nodeList;
+    std::vector<PointVertex> lodPoints;
+
+    //build scratch state
+    std::vector<quint32> order;
+    std::vector<quint32> scratch;
+    std::vector<quint32> cellStamps;
+    quint32 stamp=0;
+};
+
+#endif // POINTOCTREE_H
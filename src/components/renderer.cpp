@@ -1,58 +1,179 @@
 #include "renderer.h"
+#include "assetmanager.h"
 #include "qrandom.h"
 #include <QVulkanFunctions>
 #include <QtConcurrentRun>
+#include <QtConcurrentMap>
+#include <QThread>
 #include <QTime>
-
-static float quadVert[] = { // Y up, front = CW
-    -1, -1, 0,
-    -1,  1, 0,
-    1, -1, 0,
-    1,  1, 0
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QFile>
+#include <QQuaternion>
+#include <algorithm>
+#include <climits>
+#include <limits>
+
+static float quadVert[] = { // the floor, Y up, front = CW
+    -20, -100, 0,
+    -20,  100, 0,
+    20, -100, 0,
+    20,  100, 0
 };
 
-#define DBG Q_UNLIKELY(vkview->isDebugEnabled())
-
-const int MAX_INSTANCES = 16384;
-const VkDeviceSize PER_INSTANCE_DATA_SIZE = 6 * sizeof(float); // instTranslate, instDiffuseAdjust
+#define DBG Q_UNLIKELY(target->isDebugEnabled())
+
+const int INITIAL_INSTANCE_CAPACITY = 1024;
+const VkDeviceSize PER_INSTANCE_DATA_SIZE = 3 * sizeof(float); // instDiffuseAdjust
+const VkDeviceSize PER_INSTANCE_TRANSFORM_SIZE = 8 * sizeof(float); // rotation, translation, scale, see color_phong.vert
+const VkDeviceSize TRANSFORM_ALIGNMENT = 256; // the largest minStorageBufferOffsetAlignment the spec allows
+const VkDeviceSize STAGING_RING_SIZE = 4 * 1024 * 1024;
+const VkDeviceSize MIN_UNIFORM_RING_FRAME_SIZE = 64 * 1024; // uniform space per frame in flight, more for scenes that need it
+const int MAX_RECORD_THREADS = 8;
+const float FAR_PLANE = 1000.0f; // of the projection, render queue depths are relative to it
+const int MIN_INSTANCES_PER_RECORD_JOB = 1024; // smaller item batches are not worth a thread
+const int CULL_BENCH_MIN_INSTANCES = 1024;
+const int CULL_BENCH_MAX_INSTANCES = 1024 * 1024;
+const int CULL_BENCH_WARMUP_FRAMES = 10;
+const int CULL_BENCH_FRAMES = 100; // measured per instance count and mode
+const float ANIMATION_FRAME_TIME = 1.0f / 60.0f; // animation time per frame built
+const int ANIMATION_KEYS = 6; // per instance track, the last one repeats the first
+const int ANIMATION_ROTATION_KEYS = 4; // a turn in thirds, the last one repeats the first
+
+static_assert(sizeof(Scene::Transform) == PER_INSTANCE_TRANSFORM_SIZE && sizeof(QVector3D) == PER_INSTANCE_DATA_SIZE,
+              "the scene's world transforms and tints are copied as they are");
+
+static VkFormat vkFormat(VertexFormat::Encoding encoding)
+{
+    switch (encoding) {
+    case VertexFormat::Float2:
+        return VK_FORMAT_R32G32_SFLOAT;
+    case VertexFormat::Float3:
+        return VK_FORMAT_R32G32B32_SFLOAT;
+    case VertexFormat::Unorm16x4:
+        return VK_FORMAT_R16G16B16A16_UNORM;
+    case VertexFormat::Half2:
+        return VK_FORMAT_R16G16_SFLOAT;
+    case VertexFormat::OctSnorm16x2:
+        return VK_FORMAT_R16G16_SNORM;
+    }
+    return VK_FORMAT_UNDEFINED;
+}
 
 static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
 {
     return (v + byteAlign - 1) & ~(byteAlign - 1);
 }
 
-Renderer::Renderer(Vkview *w, int initialCount)
-    : vkview(w),
+// An instance buffer region holds the attributes of capacity instances,
+// bound as vertex input, followed by their transforms, bound as storage.
+static inline VkDeviceSize transformOffset(int capacity)
+{
+    return aligned(VkDeviceSize(capacity) * PER_INSTANCE_DATA_SIZE, TRANSFORM_ALIGNMENT);
+}
+
+static inline VkDeviceSize instanceRegionSize(int capacity)
+{
+    return aligned(transformOffset(capacity) + VkDeviceSize(capacity) * PER_INSTANCE_TRANSFORM_SIZE, TRANSFORM_ALIGNMENT);
+}
+
+Renderer::Renderer(RenderTarget *w, int initialCount)
+    : target(w),
     // Have the light positioned just behind the default camera position, looking forward.
     lightPos(0.0f, 0.0f, 25.0f),
     cam(QVector3D(0.0f, 0.0f, 20.0f)), // starting camera position
-    instCount(initialCount)
+    instCount(initialCount),
+    publishedInstCount(initialCount),
+    random(QRandomGenerator::global()->generate())
 {
-    floorModel.translate(0, -5, 0);
-    floorModel.rotate(-90, 1, 0, 0);
-    floorModel.scale(20, 100, 1);
-
-    blockMesh.load(QString(MESH_DIR)+"/block.buf");
-    logoMesh.load(QString(MESH_DIR)+"/qt_logo.buf");
+    Mesh::setVerbose(DBG);
+    // KEYFRAME_STRESS_INSTANCES=1000000 doubles the instance count every
+    // frame until it reaches the given number.
+    stressInstanceTarget = qEnvironmentVariableIntValue("KEYFRAME_STRESS_INSTANCES");
+
+    // KEYFRAME_GPU_CULLING=0 draws every instance without the compute pre-pass.
+    gpuCullingRequested = qEnvironmentVariableIsEmpty("KEYFRAME_GPU_CULLING")
+                          || qEnvironmentVariableIntValue("KEYFRAME_GPU_CULLING") != 0;
+    // KEYFRAME_CPU_CULLING=1 culls on the CPU instead, which is also the
+    // fallback when the compute pre-pass is not available.
+    cpuCullingRequested = qEnvironmentVariableIntValue("KEYFRAME_CPU_CULLING");
+    // KEYFRAME_CULL_BENCH=1 sweeps the instance count from 1K to 1M and
+    // compares the frame time with and without culling at every step.
+    cullBench.active = (gpuCullingRequested || cpuCullingRequested) && qEnvironmentVariableIntValue("KEYFRAME_CULL_BENCH");
+    if (qEnvironmentVariableIntValue("KEYFRAME_CPU_CULL_BENCH"))
+        CpuCuller::benchmark(1024 * 1024);
+
+    // KEYFRAME_ANIMATION=1 moves every instance along a looping keyframe
+    // path around its position, KEYFRAME_ANIMATION_ERROR=0.001 keeps the
+    // tracks compressed within that error, KEYFRAME_ANIMATION_BENCH=1 logs how
+    // many tracks the animator evaluates per millisecond, plain and compressed,
+    // and the compression ratios.
+    animationRequested = qEnvironmentVariableIntValue("KEYFRAME_ANIMATION");
+    const float animationError = qEnvironmentVariable("KEYFRAME_ANIMATION_ERROR").toFloat();
+    if (animationError > 0.0f)
+        animator.setCompression(animationError);
+    if (qEnvironmentVariableIntValue("KEYFRAME_ANIMATION_BENCH"))
+        Animator::benchmark(64 * 1024);
+    // KEYFRAME_MESH_BENCH=file.buf logs the load time and memory of that mesh
+    // through the mapped and the copying loader.
+    if (!qEnvironmentVariableIsEmpty("KEYFRAME_MESH_BENCH"))
+        Mesh::benchmark(qEnvironmentVariable("KEYFRAME_MESH_BENCH"));
+    // KEYFRAME_SCENE_BENCH=1 logs the time per entity of a scene update, from
+    // 1K to 100K entities, which stays flat as long as the update is linear.
+    if (qEnvironmentVariableIntValue("KEYFRAME_SCENE_BENCH"))
+        Scene::benchmark(100 * 1000);
+    cullBench.count = CULL_BENCH_MIN_INSTANCES;
+
+    // KEYFRAME_PROFILE=0 leaves out the timestamp and pipeline statistics
+    // queries, KEYFRAME_PROFILE_TRACE=file.json writes the last frames as a
+    // Chrome trace when the renderer releases its resources.
+    profilingRequested = qEnvironmentVariableIsEmpty("KEYFRAME_PROFILE")
+                         || qEnvironmentVariableIntValue("KEYFRAME_PROFILE") != 0;
+    profileTraceFileName = qEnvironmentVariable("KEYFRAME_PROFILE_TRACE");
+
+    // KEYFRAME_VERTEX_FORMAT=packed converts the meshes to 16 bytes per vertex.
+    vertexFormat = VertexFormat::fromEnvironment();
+    loadScene();
+
+    // KEYFRAME_SHADER_HOT_RELOAD=1 recompiles the GLSL sources in SHADER_DIR
+    // when they are saved and swaps the affected pipelines while running.
+    if (qEnvironmentVariableIntValue("KEYFRAME_SHADER_HOT_RELOAD")) {
+        const QString dir = QString(SHADER_DIR) + "/";
+        shaderSources.insert(dir + (vertexFormat == VertexFormat::Packed ? "color_phong_packed.vert" : "color_phong.vert"), ItemVs);
+        shaderSources.insert(dir + "color_phong.frag", ItemFs);
+        shaderSources.insert(dir + "color.vert", FloorVs);
+        shaderSources.insert(dir + "color.frag", FloorFs);
+        if (gpuCullingRequested)
+            shaderSources.insert(dir + "cull.comp", CullCs);
+        shaderWatcher.reset(new ShaderWatcher);
+        shaderWatcher->setDebug(DBG);
+        shaderWatcher->watch(shaderSources.keys(), [this](const QString &source, const QByteArray &spirv) {
+            shaderCompiled(source, spirv);
+        });
+    }
 
-    QObject::connect(&frameWatcher, &QFutureWatcherBase::finished, vkview, [this] {
+    QObject::connect(&frameWatcher, &QFutureWatcherBase::finished, &frameWatcher, [this] {
         if (framePending) {
             framePending = false;
-            vkview->frameReady();
-            vkview->requestUpdate();
+            target->frameReady();
+            recordInputLatency();
+            target->requestUpdate();
         }
     });
 }
 
 void Renderer::preInitResources()
 {
-    const QList<int> sampleCounts = vkview->supportedSampleCounts();
+    const QList<int> sampleCounts = target->supportedSampleCounts();
     if (DBG)
         qDebug() << "Supported sample counts:" << sampleCounts;
     if (sampleCounts.contains(4)) {
         if (DBG)
             qDebug("Requesting 4x MSAA");
-        vkview->setSampleCount(4);
+        target->setSampleCount(4);
     }
 }
 
@@ -64,106 +185,222 @@ void Renderer::initResources()
     animatingStatus = true;
     framePending = false;
 
-    QVulkanInstance *inst = vkview->vulkanInstance();
-    VkDevice dev = vkview->device();
-    const VkPhysicalDeviceLimits *pdevLimits = &vkview->physicalDeviceProperties()->limits;
+    QVulkanInstance *inst = target->vulkanInstance();
+    VkDevice dev = target->device();
+    const VkPhysicalDeviceLimits *pdevLimits = &target->physicalDeviceProperties()->limits;
     const VkDeviceSize uniAlign = pdevLimits->minUniformBufferOffsetAlignment;
 
     devFuncs = inst->deviceFunctions(dev);
 
+    uploader.create(devFuncs, dev, target->graphicsQueue(), target->graphicsQueueFamilyIndex(),
+                    target->hostVisibleMemoryIndex(), STAGING_RING_SIZE);
+
+    createRecordSlots();
+
+    if (profilingRequested) {
+        // Both targets enable every supported feature, statistics included.
+        QVulkanFunctions *f = inst->functions();
+        uint32_t familyCount = 0;
+        f->vkGetPhysicalDeviceQueueFamilyProperties(target->physicalDevice(), &familyCount, nullptr);
+        QVector<VkQueueFamilyProperties> families(familyCount);
+        f->vkGetPhysicalDeviceQueueFamilyProperties(target->physicalDevice(), &familyCount, families.data());
+        VkPhysicalDeviceFeatures features;
+        f->vkGetPhysicalDeviceFeatures(target->physicalDevice(), &features);
+        profiler.create(devFuncs, dev, target->physicalDeviceProperties(),
+                        families[target->graphicsQueueFamilyIndex()].timestampValidBits,
+                        features.pipelineStatisticsQuery, target->concurrentFrameCount(), MAX_RECORD_THREADS + 1);
+    }
+
+    // The meshes go to the GPU from buildFrame() once they are loaded, the
+    // frames before that draw a placeholder in their place.
+    uploadToken.reset(new bool(true));
+    for (int mesh = 0; mesh < gpuMeshes.size(); ++mesh)
+        uploadWhenLoaded(mesh);
+
     // Note the std140 packing rules. A vec3 still has an alignment of 16,
     // while a mat3 is like 3 * vec3.
     itemMaterial.vertUniSize = aligned(2 * 64 + 48, uniAlign); // see color_phong.vert
     itemMaterial.fragUniSize = aligned(6 * 16 + 12 + 2 * 4, uniAlign); // see color_phong.frag
 
-    if (!itemMaterial.vs.isValid())
-        itemMaterial.vs.load(inst, dev, QString(SHADER_DIR)+"/color_phong_vert.spv");
+    if (!itemMaterial.vs.isValid()) {
+        if (vertexFormat == VertexFormat::Packed)
+            itemMaterial.vs.load(inst, dev, QString(SHADER_BIN_DIR)+"/color_phong_packed_vert.spv");
+        else
+            itemMaterial.vs.load(inst, dev, QString(SHADER_BIN_DIR)+"/color_phong_vert.spv");
+    }
     if (!itemMaterial.fs.isValid())
         itemMaterial.fs.load(inst, dev, QString(SHADER_DIR)+"/color_phong_frag.spv");
     if (!floorMaterial.vs.isValid())
         floorMaterial.vs.load(inst, dev, QString(SHADER_DIR)+"/color_vert.spv");
     if (!floorMaterial.fs.isValid())
         floorMaterial.fs.load(inst, dev, QString(SHADER_DIR)+"/color_frag.spv");
+    // compiled at build time, see the glslc step in CMakeLists.txt
+    if (gpuCullingRequested && !cullShader.isValid())
+        cullShader.load(inst, dev, QString(SHADER_BIN_DIR)+"/cull_comp.spv");
 
     pipelinesFuture = QtConcurrent::run(&Renderer::createPipelines, this);
 }
 
+// The cache blob is only valid for the exact device and driver build it came
+// from, so the file name carries all the fields of the cache header.
+QString Renderer::pipelineCacheFileName() const
+{
+    const VkPhysicalDeviceProperties *props = target->physicalDeviceProperties();
+    QString uuid;
+    for (int i = 0; i < VK_UUID_SIZE; ++i)
+        uuid += QString::asprintf("%02x", props->pipelineCacheUUID[i]);
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
+           + QString::asprintf("/pipelinecache_%04x_%04x_", props->vendorID, props->deviceID)
+           + uuid + QLatin1String(".bin");
+}
+
+QByteArray Renderer::loadPipelineCacheData() const
+{
+    QFile f(pipelineCacheFileName());
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QByteArray data = f.readAll();
+
+    // Validate the VkPipelineCacheHeaderVersionOne header ourselves, some
+    // drivers do not cope well with blobs from another device.
+    const VkPhysicalDeviceProperties *props = target->physicalDeviceProperties();
+    quint32 header[4];
+    if (data.size() < qsizetype(sizeof(header) + VK_UUID_SIZE))
+        return QByteArray();
+    memcpy(header, data.constData(), sizeof(header));
+    if (header[0] < sizeof(header) + VK_UUID_SIZE
+        || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        || header[2] != props->vendorID
+        || header[3] != props->deviceID
+        || memcmp(data.constData() + sizeof(header), props->pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        qWarning("Ignoring incompatible pipeline cache %s", qPrintable(f.fileName()));
+        return QByteArray();
+    }
+    return data;
+}
+
+void Renderer::savePipelineCache()
+{
+    VkDevice dev = target->device();
+    size_t size = 0;
+    VkResult err = devFuncs->vkGetPipelineCacheData(dev, pipelineCache, &size, nullptr);
+    if (err != VK_SUCCESS || !size) {
+        qWarning("Failed to query pipeline cache size: %d", err);
+        return;
+    }
+    QByteArray data(qsizetype(size), Qt::Uninitialized);
+    err = devFuncs->vkGetPipelineCacheData(dev, pipelineCache, &size, data.data());
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to retrieve pipeline cache data: %d", err);
+        return;
+    }
+    data.resize(qsizetype(size));
+
+    const QString fn = pipelineCacheFileName();
+    QDir().mkpath(QFileInfo(fn).absolutePath());
+    QSaveFile f(fn);
+    if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size() || !f.commit()) {
+        qWarning("Failed to write pipeline cache %s", qPrintable(fn));
+        return;
+    }
+    if (DBG)
+        qDebug("Saved %lld bytes of pipeline cache to %s", qint64(data.size()), qPrintable(fn));
+}
+
+// One command pool per frame in flight and recording job. A job records on
+// whatever pool thread picks it up, but never on two threads at once, so the
+// pool needs no locking. Pools of a frame are reset as a whole when that frame
+// slot comes around again.
+void Renderer::createRecordSlots()
+{
+    VkDevice dev = target->device();
+    recordThreadCount = qBound(1, QThread::idealThreadCount(), MAX_RECORD_THREADS);
+    recordSlotCount = recordThreadCount + 1; // item jobs plus the floor
+    recordSlots.resize(target->concurrentFrameCount() * recordSlotCount);
+
+    for (RecordSlot &slot : recordSlots) {
+        VkCommandPoolCreateInfo poolInfo;
+        memset(&poolInfo, 0, sizeof(poolInfo));
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = target->graphicsQueueFamilyIndex();
+        VkResult err = devFuncs->vkCreateCommandPool(dev, &poolInfo, nullptr, &slot.pool);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create command pool: %d", err);
+
+        VkCommandBufferAllocateInfo cmdBufInfo = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, slot.pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY, 1
+        };
+        err = devFuncs->vkAllocateCommandBuffers(dev, &cmdBufInfo, &slot.cmdBuf);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate secondary command buffer: %d", err);
+    }
+
+    if (DBG)
+        qDebug("Recording on up to %d threads", recordThreadCount);
+}
+
+void Renderer::destroyRecordSlots()
+{
+    VkDevice dev = target->device();
+    for (const RecordSlot &slot : std::as_const(recordSlots))
+        devFuncs->vkDestroyCommandPool(dev, slot.pool, nullptr);
+    recordSlots.clear();
+}
+
 void Renderer::createPipelines()
 {
-    VkDevice dev = vkview->device();
+    VkDevice dev = target->device();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    const QByteArray initialData = loadPipelineCacheData();
 
     VkPipelineCacheCreateInfo pipelineCacheInfo;
     memset(&pipelineCacheInfo, 0, sizeof(pipelineCacheInfo));
     pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheInfo.initialDataSize = size_t(initialData.size());
+    pipelineCacheInfo.pInitialData = initialData.isEmpty() ? nullptr : initialData.constData();
     VkResult err = devFuncs->vkCreatePipelineCache(dev, &pipelineCacheInfo, nullptr, &pipelineCache);
+    if (err != VK_SUCCESS && !initialData.isEmpty()) {
+        qWarning("Failed to create pipeline cache from saved data: %d, starting empty", err);
+        pipelineCacheInfo.initialDataSize = 0;
+        pipelineCacheInfo.pInitialData = nullptr;
+        err = devFuncs->vkCreatePipelineCache(dev, &pipelineCacheInfo, nullptr, &pipelineCache);
+    }
     if (err != VK_SUCCESS)
         qFatal("Failed to create pipeline cache: %d", err);
 
     createItemPipeline();
     createFloorPipeline();
+    if (gpuCullingRequested)
+        createCullPipeline();
+
+    // Compare a first run (or one with the cache file deleted) against a warm
+    // one to see what the cache saves.
+    if (DBG)
+        qDebug("Created pipelines in %.3f ms (%s pipeline cache, %lld bytes)",
+               timer.nsecsElapsed() / 1000000.0, initialData.isEmpty() ? "cold" : "warm",
+               qint64(initialData.size()));
 }
 
 void Renderer::createItemPipeline()
 {
-    VkDevice dev = vkview->device();
-
-    // Vertex layout.
-    VkVertexInputBindingDescription vertexBindingDesc[] = {
-        {
-            0, // binding
-            8 * sizeof(float),
-            VK_VERTEX_INPUT_RATE_VERTEX
-        },
-        {
-            1,
-            6 * sizeof(float),
-            VK_VERTEX_INPUT_RATE_INSTANCE
-        }
-    };
-    VkVertexInputAttributeDescription vertexAttrDesc[] = {
-        { // position
-            0, // location
-            0, // binding
-            VK_FORMAT_R32G32B32_SFLOAT,
-            0 // offset
-        },
-        { // normal
-            1,
-            0,
-            VK_FORMAT_R32G32B32_SFLOAT,
-            5 * sizeof(float)
-        },
-        { // instTranslate
-            2,
-            1,
-            VK_FORMAT_R32G32B32_SFLOAT,
-            0
-        },
-        { // instDiffuseAdjust
-            3,
-            1,
-            VK_FORMAT_R32G32B32_SFLOAT,
-            3 * sizeof(float)
-        }
-    };
-
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo;
-    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.pNext = nullptr;
-    vertexInputInfo.flags = 0;
-    vertexInputInfo.vertexBindingDescriptionCount = sizeof(vertexBindingDesc) / sizeof(vertexBindingDesc[0]);
-    vertexInputInfo.pVertexBindingDescriptions = vertexBindingDesc;
-    vertexInputInfo.vertexAttributeDescriptionCount = sizeof(vertexAttrDesc) / sizeof(vertexAttrDesc[0]);
-    vertexInputInfo.pVertexAttributeDescriptions = vertexAttrDesc;
+    VkDevice dev = target->device();
 
-    // Descriptor set layout.
+    // Descriptor set layout. The uniforms would do with a single set due to
+    // the dynamic uniform buffer, the transforms change their buffer from
+    // frame to frame, so there is a set per frame in flight.
+    const int frameCount = target->concurrentFrameCount();
     VkDescriptorPoolSize descPoolSizes[] = {
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 2 }
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, uint32_t(2 * frameCount) },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, uint32_t(frameCount) }
     };
     VkDescriptorPoolCreateInfo descPoolInfo;
     memset(&descPoolInfo, 0, sizeof(descPoolInfo));
     descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descPoolInfo.maxSets = 1; // a single set is enough due to the dynamic uniform buffer
+    descPoolInfo.maxSets = uint32_t(frameCount);
     descPoolInfo.poolSizeCount = sizeof(descPoolSizes) / sizeof(descPoolSizes[0]);
     descPoolInfo.pPoolSizes = descPoolSizes;
     VkResult err = devFuncs->vkCreateDescriptorPool(dev, &descPoolInfo, nullptr, &itemMaterial.descPool);
@@ -185,6 +422,13 @@ void Renderer::createItemPipeline()
                 1,
                 VK_SHADER_STAGE_FRAGMENT_BIT,
                 nullptr
+            },
+            { // transforms
+                2,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                1,
+                VK_SHADER_STAGE_VERTEX_BIT,
+                nullptr
             }
         };
     VkDescriptorSetLayoutCreateInfo descLayoutInfo = {
@@ -198,16 +442,18 @@ void Renderer::createItemPipeline()
     if (err != VK_SUCCESS)
         qFatal("Failed to create descriptor set layout: %d", err);
 
+    itemMaterial.descSets.resize(frameCount);
+    QVector<VkDescriptorSetLayout> layouts(frameCount, itemMaterial.descSetLayout);
     VkDescriptorSetAllocateInfo descSetAllocInfo = {
         VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
         nullptr,
         itemMaterial.descPool,
-        1,
-        &itemMaterial.descSetLayout
+        uint32_t(frameCount),
+        layouts.constData()
     };
-    err = devFuncs->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &itemMaterial.descSet);
+    err = devFuncs->vkAllocateDescriptorSets(dev, &descSetAllocInfo, itemMaterial.descSets.data());
     if (err != VK_SUCCESS)
-        qFatal("Failed to allocate descriptor set: %d", err);
+        qFatal("Failed to allocate descriptor sets: %d", err);
 
     // Graphics pipeline.
     VkPipelineLayoutCreateInfo pipelineLayoutInfo;
@@ -220,6 +466,64 @@ void Renderer::createItemPipeline()
     if (err != VK_SUCCESS)
         qFatal("Failed to create pipeline layout: %d", err);
 
+    itemMaterial.pipeline = buildItemPipeline(itemMaterial.vs.data()->shaderModule, itemMaterial.fs.data()->shaderModule);
+    if (!itemMaterial.pipeline)
+        qFatal("Failed to create item pipeline");
+}
+
+// Everything but the layout, which stays the same when a shader is replaced.
+VkPipeline Renderer::buildItemPipeline(VkShaderModule vs, VkShaderModule fs)
+{
+    VkDevice dev = target->device();
+
+    // Vertex layout. The mesh attributes come from the vertex format, the
+    // shader only consumes the position and the normal. The instance
+    // transforms are read from storage, see writeTransformDescriptor().
+    const VertexFormat &format = VertexFormat::get(vertexFormat);
+    const VertexFormat::Attribute *position = format.find(VertexFormat::Position);
+    const VertexFormat::Attribute *normal = format.find(VertexFormat::Normal);
+    VkVertexInputBindingDescription vertexBindingDesc[] = {
+        {
+            0, // binding
+            uint32_t(format.stride()),
+            VK_VERTEX_INPUT_RATE_VERTEX
+        },
+        {
+            1,
+            uint32_t(PER_INSTANCE_DATA_SIZE),
+            VK_VERTEX_INPUT_RATE_INSTANCE
+        }
+    };
+    VkVertexInputAttributeDescription vertexAttrDesc[] = {
+        { // position
+            0, // location
+            0, // binding
+            vkFormat(position->encoding),
+            uint32_t(position->offset)
+        },
+        { // normal
+            1,
+            0,
+            vkFormat(normal->encoding),
+            uint32_t(normal->offset)
+        },
+        { // instDiffuseAdjust
+            2,
+            1,
+            VK_FORMAT_R32G32B32_SFLOAT,
+            0
+        }
+    };
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo;
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.pNext = nullptr;
+    vertexInputInfo.flags = 0;
+    vertexInputInfo.vertexBindingDescriptionCount = sizeof(vertexBindingDesc) / sizeof(vertexBindingDesc[0]);
+    vertexInputInfo.pVertexBindingDescriptions = vertexBindingDesc;
+    vertexInputInfo.vertexAttributeDescriptionCount = sizeof(vertexAttrDesc) / sizeof(vertexAttrDesc[0]);
+    vertexInputInfo.pVertexAttributeDescriptions = vertexAttrDesc;
+
     VkGraphicsPipelineCreateInfo pipelineInfo;
     memset(&pipelineInfo, 0, sizeof(pipelineInfo));
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -230,7 +534,7 @@ void Renderer::createItemPipeline()
             nullptr,
             0,
             VK_SHADER_STAGE_VERTEX_BIT,
-            itemMaterial.vs.data()->shaderModule,
+            vs,
             "main",
             nullptr
         },
@@ -239,7 +543,7 @@ void Renderer::createItemPipeline()
             nullptr,
             0,
             VK_SHADER_STAGE_FRAGMENT_BIT,
-            itemMaterial.fs.data()->shaderModule,
+            fs,
             "main",
             nullptr
         }
@@ -274,7 +578,7 @@ void Renderer::createItemPipeline()
     VkPipelineMultisampleStateCreateInfo ms;
     memset(&ms, 0, sizeof(ms));
     ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    ms.rasterizationSamples = vkview->sampleCountFlagBits();
+    ms.rasterizationSamples = target->sampleCountFlagBits();
     pipelineInfo.pMultisampleState = &ms;
 
     VkPipelineDepthStencilStateCreateInfo ds;
@@ -304,40 +608,20 @@ void Renderer::createItemPipeline()
     pipelineInfo.pDynamicState = &dyn;
 
     pipelineInfo.layout = itemMaterial.pipelineLayout;
-    pipelineInfo.renderPass = vkview->defaultRenderPass();
+    pipelineInfo.renderPass = target->defaultRenderPass();
 
-    err = devFuncs->vkCreateGraphicsPipelines(dev, pipelineCache, 1, &pipelineInfo, nullptr, &itemMaterial.pipeline);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create graphics pipeline: %d", err);
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult err = devFuncs->vkCreateGraphicsPipelines(dev, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create graphics pipeline: %d", err);
+        return VK_NULL_HANDLE;
+    }
+    return pipeline;
 }
 
 void Renderer::createFloorPipeline()
 {
-    VkDevice dev = vkview->device();
-
-    // Vertex layout.
-    VkVertexInputBindingDescription vertexBindingDesc = {
-        0, // binding
-        3 * sizeof(float),
-        VK_VERTEX_INPUT_RATE_VERTEX
-    };
-    VkVertexInputAttributeDescription vertexAttrDesc[] = {
-                                                          { // position
-                                                              0, // location
-                                                              0, // binding
-                                                              VK_FORMAT_R32G32B32_SFLOAT,
-                                                              0 // offset
-                                                          },
-                                                          };
-
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo;
-    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.pNext = nullptr;
-    vertexInputInfo.flags = 0;
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.pVertexBindingDescriptions = &vertexBindingDesc;
-    vertexInputInfo.vertexAttributeDescriptionCount = sizeof(vertexAttrDesc) / sizeof(vertexAttrDesc[0]);
-    vertexInputInfo.pVertexAttributeDescriptions = vertexAttrDesc;
+    VkDevice dev = target->device();
 
     // Do not bother with uniform buffers and descriptors, all the data fits
     // into the spec mandated minimum of 128 bytes for push constants.
@@ -366,6 +650,39 @@ void Renderer::createFloorPipeline()
     if (err != VK_SUCCESS)
         qFatal("Failed to create pipeline layout: %d", err);
 
+    floorMaterial.pipeline = buildFloorPipeline(floorMaterial.vs.data()->shaderModule, floorMaterial.fs.data()->shaderModule);
+    if (!floorMaterial.pipeline)
+        qFatal("Failed to create floor pipeline");
+}
+
+VkPipeline Renderer::buildFloorPipeline(VkShaderModule vs, VkShaderModule fs)
+{
+    VkDevice dev = target->device();
+
+    // Vertex layout.
+    VkVertexInputBindingDescription vertexBindingDesc = {
+        0, // binding
+        3 * sizeof(float),
+        VK_VERTEX_INPUT_RATE_VERTEX
+    };
+    VkVertexInputAttributeDescription vertexAttrDesc[] = {
+                                                          { // position
+                                                              0, // location
+                                                              0, // binding
+                                                              VK_FORMAT_R32G32B32_SFLOAT,
+                                                              0 // offset
+                                                          },
+                                                          };
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo;
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.pNext = nullptr;
+    vertexInputInfo.flags = 0;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.pVertexBindingDescriptions = &vertexBindingDesc;
+    vertexInputInfo.vertexAttributeDescriptionCount = sizeof(vertexAttrDesc) / sizeof(vertexAttrDesc[0]);
+    vertexInputInfo.pVertexAttributeDescriptions = vertexAttrDesc;
+
     VkGraphicsPipelineCreateInfo pipelineInfo;
     memset(&pipelineInfo, 0, sizeof(pipelineInfo));
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -376,7 +693,7 @@ void Renderer::createFloorPipeline()
             nullptr,
             0,
             VK_SHADER_STAGE_VERTEX_BIT,
-            floorMaterial.vs.data()->shaderModule,
+            vs,
             "main",
             nullptr
         },
@@ -385,7 +702,7 @@ void Renderer::createFloorPipeline()
             nullptr,
             0,
             VK_SHADER_STAGE_FRAGMENT_BIT,
-            floorMaterial.fs.data()->shaderModule,
+            fs,
             "main",
             nullptr
         }
@@ -420,7 +737,7 @@ void Renderer::createFloorPipeline()
     VkPipelineMultisampleStateCreateInfo ms;
     memset(&ms, 0, sizeof(ms));
     ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    ms.rasterizationSamples = vkview->sampleCountFlagBits();
+    ms.rasterizationSamples = target->sampleCountFlagBits();
     pipelineInfo.pMultisampleState = &ms;
 
     VkPipelineDepthStencilStateCreateInfo ds;
@@ -450,19 +767,184 @@ void Renderer::createFloorPipeline()
     pipelineInfo.pDynamicState = &dyn;
 
     pipelineInfo.layout = floorMaterial.pipelineLayout;
-    pipelineInfo.renderPass = vkview->defaultRenderPass();
+    pipelineInfo.renderPass = target->defaultRenderPass();
 
-    err = devFuncs->vkCreateGraphicsPipelines(dev, pipelineCache, 1, &pipelineInfo, nullptr, &floorMaterial.pipeline);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create graphics pipeline: %d", err);
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult err = devFuncs->vkCreateGraphicsPipelines(dev, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create graphics pipeline: %d", err);
+        return VK_NULL_HANDLE;
+    }
+    return pipeline;
+}
+
+void Renderer::createCullPipeline()
+{
+    if (!cullShader.isValid()) {
+        qWarning("Culling shader not available, culling on the CPU");
+        return;
+    }
+    culler.create(devFuncs, target->device(), pipelineCache, cullShader.data()->shaderModule,
+                  target->concurrentFrameCount(), target->hostVisibleMemoryIndex(), target->deviceLocalMemoryIndex());
+}
+
+Shader *Renderer::shaderForSlot(int slot)
+{
+    switch (slot) {
+    case ItemVs:
+        return &itemMaterial.vs;
+    case ItemFs:
+        return &itemMaterial.fs;
+    case FloorVs:
+        return &floorMaterial.vs;
+    case FloorFs:
+        return &floorMaterial.fs;
+    case CullCs:
+        return &cullShader;
+    }
+    return nullptr;
+}
+
+// GUI thread. Several saves before the next frame boundary collapse into one
+// rebuild with the latest SPIR-V of each stage.
+void Renderer::shaderCompiled(const QString &source, const QByteArray &spirv)
+{
+    const int slot = shaderSources.value(source, -1);
+    if (slot < 0)
+        return;
+    {
+        QMutexLocker lock(&reloadMutex);
+        compiledShaders.insert(slot, spirv);
+    }
+    target->requestUpdate();
+}
+
+// Called by buildFrame() before anything is recorded. The pipelines of the
+// frames in flight are released once those frames have completed.
+void Renderer::applyShaderReloads()
+{
+    if (!reloadFuture.isFinished())
+        return;
+
+    if (reloadPending) {
+        reloadPending = false;
+        const ShaderReload reload = reloadFuture.result();
+        VkDevice dev = target->device();
+        if (reload.itemPipeline) {
+            VkPipeline old = itemMaterial.pipeline;
+            itemMaterial.pipeline = reload.itemPipeline;
+            deferRelease([this, dev, old] { devFuncs->vkDestroyPipeline(dev, old, nullptr); });
+        }
+        if (reload.floorPipeline) {
+            VkPipeline old = floorMaterial.pipeline;
+            floorMaterial.pipeline = reload.floorPipeline;
+            deferRelease([this, dev, old] { devFuncs->vkDestroyPipeline(dev, old, nullptr); });
+        }
+        if (reload.cullPipeline) {
+            VkPipeline old = culler.replacePipeline(reload.cullPipeline);
+            deferRelease([this, dev, old] { devFuncs->vkDestroyPipeline(dev, old, nullptr); });
+        }
+        // Pipelines do not reference their modules after creation.
+        for (int slot = 0; slot < ShaderSlotCount; ++slot) {
+            if (!reload.modules[slot])
+                continue;
+            Shader *shader = shaderForSlot(slot);
+            if (shader->isValid())
+                devFuncs->vkDestroyShaderModule(dev, shader->data()->shaderModule, nullptr);
+            shader->adopt(reload.modules[slot]);
+        }
+    }
+
+    QHash<int, QByteArray> spirv;
+    {
+        QMutexLocker lock(&reloadMutex);
+        spirv.swap(compiledShaders);
+    }
+    if (!spirv.isEmpty()) {
+        reloadFuture = QtConcurrent::run(&Renderer::rebuildPipelines, this, spirv);
+        reloadPending = true;
+    }
+}
+
+// Worker thread. Stages that did not change keep their current module, the
+// shaders are not touched until applyShaderReloads() has the result.
+Renderer::ShaderReload Renderer::rebuildPipelines(const QHash<int, QByteArray> &spirv)
+{
+    VkDevice dev = target->device();
+    QElapsedTimer timer;
+    timer.start();
+
+    ShaderReload reload;
+    for (auto it = spirv.cbegin(); it != spirv.cend(); ++it)
+        reload.modules[it.key()] = Shader::createModule(devFuncs, dev, it.value());
+    auto module = [this, &reload](int slot) {
+        return reload.modules[slot] ? reload.modules[slot] : shaderForSlot(slot)->data()->shaderModule;
+    };
+    auto drop = [this, dev, &reload](int slot) {
+        if (reload.modules[slot])
+            devFuncs->vkDestroyShaderModule(dev, reload.modules[slot], nullptr);
+        reload.modules[slot] = VK_NULL_HANDLE;
+    };
+
+    // A stage that fails to compile into a pipeline leaves the old one in place.
+    if (spirv.contains(ItemVs) || spirv.contains(ItemFs)) {
+        if (module(ItemVs) && module(ItemFs))
+            reload.itemPipeline = buildItemPipeline(module(ItemVs), module(ItemFs));
+        if (!reload.itemPipeline) {
+            drop(ItemVs);
+            drop(ItemFs);
+        }
+    }
+    if (spirv.contains(FloorVs) || spirv.contains(FloorFs)) {
+        if (module(FloorVs) && module(FloorFs))
+            reload.floorPipeline = buildFloorPipeline(module(FloorVs), module(FloorFs));
+        if (!reload.floorPipeline) {
+            drop(FloorVs);
+            drop(FloorFs);
+        }
+    }
+    if (spirv.contains(CullCs)) {
+        if (culler.isValid() && module(CullCs))
+            reload.cullPipeline = culler.createPipeline(pipelineCache, module(CullCs));
+        if (!reload.cullPipeline)
+            drop(CullCs);
+    }
+
+    if (DBG)
+        qDebug("Rebuilt pipelines for %d changed shader(s) in %.3f ms", int(spirv.size()),
+               timer.nsecsElapsed() / 1000000.0);
+    return reload;
+}
+
+void Renderer::destroyShaderReload(const ShaderReload &reload)
+{
+    VkDevice dev = target->device();
+    if (reload.itemPipeline)
+        devFuncs->vkDestroyPipeline(dev, reload.itemPipeline, nullptr);
+    if (reload.floorPipeline)
+        devFuncs->vkDestroyPipeline(dev, reload.floorPipeline, nullptr);
+    if (reload.cullPipeline)
+        devFuncs->vkDestroyPipeline(dev, reload.cullPipeline, nullptr);
+    for (VkShaderModule module : reload.modules) {
+        if (module)
+            devFuncs->vkDestroyShaderModule(dev, module, nullptr);
+    }
+}
+
+void Renderer::waitForAssets()
+{
+    pipelinesFuture.waitForFinished();
+    // A loaded mesh has its upload callback queued already, that runs at the
+    // start of the next frame.
+    for (Mesh &mesh : meshes)
+        mesh.data();
 }
 
 void Renderer::initSwapChainResources()
 {
-    proj = vkview->clipCorrectionMatrix();
-    const QSize sz = vkview->swapChainImageSize();
-    proj.perspective(45.0f, sz.width() / (float) sz.height(), 0.01f, 1000.0f);
-    markViewProjDirty();
+    proj = target->clipCorrectionMatrix();
+    const QSize sz = target->swapChainImageSize();
+    proj.perspective(45.0f, sz.width() / (float) sz.height(), 0.01f, FAR_PLANE);
 }
 
 void Renderer::releaseSwapChainResources()
@@ -474,7 +956,8 @@ void Renderer::releaseSwapChainResources()
     // from here.
     if (framePending) {
         framePending = false;
-        vkview->frameReady();
+        target->frameReady();
+        recordInputLatency();
     }
 }
 
@@ -484,8 +967,26 @@ void Renderer::releaseResources()
         qDebug("Renderer release");
 
     pipelinesFuture.waitForFinished();
+    reloadFuture.waitForFinished();
+    if (reloadPending) {
+        reloadPending = false;
+        destroyShaderReload(reloadFuture.result());
+    }
+    {
+        // compiled against the old device, the next edit triggers a new build
+        QMutexLocker lock(&reloadMutex);
+        compiledShaders.clear();
+    }
 
-    VkDevice dev = vkview->device();
+    VkDevice dev = target->device();
+
+    uploader.destroy();
+    runDeferredReleases(true);
+    destroyRecordSlots();
+
+    if (!profileTraceFileName.isEmpty() && profiler.writeChromeTrace(profileTraceFileName))
+        qDebug("Wrote GPU trace to %s", qPrintable(profileTraceFileName));
+    profiler.destroy();
 
     if (itemMaterial.descSetLayout) {
         devFuncs->vkDestroyDescriptorSetLayout(dev, itemMaterial.descSetLayout, nullptr);
@@ -495,6 +996,7 @@ void Renderer::releaseResources()
     if (itemMaterial.descPool) {
         devFuncs->vkDestroyDescriptorPool(dev, itemMaterial.descPool, nullptr);
         itemMaterial.descPool = VK_NULL_HANDLE;
+        itemMaterial.descSets.clear();
     }
 
     if (itemMaterial.pipeline) {
@@ -507,6 +1009,8 @@ void Renderer::releaseResources()
         itemMaterial.pipelineLayout = VK_NULL_HANDLE;
     }
 
+    culler.destroy();
+
     if (floorMaterial.pipeline) {
         devFuncs->vkDestroyPipeline(dev, floorMaterial.pipeline, nullptr);
         floorMaterial.pipeline = VK_NULL_HANDLE;
@@ -518,19 +1022,17 @@ void Renderer::releaseResources()
     }
 
     if (pipelineCache) {
+        savePipelineCache();
         devFuncs->vkDestroyPipelineCache(dev, pipelineCache, nullptr);
         pipelineCache = VK_NULL_HANDLE;
     }
 
-    if (blockVertexBuf) {
-        devFuncs->vkDestroyBuffer(dev, blockVertexBuf, nullptr);
-        blockVertexBuf = VK_NULL_HANDLE;
-    }
-
-    if (logoVertexBuf) {
-        devFuncs->vkDestroyBuffer(dev, logoVertexBuf, nullptr);
-        logoVertexBuf = VK_NULL_HANDLE;
-    }
+    uploadToken.reset();
+    destroyMeshBuffer(&placeholderMesh);
+    for (GpuMesh &gpuMesh : gpuMeshes)
+        destroyMeshBuffer(&gpuMesh);
+    itemDraws.clear();
+    itemDescriptorsWritten = false;
 
     if (floorVertexBuf) {
         devFuncs->vkDestroyBuffer(dev, floorVertexBuf, nullptr);
@@ -545,6 +1047,12 @@ void Renderer::releaseResources()
     if (bufMem) {
         devFuncs->vkFreeMemory(dev, bufMem, nullptr);
         bufMem = VK_NULL_HANDLE;
+        uniformRing.reset();
+    }
+
+    if (vertexBufMem) {
+        devFuncs->vkFreeMemory(dev, vertexBufMem, nullptr);
+        vertexBufMem = VK_NULL_HANDLE;
     }
 
     if (instBuf) {
@@ -555,6 +1063,20 @@ void Renderer::releaseResources()
     if (instBufMem) {
         devFuncs->vkFreeMemory(dev, instBufMem, nullptr);
         instBufMem = VK_NULL_HANDLE;
+        instMapped = nullptr;
+        instCapacity = 0;
+    }
+
+    if (cpuVisibleBuf) {
+        devFuncs->vkDestroyBuffer(dev, cpuVisibleBuf, nullptr);
+        cpuVisibleBuf = VK_NULL_HANDLE;
+    }
+
+    if (cpuVisibleMem) {
+        devFuncs->vkFreeMemory(dev, cpuVisibleMem, nullptr);
+        cpuVisibleMem = VK_NULL_HANDLE;
+        cpuVisibleMapped = nullptr;
+        cpuVisibleCapacity = 0;
     }
 
     if (itemMaterial.vs.isValid()) {
@@ -574,44 +1096,29 @@ void Renderer::releaseResources()
         devFuncs->vkDestroyShaderModule(dev, floorMaterial.fs.data()->shaderModule, nullptr);
         floorMaterial.fs.reset();
     }
+
+    if (cullShader.isValid()) {
+        devFuncs->vkDestroyShaderModule(dev, cullShader.data()->shaderModule, nullptr);
+        cullShader.reset();
+    }
 }
 
 void Renderer::ensureBuffers()
 {
-    if (blockVertexBuf)
+    if (floorVertexBuf)
         return;
 
-    VkDevice dev = vkview->device();
-    const int concurrentFrameCount = vkview->concurrentFrameCount();
+    VkDevice dev = target->device();
+    const int concurrentFrameCount = target->concurrentFrameCount();
 
-    // Vertex buffer for the block.
+    // Vertex buffer for the floor. The item meshes get buffers of their own
+    // once they are loaded, see createMeshBuffer().
     VkBufferCreateInfo bufInfo;
     memset(&bufInfo, 0, sizeof(bufInfo));
     bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    const int blockMeshByteCount = blockMesh.data()->vertexCount * 8 * sizeof(float);
-    bufInfo.size = blockMeshByteCount;
-    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &blockVertexBuf);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create vertex buffer: %d", err);
-
-    VkMemoryRequirements blockVertMemReq;
-    devFuncs->vkGetBufferMemoryRequirements(dev, blockVertexBuf, &blockVertMemReq);
-
-    // Vertex buffer for the logo.
-    const int logoMeshByteCount = logoMesh.data()->vertexCount * 8 * sizeof(float);
-    bufInfo.size = logoMeshByteCount;
-    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &logoVertexBuf);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create vertex buffer: %d", err);
-
-    VkMemoryRequirements logoVertMemReq;
-    devFuncs->vkGetBufferMemoryRequirements(dev, logoVertexBuf, &logoVertMemReq);
-
-    // Vertex buffer for the floor.
     bufInfo.size = sizeof(quadVert);
-    err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &floorVertexBuf);
+    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &floorVertexBuf);
     if (err != VK_SUCCESS)
         qFatal("Failed to create vertex buffer: %d", err);
 
@@ -619,9 +1126,15 @@ void Renderer::ensureBuffers()
     devFuncs->vkGetBufferMemoryRequirements(dev, floorVertexBuf, &floorVertMemReq);
 
     // Uniform buffer. Instead of using multiple descriptor sets, we take a
-    // different approach: have a single dynamic uniform buffer and specify the
-    // active-frame-specific offset at the time of binding the descriptor set.
-    bufInfo.size = (itemMaterial.vertUniSize + itemMaterial.fragUniSize) * concurrentFrameCount;
+    // different approach: have a single dynamic uniform buffer, sub-allocate
+    // the blocks of every frame from it and specify their offsets at the time
+    // of binding the descriptor set. A frame takes at most a vertex block per
+    // mesh and a fragment block per material of the scene, see
+    // writeItemUniforms().
+    const VkDeviceSize uniFrameSize = qMax(MIN_UNIFORM_RING_FRAME_SIZE,
+                                           scene.meshCount() * itemMaterial.vertUniSize
+                                           + scene.materialCount() * itemMaterial.fragUniSize);
+    bufInfo.size = UniformRing::bufferSize(uniFrameSize, concurrentFrameCount);
     bufInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
     err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &uniBuf);
     if (err != VK_SUCCESS)
@@ -630,157 +1143,645 @@ void Renderer::ensureBuffers()
     VkMemoryRequirements uniMemReq;
     devFuncs->vkGetBufferMemoryRequirements(dev, uniBuf, &uniMemReq);
 
-    // Allocate memory for everything at once.
-    VkDeviceSize logoVertStartOffset = aligned(0 + blockVertMemReq.size, logoVertMemReq.alignment);
-    VkDeviceSize floorVertStartOffset = aligned(logoVertStartOffset + logoVertMemReq.size, floorVertMemReq.alignment);
-    itemMaterial.uniMemStartOffset = aligned(floorVertStartOffset + floorVertMemReq.size, uniMemReq.alignment);
+    // Static geometry lives in device-local memory.
     VkMemoryAllocateInfo memAllocInfo = {
         VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
         nullptr,
-        itemMaterial.uniMemStartOffset + uniMemReq.size,
-        vkview->hostVisibleMemoryIndex()
+        floorVertMemReq.size,
+        target->deviceLocalMemoryIndex()
     };
-    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &bufMem);
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &vertexBufMem);
     if (err != VK_SUCCESS)
         qFatal("Failed to allocate memory: %d", err);
 
-    err = devFuncs->vkBindBufferMemory(dev, blockVertexBuf, bufMem, 0);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = devFuncs->vkBindBufferMemory(dev, logoVertexBuf, bufMem, logoVertStartOffset);
+    err = devFuncs->vkBindBufferMemory(dev, floorVertexBuf, vertexBufMem, 0);
     if (err != VK_SUCCESS)
         qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = devFuncs->vkBindBufferMemory(dev, floorVertexBuf, bufMem, floorVertStartOffset);
+
+    // Only the per-frame uniform data stays in host-visible memory.
+    memAllocInfo.allocationSize = uniMemReq.size;
+    memAllocInfo.memoryTypeIndex = target->hostVisibleMemoryIndex();
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &bufMem);
     if (err != VK_SUCCESS)
-        qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = devFuncs->vkBindBufferMemory(dev, uniBuf, bufMem, itemMaterial.uniMemStartOffset);
+        qFatal("Failed to allocate memory: %d", err);
+    err = devFuncs->vkBindBufferMemory(dev, uniBuf, bufMem, 0);
     if (err != VK_SUCCESS)
         qFatal("Failed to bind uniform buffer memory: %d", err);
 
-    // Copy vertex data.
-    quint8 *p;
-    err = devFuncs->vkMapMemory(dev, bufMem, 0, itemMaterial.uniMemStartOffset, 0, reinterpret_cast<void **>(&p));
+    // Mapped once, for as long as the memory exists.
+    quint8 *uniMapped;
+    err = devFuncs->vkMapMemory(dev, bufMem, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&uniMapped));
     if (err != VK_SUCCESS)
         qFatal("Failed to map memory: %d", err);
-    memcpy(p, blockMesh.data()->geom.constData(), blockMeshByteCount);
-    memcpy(p + logoVertStartOffset, logoMesh.data()->geom.constData(), logoMeshByteCount);
-    memcpy(p + floorVertStartOffset, quadVert, sizeof(quadVert));
-    devFuncs->vkUnmapMemory(dev, bufMem);
+    uniformRing.create(uniMapped, uniFrameSize, concurrentFrameCount,
+                       target->physicalDeviceProperties()->limits.minUniformBufferOffsetAlignment);
+
+    // Copy vertex data. Both copies go out in one submission that is ordered
+    // before this frame's command buffer on the same queue. buildFrame() runs
+    // while the GUI thread waits for frameReady(), so nothing else submits to
+    // the graphics queue meanwhile.
+    createMeshBuffer(&placeholderMesh, Mesh::placeholder(vertexFormat));
+    uploader.upload(floorVertexBuf, 0, quadVert, sizeof(quadVert));
+    uploader.flush();
+}
+
+// The descriptor set comes from createItemPipeline(), so this waits for the
+// pipelines.
+void Renderer::writeItemDescriptors()
+{
+    if (itemDescriptorsWritten)
+        return;
+    itemDescriptorsWritten = true;
+
+    VkDevice dev = target->device();
 
     // Write descriptors for the uniform buffers in the vertex and fragment shaders.
     VkDescriptorBufferInfo vertUni = { uniBuf, 0, itemMaterial.vertUniSize };
-    VkDescriptorBufferInfo fragUni = { uniBuf, itemMaterial.vertUniSize, itemMaterial.fragUniSize };
+    VkDescriptorBufferInfo fragUni = { uniBuf, 0, itemMaterial.fragUniSize };
+
+    for (VkDescriptorSet descSet : std::as_const(itemMaterial.descSets)) {
+        VkWriteDescriptorSet descWrite[2];
+        memset(descWrite, 0, sizeof(descWrite));
+        descWrite[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descWrite[0].dstSet = descSet;
+        descWrite[0].dstBinding = 0;
+        descWrite[0].descriptorCount = 1;
+        descWrite[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        descWrite[0].pBufferInfo = &vertUni;
+
+        descWrite[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descWrite[1].dstSet = descSet;
+        descWrite[1].dstBinding = 1;
+        descWrite[1].descriptorCount = 1;
+        descWrite[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        descWrite[1].pBufferInfo = &fragUni;
+
+        devFuncs->vkUpdateDescriptorSets(dev, 2, descWrite, 0, nullptr);
+    }
+}
 
-    VkWriteDescriptorSet descWrite[2];
-    memset(descWrite, 0, sizeof(descWrite));
-    descWrite[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descWrite[0].dstSet = itemMaterial.descSet;
-    descWrite[0].dstBinding = 0;
-    descWrite[0].descriptorCount = 1;
-    descWrite[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    descWrite[0].pBufferInfo = &vertUni;
+// The transforms the item draws of this frame read, the set of this frame
+// slot is not used by any pending frame.
+void Renderer::writeTransformDescriptor(VkBuffer buf, VkDeviceSize offset, VkDeviceSize range)
+{
+    VkDescriptorBufferInfo transforms = { buf, offset, range };
+    VkWriteDescriptorSet descWrite;
+    memset(&descWrite, 0, sizeof(descWrite));
+    descWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descWrite.dstSet = itemMaterial.descSets[target->currentFrame()];
+    descWrite.dstBinding = 2;
+    descWrite.descriptorCount = 1;
+    descWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descWrite.pBufferInfo = &transforms;
+    devFuncs->vkUpdateDescriptorSets(target->device(), 1, &descWrite, 0, nullptr);
+}
 
-    descWrite[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descWrite[1].dstSet = itemMaterial.descSet;
-    descWrite[1].dstBinding = 1;
-    descWrite[1].descriptorCount = 1;
-    descWrite[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    descWrite[1].pBufferInfo = &fragUni;
+void Renderer::createMeshBuffer(GpuMesh *gpuMesh, const MeshData &md)
+{
+    VkDevice dev = target->device();
+
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = md.geomByteCount() + md.indexByteCount();
+    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+            | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &gpuMesh->buf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create vertex buffer: %d", err);
 
-    devFuncs->vkUpdateDescriptorSets(dev, 2, descWrite, 0, nullptr);
+    VkMemoryRequirements memReq;
+    devFuncs->vkGetBufferMemoryRequirements(dev, gpuMesh->buf, &memReq);
+    VkMemoryAllocateInfo memAllocInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        nullptr,
+        memReq.size,
+        target->deviceLocalMemoryIndex()
+    };
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &gpuMesh->mem);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate memory: %d", err);
+    err = devFuncs->vkBindBufferMemory(dev, gpuMesh->buf, gpuMesh->mem, 0);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind vertex buffer memory: %d", err);
+
+    // The payload is read straight from the mapped .buf file into the
+    // staging ring, the caller flushes.
+    uploader.upload(gpuMesh->buf, 0, md.geomData(), md.geomByteCount());
+    if (md.isIndexed())
+        uploader.upload(gpuMesh->buf, md.geomByteCount(), md.indexData(), md.indexByteCount());
+    gpuMesh->data = md;
 }
 
-void Renderer::ensureInstanceBuffer()
+void Renderer::destroyMeshBuffer(GpuMesh *gpuMesh)
 {
-    if (instCount == preparedInstCount && instBuf)
+    VkDevice dev = target->device();
+    if (gpuMesh->buf) {
+        devFuncs->vkDestroyBuffer(dev, gpuMesh->buf, nullptr);
+        gpuMesh->buf = VK_NULL_HANDLE;
+    }
+    if (gpuMesh->mem) {
+        devFuncs->vkFreeMemory(dev, gpuMesh->mem, nullptr);
+        gpuMesh->mem = VK_NULL_HANDLE;
+    }
+    gpuMesh->data = MeshData();
+}
+
+void Renderer::uploadWhenLoaded(int mesh)
+{
+    QWeakPointer<bool> token = uploadToken;
+    meshes[mesh].handle().whenLoaded([this, token, mesh](const MeshData &md) {
+        // Runs in buildFrame(), after ensureBuffers().
+        GpuMesh *gpuMesh = &gpuMeshes[mesh];
+        if (token.isNull() || gpuMesh->buf || !md.isValid())
+            return;
+        createMeshBuffer(gpuMesh, md);
+        if (DBG)
+            qDebug("Uploaded mesh with %d vertices, %d indices", md.vertexCount, md.indexCount);
+    });
+}
+
+const Renderer::GpuMesh *Renderer::gpuMesh(int mesh) const
+{
+    return mesh >= 0 && gpuMeshes[mesh].buf ? &gpuMeshes[mesh] : &placeholderMesh;
+}
+
+// KEYFRAME_SCENE=file.json draws another scene than the default one, see
+// Scene::load() and resource/scenes/default.json for the format.
+void Renderer::loadScene()
+{
+    QString fileName = qEnvironmentVariable("KEYFRAME_SCENE");
+    if (fileName.isEmpty())
+        fileName = QString(SCENE_DIR) + "/default.json";
+    scene.load(fileName);
+    spawnBegin = scene.entityCount();
+
+    // What the first frames show loads first, the other meshes can wait.
+    QVector<bool> shown(scene.meshCount(), false);
+    for (int entity = 0; entity < scene.entityCount(); ++entity) {
+        if (scene.meshOf(entity) >= 0)
+            shown[scene.meshOf(entity)] = true;
+    }
+    if (scene.spawner().entity >= 0)
+        shown[scene.spawner().meshes.first()] = true;
+    meshes.resize(scene.meshCount());
+    gpuMeshes.resize(scene.meshCount());
+    for (int mesh = 0; mesh < scene.meshCount(); ++mesh)
+        meshes[mesh].load(scene.mesh(mesh).fileName, vertexFormat, shown[mesh] ? AssetManager::High : AssetManager::Low);
+    if (DBG)
+        qDebug("Loaded scene %s: %d meshes, %d materials, %d entities", qPrintable(fileName), scene.meshCount(),
+               scene.materialCount(), scene.entityCount());
+}
+
+void Renderer::addRange(QVector<InstanceRange> *ranges, int begin, int end)
+{
+    if (begin >= end)
         return;
+    // Keep the ranges sorted and merge anything that overlaps or touches.
+    int i = 0;
+    while (i < ranges->size() && (*ranges)[i].end < begin)
+        ++i;
+    while (i < ranges->size() && (*ranges)[i].begin <= end) {
+        begin = qMin(begin, (*ranges)[i].begin);
+        end = qMax(end, (*ranges)[i].end);
+        ranges->removeAt(i);
+    }
+    ranges->insert(i, { begin, end });
+}
 
-    Q_ASSERT(instCount <= MAX_INSTANCES);
+// Every region of the instance buffer gets the change once its frame comes
+// around again.
+void Renderer::markInstancesDirty(int begin, int end)
+{
+    for (QVector<InstanceRange> &ranges : dirtyInstances)
+        addRange(&ranges, begin, end);
+}
 
-    VkDevice dev = vkview->device();
+void Renderer::markTransformsDirty(int begin, int end)
+{
+    for (QVector<InstanceRange> &ranges : dirtyTransforms)
+        addRange(&ranges, begin, end);
+    addRange(&unculledTransforms, begin, end);
+}
 
-    // allocate only once, for the maximum instance count
+// Creates a host-visible, persistently mapped instance buffer of regions
+// regions for capacity instances each, see instanceRegionSize(). Returns false
+// when the device is out of memory.
+bool Renderer::createInstanceBuffer(int capacity, int regions, VkBuffer *buf, VkDeviceMemory *mem, quint8 **mapped)
+{
+    VkDevice dev = target->device();
+
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = regions * instanceRegionSize(capacity);
+    // storage for the culling pre-pass and the transforms the vertex shader reads
+    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, buf);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create instance buffer: %d", err);
+        *buf = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkMemoryRequirements memReq;
+    devFuncs->vkGetBufferMemoryRequirements(dev, *buf, &memReq);
+    if (DBG)
+        qDebug("Allocating %llu bytes for %d instances", (unsigned long long) memReq.size, regions * capacity);
+
+    VkMemoryAllocateInfo memAllocInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        nullptr,
+        memReq.size,
+        target->hostVisibleMemoryIndex()
+    };
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, mem);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to allocate %llu bytes of instance memory: %d", (unsigned long long) memReq.size, err);
+        devFuncs->vkDestroyBuffer(dev, *buf, nullptr);
+        *buf = VK_NULL_HANDLE;
+        return false;
+    }
+
+    err = devFuncs->vkBindBufferMemory(dev, *buf, *mem, 0);
+    if (err == VK_SUCCESS)
+        err = devFuncs->vkMapMemory(dev, *mem, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(mapped));
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to bind or map instance memory: %d", err);
+        devFuncs->vkDestroyBuffer(dev, *buf, nullptr);
+        devFuncs->vkFreeMemory(dev, *mem, nullptr);
+        *buf = VK_NULL_HANDLE;
+        *mem = VK_NULL_HANDLE;
+        return false;
+    }
+
+    return true;
+}
+
+// The transforms of all instances are bound as one storage buffer range.
+int Renderer::maxInstanceCapacity() const
+{
+    return int(target->physicalDeviceProperties()->limits.maxStorageBufferRange / PER_INSTANCE_TRANSFORM_SIZE);
+}
+
+// Returns false when count instances do not fit, either for lack of memory,
+// the old buffer stays then, or beyond maxInstanceCapacity(), up to which
+// the buffer grows.
+bool Renderer::growInstanceBuffer(int count)
+{
+    const int maxCapacity = maxInstanceCapacity();
+    int capacity = instCapacity;
+    while (capacity < count && capacity < maxCapacity)
+        capacity = capacity > maxCapacity / 2 ? maxCapacity : capacity * 2;
+    if (count > maxCapacity)
+        qWarning("At most %d instances fit into the storage buffer range of the device", maxCapacity);
+
+    VkBuffer buf;
+    VkDeviceMemory mem;
+    quint8 *mapped;
+    if (capacity == instCapacity
+        || !createInstanceBuffer(capacity, target->concurrentFrameCount(), &buf, &mem, &mapped))
+        return false;
+
+    // The old buffer may still be read by frames in flight.
+    VkBuffer oldBuf = instBuf;
+    VkDeviceMemory oldMem = instBufMem;
+    deferRelease([this, oldBuf, oldMem] {
+        VkDevice dev = target->device();
+        devFuncs->vkDestroyBuffer(dev, oldBuf, nullptr);
+        devFuncs->vkFreeMemory(dev, oldMem, nullptr);
+    });
+
+    if (DBG)
+        qDebug("Grew instance buffer from %d to %d instances", instCapacity, capacity);
+
+    instBuf = buf;
+    instBufMem = mem;
+    instMapped = mapped;
+    instCapacity = capacity;
+    instData.resize(capacity * PER_INSTANCE_DATA_SIZE);
+    transformData.resize(capacity * PER_INSTANCE_TRANSFORM_SIZE);
+
+    // instData and transformData hold everything prepared so far, every
+    // region of the new buffer is filled from them as its frame comes up.
+    // Copying the old buffer on the GPU instead would race the host, which
+    // writes a region right before its frame, not after the copy has run.
+    markInstancesDirty(0, itemCount);
+    markTransformsDirty(0, itemCount);
+    return capacity >= count;
+}
+
+void Renderer::ensureInstanceBuffer()
+{
+    spawnInstances();
+    scene.update();
+    int changedFrom = scene.changedFrom();
+    bool reordered = scene.drawListChanged();
+
+    // The items come last in the draw list, the instance buffer holds them
+    // in draw order.
+    int itemBegin;
+    int count;
+    auto itemRange = [this, &itemBegin, &count] {
+        const std::vector<Scene::Batch> &batches = scene.batches();
+        itemBegin = int(scene.drawOrder().size());
+        for (auto it = batches.rbegin(); it != batches.rend() && it->pipeline == Scene::Items; ++it)
+            itemBegin = it->first;
+        count = int(scene.drawOrder().size()) - itemBegin;
+    };
+    itemRange();
+
+    // Start small and double the capacity whenever the instance count
+    // outgrows it, up to the device memory and maxInstanceCapacity().
     if (!instBuf) {
-        VkBufferCreateInfo bufInfo;
-        memset(&bufInfo, 0, sizeof(bufInfo));
-        bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        bufInfo.size = MAX_INSTANCES * PER_INSTANCE_DATA_SIZE;
-        bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+        int capacity = INITIAL_INSTANCE_CAPACITY;
+        while (capacity < count && capacity < maxInstanceCapacity())
+            capacity = qMin(capacity * 2, maxInstanceCapacity());
+        // A region per frame in flight, so that the host never writes what a
+        // pending frame reads. Without memory for all instances, start small,
+        // those that do not fit are dropped below.
+        bool created = createInstanceBuffer(capacity, target->concurrentFrameCount(), &instBuf, &instBufMem,
+                                            &instMapped);
+        if (!created && capacity > INITIAL_INSTANCE_CAPACITY) {
+            capacity = INITIAL_INSTANCE_CAPACITY;
+            created = createInstanceBuffer(capacity, target->concurrentFrameCount(), &instBuf, &instBufMem,
+                                           &instMapped);
+        }
+        if (!created)
+            qFatal("Failed to create instance buffer");
+        instCapacity = capacity;
+        dirtyInstances.fill({}, target->concurrentFrameCount());
+        dirtyTransforms.fill({}, target->concurrentFrameCount());
 
         // Keep a copy of the data since we may lose all graphics resources on
         // unexpose, and reinitializing to new random positions afterwards
         // would not be nice.
-        instData.resize(bufInfo.size);
-
-        VkResult err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &instBuf);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to create instance buffer: %d", err);
+        if (instData.size() < qsizetype(capacity * PER_INSTANCE_DATA_SIZE))
+            instData.resize(capacity * PER_INSTANCE_DATA_SIZE);
+        if (transformData.size() < qsizetype(capacity * PER_INSTANCE_TRANSFORM_SIZE))
+            transformData.resize(capacity * PER_INSTANCE_TRANSFORM_SIZE);
+
+        // A new buffer has none of the instances prepared before.
+        markInstancesDirty(0, itemCount);
+        markTransformsDirty(0, itemCount);
+    }
 
-        VkMemoryRequirements memReq;
-        devFuncs->vkGetBufferMemoryRequirements(dev, instBuf, &memReq);
-        if (DBG)
-            qDebug("Allocating %u bytes for instance data", uint32_t(memReq.size));
+    if (count > instCapacity && !growInstanceBuffer(count)) {
+        // drop the spawned instances that do not fit
+        preparedInstCount = instCount = qMax(0, preparedInstCount - (count - instCapacity));
+        qWarning("Instance count limited to %d", instCount);
+        scene.truncate(spawnBegin + preparedInstCount);
+        if (animationRequested)
+            animator.resize(preparedInstCount);
+        scene.update();
+        changedFrom = qMin(changedFrom, scene.changedFrom());
+        reordered = true;
+        itemRange();
+        // the items of the scene file alone may not fit either
+        count = qMin(count, instCapacity);
+    }
 
-        VkMemoryAllocateInfo memAllocInfo = {
-            VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            nullptr,
-            memReq.size,
-            vkview->hostVisibleMemoryIndex()
-        };
-        err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &instBufMem);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to allocate memory: %d", err);
+    if (reordered || changedFrom < scene.entityCount() || count != itemCount)
+        gatherInstances(itemBegin, count, changedFrom);
+    uploadDirtyInstances();
+}
 
-        err = devFuncs->vkBindBufferMemory(dev, instBuf, instBufMem, 0);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to bind instance buffer memory: %d", err);
-    }
+// The instances addNew() asks for are children of the spawner, after all
+// entities of the scene file.
+void Renderer::spawnInstances()
+{
+    const Scene::Spawner &spawner = scene.spawner();
+    if (spawner.entity < 0 || instCount == preparedInstCount)
+        return;
 
-    if (instCount != preparedInstCount) {
+    if (instCount < preparedInstCount) {
+        scene.truncate(spawnBegin + instCount);
+        if (animationRequested)
+            animator.resize(instCount);
+    } else {
         if (DBG)
             qDebug("Preparing instances %d..%d", preparedInstCount, instCount - 1);
-        char *p = instData.data();
-        p += preparedInstCount * PER_INSTANCE_DATA_SIZE;
-        auto gen = [](int a, int b) {
-            return float(QRandomGenerator::global()->bounded(double(b - a)) + a);
+        auto gen = [this](int a, int b) {
+            return float(random.bounded(double(b - a)) + a);
         };
+        if (animationRequested)
+            animator.resize(instCount);
+        const int mesh = spawner.meshes.value(spawnMesh, spawner.meshes.first());
         for (int i = preparedInstCount; i < instCount; ++i) {
-            // Apply a random translation to each instance of the mesh.
-            float t[] = { gen(-5, 5), gen(-4, 6), gen(-30, 5) };
-            memcpy(p, t, 12);
+            // Apply a random translation to each instance of the mesh, no
+            // rotation and no scale of its own.
+            Scene::Transform t;
+            t.translate[0] = gen(-5, 5);
+            t.translate[1] = gen(-4, 6);
+            t.translate[2] = gen(-30, 5);
+            if (animationRequested)
+                addInstanceTracks(i, t.translate);
             // Apply a random adjustment to the diffuse color for each instance. (default is 0.7)
-            float d[] = { gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f };
-            memcpy(p + 12, d, 12);
-            p += PER_INSTANCE_DATA_SIZE;
+            const QVector3D tint(gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f);
+            scene.addEntity(spawner.entity, mesh, spawner.material, t, tint);
         }
-        preparedInstCount = instCount;
     }
+    preparedInstCount = instCount;
+}
 
-    quint8 *p;
-    VkResult err = devFuncs->vkMapMemory(dev, instBufMem, 0, instCount * PER_INSTANCE_DATA_SIZE, 0,
-                                           reinterpret_cast<void **>(&p));
-    if (err != VK_SUCCESS)
-        qFatal("Failed to map memory: %d", err);
-    memcpy(p, instData.constData(), instData.size());
-    devFuncs->vkUnmapMemory(dev, instBufMem);
+// Copies the tints and world transforms of the item entities into instData
+// and transformData in draw order and schedules what changed for upload: the
+// instances whose slot now holds another entity, and the transforms of the
+// entities from changedFrom on. One pass over the items, whatever changed.
+void Renderer::gatherInstances(int itemBegin, int count, int changedFrom)
+{
+    const quint32 *entities = scene.drawOrder().data() + itemBegin;
+    const Scene::Transform *worlds = scene.worldTransforms();
+    const QVector3D *tints = scene.tints();
+    const int kept = qMin(itemCount, count);
+    itemEntities.resize(count);
+
+    // dirty runs, -1 while there is none
+    int instRun = -1;
+    int transformRun = -1;
+    for (int i = 0; i < count; ++i) {
+        const quint32 e = entities[i];
+        const bool moved = i >= kept || itemEntities[i] != e;
+        if (moved) {
+            itemEntities[i] = e;
+            memcpy(instData.data() + i * PER_INSTANCE_DATA_SIZE, &tints[e], PER_INSTANCE_DATA_SIZE);
+            if (instRun < 0)
+                instRun = i;
+        } else if (instRun >= 0) {
+            markInstancesDirty(instRun, i);
+            instRun = -1;
+        }
+        if (moved || int(e) >= changedFrom) {
+            memcpy(transformData.data() + i * PER_INSTANCE_TRANSFORM_SIZE, &worlds[e], PER_INSTANCE_TRANSFORM_SIZE);
+            if (transformRun < 0)
+                transformRun = i;
+        } else if (transformRun >= 0) {
+            markTransformsDirty(transformRun, i);
+            transformRun = -1;
+        }
+    }
+    if (instRun >= 0)
+        markInstancesDirty(instRun, count);
+    if (transformRun >= 0)
+        markTransformsDirty(transformRun, count);
+    itemCount = count;
 }
 
-void Renderer::getMatrices(QMatrix4x4 *vp, QMatrix4x4 *model, QMatrix3x3 *modelNormal, QVector3D *eyePos)
+// Only the ranges that changed since this frame's region was last written go
+// to the GPU. Its previous frame has been waited for, nothing reads the region
+// now. Attributes and transforms are tracked apart, animation only touches the
+// transforms.
+void Renderer::uploadDirtyInstances()
 {
-    model->setToIdentity();
-    if (useLogo)
-        model->rotate(90, 1, 0, 0);
-    model->rotate(rotation, 1, 1, 0);
+    const int frame = target->currentFrame();
+    quint8 *region = instMapped + VkDeviceSize(frame) * instanceRegionSize(instCapacity);
+    for (const InstanceRange &r : std::as_const(dirtyInstances[frame])) {
+        const VkDeviceSize ofs = r.begin * PER_INSTANCE_DATA_SIZE;
+        const VkDeviceSize size = (r.end - r.begin) * PER_INSTANCE_DATA_SIZE;
+        memcpy(region + ofs, instData.constData() + ofs, size);
+        frameUploadBytes += size;
+    }
+    quint8 *transformMapped = region + transformOffset(instCapacity);
+    for (const InstanceRange &r : std::as_const(dirtyTransforms[frame])) {
+        const VkDeviceSize ofs = r.begin * PER_INSTANCE_TRANSFORM_SIZE;
+        const VkDeviceSize size = (r.end - r.begin) * PER_INSTANCE_TRANSFORM_SIZE;
+        memcpy(transformMapped + ofs, transformData.constData() + ofs, size);
+        frameUploadBytes += size;
+    }
+    dirtyInstances[frame].clear();
+    dirtyTransforms[frame].clear();
+
+    // The CPU culler keeps its own copy of the positions, and only learns
+    // how far rotation and scale may take the mesh from them.
+    cpuCuller.resize(itemCount);
+    for (const InstanceRange &r : std::as_const(unculledTransforms)) {
+        for (int i = r.begin; i < qMin(r.end, itemCount); ++i) {
+            const float *t = reinterpret_cast<const float *>(transformData.constData() + i * PER_INSTANCE_TRANSFORM_SIZE);
+            cpuCuller.setPosition(i, t + 4);
+            instancesTransformed |= qAbs(t[3]) < 1.0f || t[7] != 1.0f;
+            maxInstanceScale = qMax(maxInstanceScale, qAbs(t[7]));
+        }
+    }
+    unculledTransforms.clear();
+}
 
-    *modelNormal = model->normalMatrix();
+// A closed path of random keys around the position, each instance with a
+// different interpolation and speed, a turn about a random axis and a pulse
+// of its scale.
+void Renderer::addInstanceTracks(int instance, const float *translate)
+{
+    auto gen = [this](float a, float b) {
+        return float(random.bounded(double(b - a)) + a);
+    };
+    const Animator::Interpolation interpolation = Animator::Interpolation(random.bounded(3));
+    QVector<Animator::Key> keys(ANIMATION_KEYS);
+    float time = 0.0f;
+    for (int k = 0; k < ANIMATION_KEYS; ++k) {
+        Animator::Key &key = keys[k];
+        key.time = time;
+        time += gen(0.5f, 2.0f);
+        key.interpolation = interpolation;
+        for (int c = 0; c < 3; ++c) {
+            key.value[c] = k == 0 || k == ANIMATION_KEYS - 1 ? translate[c] : translate[c] + gen(-1.0f, 1.0f);
+            key.inTangent[c] = key.outTangent[c] = gen(-2.0f, 2.0f);
+        }
+    }
+    keys.last().inTangent[0] = keys.first().outTangent[0];
+    keys.last().inTangent[1] = keys.first().outTangent[1];
+    keys.last().inTangent[2] = keys.first().outTangent[2];
+    animator.setTrack(instance, Animator::Translation, keys);
+
+    QVector3D axis(gen(-1.0f, 1.0f), gen(-1.0f, 1.0f), gen(-1.0f, 1.0f));
+    if (axis.isNull())
+        axis = QVector3D(0.0f, 1.0f, 0.0f);
+    axis.normalize();
+    const float turnTime = gen(2.0f, 8.0f);
+    QVector<Animator::Key> rotationKeys(ANIMATION_ROTATION_KEYS);
+    for (int k = 0; k < ANIMATION_ROTATION_KEYS; ++k) {
+        Animator::Key &key = rotationKeys[k];
+        key.time = k * turnTime / (ANIMATION_ROTATION_KEYS - 1);
+        const QQuaternion q = QQuaternion::fromAxisAndAngle(axis, k * 360.0f / (ANIMATION_ROTATION_KEYS - 1));
+        key.value[0] = q.x();
+        key.value[1] = q.y();
+        key.value[2] = q.z();
+        key.value[3] = q.scalar();
+    }
+    animator.setTrack(instance, Animator::Rotation, rotationKeys);
+
+    // uniform, the transforms only have room for one factor
+    const float pulseTime = gen(1.0f, 4.0f);
+    const float pulse = gen(0.6f, 1.4f);
+    QVector<Animator::Key> scaleKeys(3);
+    for (int k = 0; k < 3; ++k) {
+        Animator::Key &key = scaleKeys[k];
+        key.time = k * pulseTime / 2;
+        key.interpolation = Animator::Bezier;
+        std::fill(key.value, key.value + 3, k == 1 ? pulse : 1.0f);
+    }
+    animator.setTrack(instance, Animator::Scale, scaleKeys);
+}
 
+// Evaluates the tracks straight into the local transforms of the spawned
+// entities, the scene propagates them and the world transforms go to the GPU
+// and the CPU culler with the next upload. The attributes stay as they are.
+void Renderer::animateInstances()
+{
+    const int count = qMin(animator.size(), preparedInstCount);
+    if (!count)
+        return;
+    animationTime += ANIMATION_FRAME_TIME;
+    float *transforms = reinterpret_cast<float *>(scene.localTransforms(spawnBegin, spawnBegin + count));
+    const int stride = int(PER_INSTANCE_TRANSFORM_SIZE / sizeof(float));
+    animator.evaluate(Animator::Rotation, animationTime, transforms, stride);
+    animator.evaluate(Animator::Translation, animationTime, transforms + 4, stride);
+    // the scale track has three components, the transform takes the first
+    animatedScales.resize(size_t(animator.size()) * 3);
+    animator.evaluate(Animator::Scale, animationTime, animatedScales.data(), 3);
+    for (int i = 0; i < count; ++i)
+        transforms[i * stride + 7] = animatedScales[size_t(i) * 3];
+}
+
+void Renderer::deferRelease(std::function<void()> release)
+{
+    deferredReleases.append({ frameCounter, std::move(release) });
+}
+
+// The target waits for the fence of a frame slot before reusing it, so
+// after concurrentFrameCount frames everything recorded before has completed.
+void Renderer::runDeferredReleases(bool all)
+{
+    const quint64 frames = quint64(target->concurrentFrameCount());
+    int i = 0;
+    while (i < deferredReleases.size()) {
+        if (all || frameCounter >= deferredReleases[i].frame + frames) {
+            deferredReleases[i].release();
+            deferredReleases.removeAt(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void Renderer::getMatrices(QMatrix4x4 *vp, QVector3D *eyePos)
+{
     QMatrix4x4 view = cam.viewMatrix();
     *vp = proj * view;
 
     *eyePos = view.inverted().column(3).toVector3D();
 }
 
-void Renderer::writeFragUni(quint8 *p, const QVector3D &eyePos)
+// The orientation of the mesh in the scene, then the spin all items share.
+QMatrix4x4 Renderer::itemModel(int mesh) const
+{
+    const float *q = scene.mesh(mesh).rotation;
+    QMatrix4x4 model;
+    model.rotate(QQuaternion(q[3], q[0], q[1], q[2]));
+    model.rotate(rotation, 1, 1, 0);
+    return model;
+}
+
+void Renderer::writeFragUni(quint8 *p, const QVector3D &eyePos, const float *diffuse)
 {
     float ECCameraPosition[] = { eyePos.x(), eyePos.y(), eyePos.z() };
     memcpy(p, ECCameraPosition, 12);
@@ -791,8 +1792,7 @@ void Renderer::writeFragUni(quint8 *p, const QVector3D &eyePos)
     memcpy(p, ka, 12);
     p += 16;
 
-    float kd[] = { 0.7f, 0.7f, 0.7f };
-    memcpy(p, kd, 12);
+    memcpy(p, diffuse, 12);
     p += 16;
 
     float ks[] = { 0.66f, 0.66f, 0.66f };
@@ -834,14 +1834,94 @@ void Renderer::startNextFrame()
 
 void Renderer::buildFrame()
 {
-    QMutexLocker locker(&guiMutex);
+    ++frameCounter;
+    runDeferredReleases(false);
+    applyInput();
+    advanceCullBench();
+
+    if (instCount < stressInstanceTarget) {
+        instCount = qMin(qMax(instCount * 2, 16), stressInstanceTarget);
+        qDebug("Stress test: %d instances", instCount);
+    }
 
+    frameUploadBytes = 0;
     ensureBuffers();
+    // Meshes that finished loading since the last frame go into the upload
+    // queue now and are drawn from this frame on.
+    if (AssetManager::instance()->processCompleted())
+        uploader.flush();
+    if (animationRequested && animatingStatus)
+        animateInstances();
     ensureInstanceBuffer();
-    pipelinesFuture.waitForFinished();
+    publishedInstCount.store(itemCount, std::memory_order_relaxed);
+    if (DBG && frameUploadBytes)
+        qDebug("Uploaded %llu bytes of instance data", (unsigned long long) frameUploadBytes);
+
+    // Until the shaders are loaded and the pipelines built, frames only clear
+    // instead of waiting for them.
+    profiler.beginFrame(target->currentCommandBuffer(), target->currentFrame(), frameCounter);
+    QVector<RecordJob> jobs;
+    if (pipelinesFuture.isFinished()) {
+        applyShaderReloads();
+        writeItemDescriptors();
+        uniformRing.beginFrame(target->currentFrame());
+        if (animatingStatus)
+            rotation += 0.5;
+        writeItemUniforms();
+
+        // The compute pre-pass writes an indirect draw per item batch, scenes
+        // with more batches than it takes are culled on the CPU.
+        const bool gpuCull = cullingEnabled && culler.isValid() && !cpuCullingRequested
+                             && itemDraws.size() <= GpuCuller::MAX_DRAWS;
+        if (cullingEnabled && culler.isValid() && !cpuCullingRequested && !gpuCull && !gpuCullFallbackLogged) {
+            qWarning("%d item batches, more than the %d the culling pre-pass takes, culling on the CPU",
+                     int(itemDraws.size()), GpuCuller::MAX_DRAWS);
+            gpuCullFallbackLogged = true;
+        }
+        const bool cpuCull = cullingEnabled && !gpuCull && (gpuCullingRequested || cpuCullingRequested);
+        const int visible = cpuCull ? cullItemsOnCpu() : -1;
+
+        // The floor gets a job of its own. GPU culled instances are drawn with one
+        // indirect draw per batch, otherwise they are split into at most one batch per thread.
+        // The transforms come from wherever the instances of the draws do.
+        jobs.append({ 0, RecordJob::Floor, 0, 0, VK_NULL_HANDLE, 0 });
+        if (gpuCull) {
+            cullItems();
+            writeTransformDescriptor(culler.visibleInstances(), culler.visibleTransformOffset(),
+                                     culler.visibleTransformSize());
+            jobs.append({ 1, RecordJob::CulledItems, 0, itemCount, VK_NULL_HANDLE, 0 });
+        } else if (visible >= 0) {
+            const VkDeviceSize region = VkDeviceSize(target->currentFrame()) * instanceRegionSize(cpuVisibleCapacity);
+            writeTransformDescriptor(cpuVisibleBuf, region + transformOffset(cpuVisibleCapacity),
+                                     cpuVisibleCapacity * PER_INSTANCE_TRANSFORM_SIZE);
+            appendItemJobs(&jobs, cpuVisibleBuf, region, visible);
+        } else {
+            const VkDeviceSize region = VkDeviceSize(target->currentFrame()) * instanceRegionSize(instCapacity);
+            writeTransformDescriptor(instBuf, region + transformOffset(instCapacity),
+                                     instCapacity * PER_INSTANCE_TRANSFORM_SIZE);
+            appendItemJobs(&jobs, instBuf, region, itemCount);
+        }
+    }
 
-    VkCommandBuffer cb = vkview->currentCommandBuffer();
-    const QSize sz = vkview->swapChainImageSize();
+    QElapsedTimer timer;
+    timer.start();
+    QtConcurrent::blockingMap(jobs, [this](RecordJob &job) { recordJob(job); });
+    const qint64 recordNs = timer.nsecsElapsed();
+
+    RenderQueue::Stats queueStats;
+    for (const RecordJob &job : std::as_const(jobs))
+        queueStats += job.stats;
+    if (DBG && (queueStats.draws != publishedDrawCount.load(std::memory_order_relaxed)
+                || queueStats.binds() != publishedBindCount.load(std::memory_order_relaxed)))
+        qDebug("Render queues: %d packets, %d draws, binds: %d pipeline, %d descriptor set, %d vertex buffer, "
+               "%d index buffer, %d push constant", queueStats.packets, queueStats.draws, queueStats.pipelineBinds,
+               queueStats.descriptorBinds, queueStats.vertexBufferBinds, queueStats.indexBufferBinds,
+               queueStats.pushConstants);
+    publishedDrawCount.store(queueStats.draws, std::memory_order_relaxed);
+    publishedBindCount.store(queueStats.binds(), std::memory_order_relaxed);
+
+    VkCommandBuffer cmdBuf = target->currentCommandBuffer();
+    const QSize sz = target->swapChainImageSize();
 
     VkClearColorValue clearColor = {{ 0.67f, 0.84f, 0.9f, 1.0f }};
     VkClearDepthStencilValue clearDS = { 1, 0 };
@@ -853,15 +1933,64 @@ void Renderer::buildFrame()
     VkRenderPassBeginInfo rpBeginInfo;
     memset(&rpBeginInfo, 0, sizeof(rpBeginInfo));
     rpBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    rpBeginInfo.renderPass = vkview->defaultRenderPass();
-    rpBeginInfo.framebuffer = vkview->currentFramebuffer();
+    rpBeginInfo.renderPass = target->defaultRenderPass();
+    rpBeginInfo.framebuffer = target->currentFramebuffer();
     rpBeginInfo.renderArea.extent.width = sz.width();
     rpBeginInfo.renderArea.extent.height = sz.height();
-    rpBeginInfo.clearValueCount = vkview->sampleCountFlagBits() > VK_SAMPLE_COUNT_1_BIT ? 3 : 2;
+    rpBeginInfo.clearValueCount = target->sampleCountFlagBits() > VK_SAMPLE_COUNT_1_BIT ? 3 : 2;
     rpBeginInfo.pClearValues = clearValues;
-    VkCommandBuffer cmdBuf = vkview->currentCommandBuffer();
-    devFuncs->vkCmdBeginRenderPass(cmdBuf, &rpBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    devFuncs->vkCmdBeginRenderPass(cmdBuf, &rpBeginInfo, jobs.isEmpty() ? VK_SUBPASS_CONTENTS_INLINE
+                                                                        : VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+    if (!jobs.isEmpty()) {
+        VkCommandBuffer secondaries[MAX_RECORD_THREADS + 1];
+        for (const RecordJob &job : std::as_const(jobs))
+            secondaries[job.slot] = job.cmdBuf;
+        devFuncs->vkCmdExecuteCommands(cmdBuf, uint32_t(jobs.size()), secondaries);
+    }
+
+    devFuncs->vkCmdEndRenderPass(cmdBuf);
+    profiler.endFrame(cmdBuf, target->currentFrame());
+
+    if (DBG)
+        qDebug("Recorded %d secondary command buffers in %.3f ms", int(jobs.size()), recordNs / 1000000.0);
+}
+
+void Renderer::appendItemJobs(QVector<RecordJob> *jobs, VkBuffer instanceBuf, VkDeviceSize instanceOffset, int count)
+{
+    const int itemJobCount = qBound(1, (count + MIN_INSTANCES_PER_RECORD_JOB - 1) / MIN_INSTANCES_PER_RECORD_JOB,
+                                    recordThreadCount);
+    const int perJob = (count + itemJobCount - 1) / itemJobCount;
+    for (int first = 0; first < count; first += perJob)
+        jobs->append({ int(jobs->size()), RecordJob::Items, first, qMin(perJob, count - first), instanceBuf, instanceOffset });
+}
 
+void Renderer::recordJob(RecordJob &job)
+{
+    RecordSlot &slot = recordSlots[target->currentFrame() * recordSlotCount + job.slot];
+    // The fence of this frame slot has been waited for, nothing recorded from
+    // the pool is pending anymore.
+    devFuncs->vkResetCommandPool(target->device(), slot.pool, 0);
+
+    VkCommandBufferInheritanceInfo inheritanceInfo;
+    memset(&inheritanceInfo, 0, sizeof(inheritanceInfo));
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = target->defaultRenderPass();
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = target->currentFramebuffer();
+
+    VkCommandBufferBeginInfo beginInfo;
+    memset(&beginInfo, 0, sizeof(beginInfo));
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    VkCommandBuffer cb = slot.cmdBuf;
+    VkResult err = devFuncs->vkBeginCommandBuffer(cb, &beginInfo);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to begin secondary command buffer: %d", err);
+
+    // Dynamic state is not inherited from the primary command buffer.
+    const QSize sz = target->swapChainImageSize();
     VkViewport viewport = {
         0, 0,
         float(sz.width()), float(sz.height()),
@@ -875,167 +2004,468 @@ void Renderer::buildFrame()
     };
     devFuncs->vkCmdSetScissor(cb, 0, 1, &scissor);
 
-    buildDrawCallsForFloor();
-    buildDrawCallsForItems();
+    RenderQueue &queue = slot.queue;
+    queue.clear();
+    if (job.kind == RecordJob::Floor)
+        queueFloorDraws(&queue);
+    else if (job.kind == RecordJob::CulledItems)
+        queueCulledItemDraws(&queue);
+    else
+        queueItemDraws(&queue, job.instanceBuf, job.instanceOffset, job.firstInstance, job.instanceCount);
+
+    const int frame = target->currentFrame();
+    profiler.beginJob(cb, frame, job.slot, job.kind == RecordJob::Floor ? GpuProfiler::Floor : GpuProfiler::Items);
+    queue.record(devFuncs, cb);
+    profiler.endJob(cb, frame, job.slot);
+    job.stats = queue.stats();
+
+    err = devFuncs->vkEndCommandBuffer(cb);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end secondary command buffer: %d", err);
+    job.cmdBuf = cb;
+}
+
+// A vertex uniform block per item mesh, for its model transform, and a
+// fragment block per material, shared by all batches that use them. The
+// uniform memory is persistently mapped, this frame's blocks are written
+// straight into its region of the ring.
+void Renderer::writeItemUniforms()
+{
+    QMatrix4x4 vp;
+    QVector3D eyePos;
+    getMatrices(&vp, &eyePos);
+
+    QVector<uint32_t> meshUni(scene.meshCount(), UINT32_MAX);
+    QVector<uint32_t> materialUni(scene.materialCount(), UINT32_MAX);
+    itemDraws.clear();
+    int first = 0;
+    for (const Scene::Batch &batch : scene.batches()) {
+        if (batch.pipeline != Scene::Items)
+            continue;
+        const GpuMesh *gm = gpuMesh(batch.mesh);
+        if (meshUni[batch.mesh] == UINT32_MAX) {
+            QMatrix4x4 model = itemModel(batch.mesh);
+            const QMatrix3x3 modelNormal = model.normalMatrix();
+
+            // Quantized positions are relative to the mesh bounds, undo that as part
+            // of the model transform. The normal matrix stays as it is.
+            const MeshData *mesh = &gm->data;
+            float decodeOffset[3], decodeScale[3];
+            VertexFormat::get(mesh->vertexFormat).positionDecode(mesh->aabb, decodeOffset, decodeScale);
+            model.translate(decodeOffset[0], decodeOffset[1], decodeOffset[2]);
+            model.scale(decodeScale[0], decodeScale[1], decodeScale[2]);
+
+            // Vertex shader uniforms
+            UniformRing::Allocation vertUni = uniformRing.allocate(itemMaterial.vertUniSize);
+            quint8 *p = vertUni.p;
+            memcpy(p, vp.constData(), 64);
+            memcpy(p + 64, model.constData(), 64);
+            const float *mnp = modelNormal.constData();
+            memcpy(p + 128, mnp, 12);
+            memcpy(p + 128 + 16, mnp + 3, 12);
+            memcpy(p + 128 + 32, mnp + 6, 12);
+            meshUni[batch.mesh] = vertUni.offset;
+        }
+        if (materialUni[batch.material] == UINT32_MAX) {
+            // Fragment shader uniforms
+            UniformRing::Allocation fragUni = uniformRing.allocate(itemMaterial.fragUniSize);
+            writeFragUni(fragUni.p, eyePos, scene.material(batch.material).color);
+            materialUni[batch.material] = fragUni.offset;
+        }
 
-    devFuncs->vkCmdEndRenderPass(cmdBuf);
+        // the instance buffer may hold fewer than the scene when memory ran out
+        const int count = qMin(batch.count, itemCount - first);
+        if (count <= 0)
+            break;
+        itemDraws.append({ batch.mesh, batch.material, gm, first, count,
+                           { meshUni[batch.mesh], materialUni[batch.material] } });
+        first += count;
+    }
 }
 
-void Renderer::buildDrawCallsForItems()
+// Bounds of the mesh after the model transform, as an axis aligned box
+// around the eight transformed corners. in is laid out like MeshData::aabb,
+// out is minX, minY, minZ, maxX, maxY, maxZ.
+static void transformBounds(const QMatrix4x4 &m, const float *in, float *out)
 {
-    VkDevice dev = vkview->device();
-    VkCommandBuffer cb = vkview->currentCommandBuffer();
+    for (int i = 0; i < 3; ++i) {
+        out[i] = std::numeric_limits<float>::max();
+        out[i + 3] = -std::numeric_limits<float>::max();
+    }
+    for (int c = 0; c < 8; ++c) {
+        const QVector3D v = m.map(QVector3D(in[(c & 1) ? 1 : 0], in[(c & 2) ? 3 : 2], in[(c & 4) ? 5 : 4]));
+        for (int i = 0; i < 3; ++i) {
+            out[i] = qMin(out[i], v[i]);
+            out[i + 3] = qMax(out[i + 3], v[i]);
+        }
+    }
+}
 
-    devFuncs->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, itemMaterial.pipeline);
+// The CPU culler tests positions only. Once instances have a rotation or a
+// scale of their own, the bounds grow to a cube around the sphere that holds
+// the mesh in any orientation, at the largest scale any instance had.
+static void boundsUnderInstanceTransforms(float *bounds, float maxScale)
+{
+    const QVector3D center((bounds[0] + bounds[3]) * 0.5f, (bounds[1] + bounds[4]) * 0.5f, (bounds[2] + bounds[5]) * 0.5f);
+    const QVector3D extents((bounds[3] - bounds[0]) * 0.5f, (bounds[4] - bounds[1]) * 0.5f, (bounds[5] - bounds[2]) * 0.5f);
+    const float radius = (center.length() + extents.length()) * maxScale;
+    for (int i = 0; i < 3; ++i) {
+        bounds[i] = -radius;
+        bounds[i + 3] = radius;
+    }
+}
 
-    VkDeviceSize vbOffset = 0;
-    devFuncs->vkCmdBindVertexBuffers(cb, 0, 1, useLogo ? &logoVertexBuf : &blockVertexBuf, &vbOffset);
-    devFuncs->vkCmdBindVertexBuffers(cb, 1, 1, &instBuf, &vbOffset);
+// Bounds of all item meshes after their model transform, so that one test
+// per instance does for every batch.
+void Renderer::itemBounds(float *bounds)
+{
+    for (int i = 0; i < 3; ++i) {
+        bounds[i] = std::numeric_limits<float>::max();
+        bounds[i + 3] = -std::numeric_limits<float>::max();
+    }
+    for (const ItemDraw &draw : std::as_const(itemDraws)) {
+        float b[6];
+        transformBounds(itemModel(draw.mesh), draw.gpuMesh->data.aabb, b);
+        for (int i = 0; i < 3; ++i) {
+            bounds[i] = qMin(bounds[i], b[i]);
+            bounds[i + 3] = qMax(bounds[i + 3], b[i + 3]);
+        }
+    }
+}
 
-    // Now provide offsets so that the two dynamic buffers point to the
-    // beginning of the vertex and fragment uniform data for the current frame.
-    uint32_t frameUniOffset = vkview->currentFrame() * (itemMaterial.vertUniSize + itemMaterial.fragUniSize);
-    uint32_t frameUniOffsets[] = { frameUniOffset, frameUniOffset };
-    devFuncs->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, itemMaterial.pipelineLayout, 0, 1,
-                                        &itemMaterial.descSet, 2, frameUniOffsets);
+void Renderer::cullItems()
+{
+    VkDevice dev = target->device();
+    const int frame = target->currentFrame();
+
+    VkBuffer oldBuf;
+    VkDeviceMemory oldMem;
+    culler.ensureCapacity(instCapacity, &oldBuf, &oldMem);
+    if (oldBuf) {
+        deferRelease([this, dev, oldBuf, oldMem] {
+            devFuncs->vkDestroyBuffer(dev, oldBuf, nullptr);
+            devFuncs->vkFreeMemory(dev, oldMem, nullptr);
+        });
+    }
 
-    if (animatingStatus)
-        rotation += 0.5;
+    // The count written by the dispatch of the last frame that used this
+    // slot, its fence has been waited for by now.
+    const int visible = int(culler.visibleCount(frame));
+    if (DBG && visible != publishedVisibleCount.load(std::memory_order_relaxed))
+        qDebug("Visible instances: %d of %d", visible, itemCount);
+    publishedVisibleCount.store(visible, std::memory_order_relaxed);
+
+    QMatrix4x4 vp;
+    QVector3D eyePos;
+    getMatrices(&vp, &eyePos);
+    // Every batch is tested against the bounds of its own mesh.
+    QVector<GpuCuller::Draw> draws(itemDraws.size());
+    for (int i = 0; i < itemDraws.size(); ++i) {
+        const ItemDraw &draw = itemDraws[i];
+        const MeshData *mesh = &draw.gpuMesh->data;
+        GpuCuller::Draw &d = draws[i];
+        d.first = draw.first;
+        d.count = draw.count;
+        d.indexed = mesh->isIndexed();
+        d.elementCount = uint32_t(mesh->isIndexed() ? mesh->indexCount : mesh->vertexCount);
+        transformBounds(itemModel(draw.mesh), mesh->aabb, d.bounds);
+    }
 
-    if (animatingStatus || vpDirty) {
-        if (vpDirty)
-            --vpDirty;
-        QMatrix4x4 vp, model;
-        QMatrix3x3 modelNormal;
-        QVector3D eyePos;
-        getMatrices(&vp, &model, &modelNormal, &eyePos);
+    VkCommandBuffer cb = target->currentCommandBuffer();
+    profiler.beginPass(cb, frame, GpuProfiler::Cull);
+    const VkDeviceSize region = VkDeviceSize(frame) * instanceRegionSize(instCapacity);
+    culler.record(cb, frame, instBuf, region, region + transformOffset(instCapacity), itemCount, draws, vp);
+    profiler.endPass(cb, frame, GpuProfiler::Cull);
+}
 
-        // Map the uniform data for the current frame, ignore the geometry data at
-        // the beginning and the uniforms for other frames.
-        quint8 *p;
-        VkResult err = devFuncs->vkMapMemory(dev, bufMem,
-                                               itemMaterial.uniMemStartOffset + frameUniOffset,
-                                               itemMaterial.vertUniSize + itemMaterial.fragUniSize,
-                                               0, reinterpret_cast<void **>(&p));
-        if (err != VK_SUCCESS)
-            qFatal("Failed to map memory: %d", err);
+// Culls on the CPU and writes the visible instances into this frame's region
+// of cpuVisibleBuf, the item draws then refer to that. Returns the number of
+// visible instances, or -1 when there is no memory for cpuVisibleBuf, the
+// items are drawn unculled then.
+int Renderer::cullItemsOnCpu()
+{
+    VkDevice dev = target->device();
+    const int frameCount = target->concurrentFrameCount();
+
+    // One region per frame in flight, sized for the instance capacity.
+    if (cpuVisibleCapacity < instCapacity) {
+        VkBuffer buf;
+        VkDeviceMemory mem;
+        quint8 *mapped;
+        if (!createInstanceBuffer(instCapacity, frameCount, &buf, &mem, &mapped))
+            return -1;
+        if (cpuVisibleBuf) {
+            VkBuffer oldBuf = cpuVisibleBuf;
+            VkDeviceMemory oldMem = cpuVisibleMem;
+            deferRelease([this, dev, oldBuf, oldMem] {
+                devFuncs->vkDestroyBuffer(dev, oldBuf, nullptr);
+                devFuncs->vkFreeMemory(dev, oldMem, nullptr);
+            });
+        }
+        cpuVisibleBuf = buf;
+        cpuVisibleMem = mem;
+        cpuVisibleMapped = mapped;
+        cpuVisibleCapacity = instCapacity;
+    }
+
+    QMatrix4x4 vp;
+    QVector3D eyePos;
+    getMatrices(&vp, &eyePos);
+    float bounds[6];
+    itemBounds(bounds);
+    if (instancesTransformed)
+        boundsUnderInstanceTransforms(bounds, maxInstanceScale);
+
+    QElapsedTimer timer;
+    timer.start();
+    visibleIndices.resize(itemCount);
+    const int visible = cpuCuller.cull(vp, bounds, visibleIndices.data());
+    const qint64 cullNs = timer.nsecsElapsed();
+
+    quint8 *dst = cpuVisibleMapped + VkDeviceSize(target->currentFrame()) * instanceRegionSize(cpuVisibleCapacity);
+    quint8 *transformDst = dst + transformOffset(cpuVisibleCapacity);
+    for (int i = 0; i < visible; ++i) {
+        memcpy(dst + i * PER_INSTANCE_DATA_SIZE, instData.constData() + visibleIndices[i] * PER_INSTANCE_DATA_SIZE,
+               PER_INSTANCE_DATA_SIZE);
+        memcpy(transformDst + i * PER_INSTANCE_TRANSFORM_SIZE,
+               transformData.constData() + visibleIndices[i] * PER_INSTANCE_TRANSFORM_SIZE, PER_INSTANCE_TRANSFORM_SIZE);
+    }
 
-        // Vertex shader uniforms
-        memcpy(p, vp.constData(), 64);
-        memcpy(p + 64, model.constData(), 64);
-        const float *mnp = modelNormal.constData();
-        memcpy(p + 128, mnp, 12);
-        memcpy(p + 128 + 16, mnp + 3, 12);
-        memcpy(p + 128 + 32, mnp + 6, 12);
+    // The visible instances keep their order, so those of a draw still follow
+    // each other.
+    int v = 0;
+    for (ItemDraw &draw : itemDraws) {
+        const int first = v;
+        while (v < visible && int(visibleIndices[v]) < draw.first + draw.count)
+            ++v;
+        draw.first = first;
+        draw.count = v - first;
+    }
+
+    if (DBG && visible != publishedVisibleCount.load(std::memory_order_relaxed))
+        qDebug("Visible instances: %d of %d, culled on the CPU (%s) at %.3f instances/ns", visible, itemCount,
+               CpuCuller::isaName(CpuCuller::bestIsa()), cullNs ? double(itemCount) / cullNs : 0.0);
+    publishedVisibleCount.store(visible, std::memory_order_relaxed);
+    return visible;
+}
 
-        // Fragment shader uniforms
-        p += itemMaterial.vertUniSize;
-        writeFragUni(p, eyePos);
+void Renderer::advanceCullBench()
+{
+    if (!cullBench.active)
+        return;
 
-        devFuncs->vkUnmapMemory(dev, bufMem);
+    if (cullBench.frame == CULL_BENCH_WARMUP_FRAMES) {
+        cullBench.timer.start();
+    } else if (cullBench.frame == CULL_BENCH_WARMUP_FRAMES + CULL_BENCH_FRAMES) {
+        const double ms = cullBench.timer.nsecsElapsed() / 1000000.0 / CULL_BENCH_FRAMES;
+        cullBench.frame = 0;
+        if (cullBench.culled) {
+            cullBench.culledMs = ms;
+            cullBench.culled = false;
+        } else {
+            qDebug("Culling benchmark: %d instances, %d visible, %.3f ms/frame culled, %.3f ms/frame unculled",
+                   cullBench.count, publishedVisibleCount.load(std::memory_order_relaxed), cullBench.culledMs, ms);
+            cullBench.culled = true;
+            cullBench.count *= 2;
+            if (cullBench.count > CULL_BENCH_MAX_INSTANCES) {
+                qDebug("Culling benchmark finished");
+                cullBench.active = false;
+                cullingEnabled = true;
+                return;
+            }
+        }
     }
+    ++cullBench.frame;
 
-    devFuncs->vkCmdDraw(cb, (useLogo ? logoMesh.data() : blockMesh.data())->vertexCount, instCount, 0, 0);
+    instCount = cullBench.count;
+    cullingEnabled = cullBench.culled;
 }
 
-void Renderer::buildDrawCallsForFloor()
+// A packet with the state of an item draw, the instance range is up to the
+// caller. Item packets sort with depth 0, the instances of a draw are spread
+// over the scene.
+RenderQueue::Packet &Renderer::queueItemPacket(RenderQueue *queue, const ItemDraw &draw)
 {
-    VkCommandBuffer cb = vkview->currentCommandBuffer();
+    const MeshData *mesh = &draw.gpuMesh->data;
+    RenderQueue::Packet &packet = queue->add();
+    packet.key = RenderQueue::key(RenderQueue::Opaque, Scene::Items, draw.material, draw.mesh, 0);
+    packet.pipeline = itemMaterial.pipeline;
+    packet.layout = itemMaterial.pipelineLayout;
+    // The two dynamic buffers point to the vertex and fragment uniform data of
+    // the mesh and material.
+    packet.descSet = itemMaterial.descSets.at(target->currentFrame());
+    packet.dynamicOffsets[0] = draw.uniOffsets[0];
+    packet.dynamicOffsets[1] = draw.uniOffsets[1];
+    packet.dynamicOffsetCount = 2;
+    packet.vertexBuf = draw.gpuMesh->buf;
+    if (mesh->isIndexed()) {
+        packet.indexBuf = draw.gpuMesh->buf;
+        packet.indexOffset = mesh->geomByteCount();
+        packet.indexType = mesh->indexSize == 2 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+        packet.elementCount = mesh->indexCount;
+    } else {
+        packet.elementCount = mesh->vertexCount;
+    }
+    return packet;
+}
 
-    devFuncs->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, floorMaterial.pipeline);
+// The part of every item draw that falls into [firstInstance, firstInstance +
+// count).
+void Renderer::queueItemDraws(RenderQueue *queue, VkBuffer instanceBuf, VkDeviceSize instanceOffset,
+                              int firstInstance, int count)
+{
+    const int end = firstInstance + count;
+    for (const ItemDraw &draw : std::as_const(itemDraws)) {
+        const int first = qMax(firstInstance, draw.first);
+        const int n = qMin(end, draw.first + draw.count) - first;
+        if (n <= 0)
+            continue;
+        RenderQueue::Packet &packet = queueItemPacket(queue, draw);
+        packet.instanceBuf = instanceBuf;
+        packet.instanceOffset = instanceOffset;
+        packet.firstInstance = first;
+        packet.instanceCount = n;
+    }
+}
 
-    VkDeviceSize vbOffset = 0;
-    devFuncs->vkCmdBindVertexBuffers(cb, 0, 1, &floorVertexBuf, &vbOffset);
+void Renderer::queueCulledItemDraws(RenderQueue *queue)
+{
+    // the compacted instances and their counts both come from cullItems(),
+    // in a draw command per batch
+    for (int i = 0; i < itemDraws.size(); ++i) {
+        RenderQueue::Packet &packet = queueItemPacket(queue, itemDraws[i]);
+        packet.instanceBuf = culler.visibleInstances();
+        packet.indirectBuf = culler.drawCommand();
+        packet.indirectOffset = GpuCuller::drawCommandOffset(i);
+    }
+}
 
-    QMatrix4x4 mvp = proj * cam.viewMatrix() * floorModel;
-    devFuncs->vkCmdPushConstants(cb, floorMaterial.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, 64, mvp.constData());
-    float color[] = { 0.67f, 1.0f, 0.2f };
-    devFuncs->vkCmdPushConstants(cb, floorMaterial.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 64, 12, color);
+// Every entity drawn with the floor pipeline, the quad at its world
+// transform, nearest first. The mvp goes to the vertex stage and the material
+// color to the fragment stage as push constants, the queue skips the color
+// where it stays the same.
+void Renderer::queueFloorDraws(RenderQueue *queue)
+{
+    QMatrix4x4 vp;
+    QVector3D eyePos;
+    getMatrices(&vp, &eyePos);
+    const std::vector<quint32> &order = scene.drawOrder();
+    const Scene::Transform *worlds = scene.worldTransforms();
+    for (const Scene::Batch &batch : scene.batches()) {
+        if (batch.pipeline != Scene::Floor)
+            break;
+        const float *color = scene.material(batch.material).color;
+        for (int s = batch.first; s < batch.first + batch.count; ++s) {
+            const Scene::Transform &world = worlds[order[s]];
+            const QVector3D pos(world.translate[0], world.translate[1], world.translate[2]);
+            RenderQueue::Packet &packet = queue->add();
+            packet.key = RenderQueue::key(RenderQueue::Opaque, Scene::Floor, batch.material, 0,
+                                          RenderQueue::depth(pos.distanceToPoint(eyePos), FAR_PLANE));
+            packet.pipeline = floorMaterial.pipeline;
+            packet.layout = floorMaterial.pipelineLayout;
+            packet.vertexBuf = floorVertexBuf;
+            packet.elementCount = 4;
+            packet.push[0] = { VK_SHADER_STAGE_VERTEX_BIT, 0, 64 };
+            packet.push[1] = { VK_SHADER_STAGE_FRAGMENT_BIT, 64, 12 };
+            const QMatrix4x4 mvp = vp * Scene::matrix(world);
+            memcpy(packet.pushData, mvp.constData(), 64);
+            memcpy(packet.pushData + 64, color, 12);
+        }
+    }
+}
 
-    devFuncs->vkCmdDraw(cb, 4, 1, 0, 0);
+// The GUI thread never touches the render state directly, everything goes
+// through the input queue and is applied at the start of the next frame.
+void Renderer::postInput(InputEvent::Type type, float value)
+{
+    input.post(type, value);
 }
 
 void Renderer::addNew()
 {
-    QMutexLocker locker(&guiMutex);
-    instCount = qMin(instCount + 16, MAX_INSTANCES);
+    postInput(InputEvent::AddInstances, 16);
 }
 
 void Renderer::yaw(float degrees)
 {
-    QMutexLocker locker(&guiMutex);
-    cam.yaw(degrees);
-    markViewProjDirty();
+    postInput(InputEvent::Yaw, degrees);
 }
 
 void Renderer::pitch(float degrees)
 {
-    QMutexLocker locker(&guiMutex);
-    cam.pitch(degrees);
-    markViewProjDirty();
+    postInput(InputEvent::Pitch, degrees);
 }
 
 void Renderer::walk(float amount)
 {
-    QMutexLocker locker(&guiMutex);
-    cam.walk(amount);
-    markViewProjDirty();
+    postInput(InputEvent::Walk, amount);
 }
 
 void Renderer::strafe(float amount)
 {
-    QMutexLocker locker(&guiMutex);
-    cam.strafe(amount);
-    markViewProjDirty();
+    postInput(InputEvent::Strafe, amount);
 }
 
-void Renderer::setUseLogo(bool b)
+void Renderer::setSpawnMesh(int index)
 {
-    QMutexLocker locker(&guiMutex);
-    useLogo = b;
+    postInput(InputEvent::SpawnMesh, float(index));
     if (!animatingStatus)
-        vkview->requestUpdate();
+        target->requestUpdate();
 }
 
+void Renderer::applyInput()
+{
+    frameInputTimes.clear();
+    InputEvent e;
+    while (input.pop(&e)) {
+        switch (e.type) {
+        case InputEvent::Yaw:
+            cam.yaw(e.value);
+            break;
+        case InputEvent::Pitch:
+            cam.pitch(e.value);
+            break;
+        case InputEvent::Walk:
+            cam.walk(e.value);
+            break;
+        case InputEvent::Strafe:
+            cam.strafe(e.value);
+            break;
+        case InputEvent::AddInstances:
+            instCount += int(e.value);
+            break;
+        case InputEvent::SpawnMesh: {
+            // the instances spawned so far as well as those to come
+            spawnMesh = int(e.value);
+            const Scene::Spawner &spawner = scene.spawner();
+            if (spawner.entity < 0)
+                break;
+            const int mesh = spawner.meshes.value(spawnMesh, spawner.meshes.first());
+            for (int entity = spawnBegin; entity < scene.entityCount(); ++entity)
+                scene.setMesh(entity, mesh);
+            break;
+        }
+        }
+        frameInputTimes.append(e.timestamp);
+    }
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+// Called on the GUI thread right after frameReady() has queued the frame for
+// presentation. frameInputTimes was filled by buildFrame(), which has
+// finished by now.
+void Renderer::recordInputLatency()
+{
+    // the frame has drained the queue, make room for what was folded while it was full
+    input.flush();
+    if (frameInputTimes.isEmpty())
+        return;
+    const qint64 now = InputQueue::now();
+    for (qint64 t : std::as_const(frameInputTimes))
+        inputLatency.add(now - t);
+    frameInputTimes.clear();
+
+    if (DBG && inputLatency.count() >= 1000) {
+        qDebug("Input to submit latency: %s", qPrintable(inputLatency.summary()));
+        inputLatency.reset();
+    }
+}
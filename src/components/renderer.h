@@ -1,17 +1,32 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
-#include "vkview.h"
+#include "rendertarget.h"
 #include "mesh.h"
 #include "shader.h"
 #include "camera.h"
+#include "uploader.h"
+#include "uniformring.h"
+#include "inputqueue.h"
+#include "latencyhistogram.h"
+#include "gpuculler.h"
+#include "cpuculler.h"
+#include "animator.h"
+#include "gpuprofiler.h"
+#include "shaderwatcher.h"
+#include "scene.h"
+#include "renderqueue.h"
+#include <QVulkanWindow>
 #include <QFutureWatcher>
+#include <QElapsedTimer>
 #include <QMutex>
+#include <QRandomGenerator>
+#include <functional>
 
 class Renderer:public QVulkanWindowRenderer
 {
 public:
-    Renderer(Vkview *w,int initialCount);
+    Renderer(RenderTarget *w,int initialCount);
     void preInitResources() override;
     void initResources() override;
     void initSwapChainResources() override;
@@ -23,51 +38,200 @@ public:
     bool animating() const {return animatingStatus;}
     void setAnimating(bool a) {animatingStatus=a;}
 
-    int instanceCount() const { return instCount;}
+    //as of the last frame built, safe to call from the GUI thread
+    int instanceCount() const { return publishedInstCount.load(std::memory_order_relaxed);}
     void addNew();
+    //bytes of instance data written to the GPU for the last frame
+    quint64 uploadedBytes() const { return frameUploadBytes;}
 
     void yaw(float degrees);
     void pitch(float degrees);
     void walk(float amount);
     void strafe(float amount);
 
-    void setUseLogo(bool b);
+    //mesh of the instances added with addNew(), an index into the meshes of
+    //the scene's spawner, e.g. 1 for the logo in the default scene
+    void setSpawnMesh(int index);
+    //block until the pipelines are built and the meshes loaded, so that the
+    //next frame shows no placeholder, for targets that export every frame
+    void waitForAssets();
+    //instance placement follows the seed, for runs that must be repeatable
+    void setRandomSeed(quint32 seed) {random.seed(seed);}
+
+    //instances that passed GPU culling a few frames ago, and the total
+    int visibleInstanceCount() const { return publishedVisibleCount.load(std::memory_order_relaxed);}
+
+    //time from an input call above to the submission of the first frame reflecting it
+    const LatencyHistogram &inputLatencyHistogram() const {return inputLatency;}
+
+    //draws and state binds (pipelines, descriptor sets, vertex and index
+    //buffers, push constants) recorded for the last frame, safe to call from
+    //the GUI thread
+    int drawCount() const { return publishedDrawCount.load(std::memory_order_relaxed);}
+    int bindCount() const { return publishedBindCount.load(std::memory_order_relaxed);}
+
+    //GPU time per pass of the last frames, safe to call from the GUI thread
+    QString profileSummary() const {return profiler.summary();}
 
 private:
     void createPipelines();
+    QString pipelineCacheFileName() const;
+    QByteArray loadPipelineCacheData() const;
+    void savePipelineCache();
     void createItemPipeline();
+    VkPipeline buildItemPipeline(VkShaderModule vs, VkShaderModule fs);
     void createFloorPipeline();
+    VkPipeline buildFloorPipeline(VkShaderModule vs, VkShaderModule fs);
+    void createCullPipeline();
+    enum ShaderSlot{ItemVs, ItemFs, FloorVs, FloorFs, CullCs, ShaderSlotCount};
+    struct ShaderReload{
+        VkShaderModule modules[ShaderSlotCount]={};//only the slots whose pipeline was rebuilt
+        VkPipeline itemPipeline=VK_NULL_HANDLE;
+        VkPipeline floorPipeline=VK_NULL_HANDLE;
+        VkPipeline cullPipeline=VK_NULL_HANDLE;
+    };
+    Shader *shaderForSlot(int slot);
+    void shaderCompiled(const QString &source, const QByteArray &spirv);
+    void applyShaderReloads();
+    ShaderReload rebuildPipelines(const QHash<int, QByteArray> &spirv);
+    void destroyShaderReload(const ShaderReload &reload);
     void ensureBuffers();
+    void writeItemDescriptors();
+    void writeTransformDescriptor(VkBuffer buf, VkDeviceSize offset, VkDeviceSize range);
+    struct GpuMesh;
+    void createMeshBuffer(GpuMesh *gpuMesh, const MeshData &md);
+    void destroyMeshBuffer(GpuMesh *gpuMesh);
+    void uploadWhenLoaded(int mesh);
+    //the mesh once it is on the GPU, the placeholder until then
+    const GpuMesh *gpuMesh(int mesh) const;
+    void loadScene();
+    void spawnInstances();
+    void gatherInstances(int itemBegin, int count, int changedFrom);
     void ensureInstanceBuffer();
-    void getMatrices(QMatrix4x4 *mvp, QMatrix4x4 *model, QMatrix3x3 *modelNormal, QVector3D *eyePos);
-    void writeFragUni(quint8 *p, const QVector3D &eyePos);
+    bool createInstanceBuffer(int capacity, int regions, VkBuffer *buf, VkDeviceMemory *mem, quint8 **mapped);
+    int maxInstanceCapacity() const;
+    bool growInstanceBuffer(int count);
+    void uploadDirtyInstances();
+    void addInstanceTracks(int instance, const float *translate);
+    void animateInstances();
+    //release runs once the frames in flight no longer use the resource
+    void deferRelease(std::function<void()> release);
+    void runDeferredReleases(bool all);
+    struct InstanceRange{
+        int begin;
+        int end;
+    };
+    static void addRange(QVector<InstanceRange> *ranges, int begin, int end);
+    //schedule instances [begin, end) for upload to every region after their data in instData changed
+    void markInstancesDirty(int begin, int end);
+    //the same for transformData
+    void markTransformsDirty(int begin, int end);
+    void getMatrices(QMatrix4x4 *vp, QVector3D *eyePos);
+    //model transform of the items drawn with a mesh, before the position decode
+    QMatrix4x4 itemModel(int mesh) const;
+    void writeFragUni(quint8 *p, const QVector3D &eyePos, const float *diffuse);
+    void postInput(InputEvent::Type type, float value);
+    void applyInput();
+    void recordInputLatency();
+    void createRecordSlots();
+    void destroyRecordSlots();
     void buildFrame();
-    void buildDrawCallsForItems();
-    void buildDrawCallsForFloor();
-
-    void markViewProjDirty(){vpDirty=vkview->concurrentFrameCount();}
+    void writeItemUniforms();
+    void itemBounds(float *bounds);
+    void cullItems();
+    int cullItemsOnCpu();
+    void advanceCullBench();
+    struct RecordJob{
+        int slot;//index of the command pool within the frame
+        enum{Floor,Items,CulledItems} kind;
+        int firstInstance;
+        int instanceCount;
+        VkBuffer instanceBuf;//for Items
+        VkDeviceSize instanceOffset;
+        VkCommandBuffer cmdBuf=VK_NULL_HANDLE;
+        RenderQueue::Stats stats;//of recording cmdBuf
+    };
+    void appendItemJobs(QVector<RecordJob> *jobs, VkBuffer instanceBuf, VkDeviceSize instanceOffset, int count);
+    void recordJob(RecordJob &job);
+    struct ItemDraw;
+    RenderQueue::Packet &queueItemPacket(RenderQueue *queue, const ItemDraw &draw);
+    void queueItemDraws(RenderQueue *queue, VkBuffer instanceBuf, VkDeviceSize instanceOffset,
+                        int firstInstance, int count);
+    void queueCulledItemDraws(RenderQueue *queue);
+    void queueFloorDraws(RenderQueue *queue);
 
-    Vkview *vkview;
+    RenderTarget *target;
     QVulkanDeviceFunctions *devFuncs;
 
-    bool useLogo=false;
-    Mesh blockMesh;
-    Mesh logoMesh;
-    VkBuffer blockVertexBuf=VK_NULL_HANDLE;
-    VkBuffer logoVertexBuf=VK_NULL_HANDLE;
+    VertexFormat::Id vertexFormat=VertexFormat::Standard;
+    // The meshes, materials and entities to draw, the instances addNew()
+    // asks for are added to the spawner of the scene.
+    Scene scene;
+    int spawnBegin=0;//first spawned entity, they come after the ones of the scene file
+    int spawnMesh=0;//into the meshes of the spawner
+    QVector<Mesh> meshes;//by scene mesh handle
+    struct GpuMesh{
+        MeshData data;//what buf holds, the draws take counts and bounds from here
+        VkBuffer buf=VK_NULL_HANDLE;//vertices, followed by the indices
+        VkDeviceMemory mem=VK_NULL_HANDLE;
+    };
+    GpuMesh placeholderMesh;//drawn until the chosen mesh is on the GPU
+    QVector<GpuMesh> gpuMeshes;//by scene mesh handle, sized once with the scene
+    //an item batch of the scene's draw list, its instances are
+    //[first, first + count) of the instance buffer the draws read
+    struct ItemDraw{
+        int mesh;//scene mesh handle
+        int material;//scene material handle
+        const GpuMesh *gpuMesh;
+        int first;
+        int count;
+        uint32_t uniOffsets[2];//dynamic offsets of the vertex and fragment uniforms
+    };
+    QVector<ItemDraw> itemDraws;//of the frame being built
+    // Upload callbacks hold a weak reference, releaseResources() drops the
+    // token so that callbacks from before a device loss do nothing.
+    QSharedPointer<bool> uploadToken;
+    bool itemDescriptorsWritten=false;
     struct{
         VkDeviceSize vertUniSize;
         VkDeviceSize fragUniSize;
-        VkDeviceSize uniMemStartOffset;
         Shader vs;
         Shader fs;
         VkDescriptorPool descPool=VK_NULL_HANDLE;
         VkDescriptorSetLayout descSetLayout=VK_NULL_HANDLE;
-        VkDescriptorSet descSet;
+        QVector<VkDescriptorSet> descSets;//one per frame in flight, the transforms are rewritten every frame
         VkPipelineLayout pipelineLayout=VK_NULL_HANDLE;
         VkPipeline pipeline=VK_NULL_HANDLE;
     }itemMaterial;
 
+    bool gpuCullingRequested=true;
+    bool cpuCullingRequested=false;
+    bool cullingEnabled=true;//false while the culling benchmark measures without
+    bool gpuCullFallbackLogged=false;//warned once that there are too many item batches for the pre-pass
+    Shader cullShader;
+    GpuCuller culler;
+    CpuCuller cpuCuller;
+    std::vector<quint32> visibleIndices;
+    VkBuffer cpuVisibleBuf=VK_NULL_HANDLE;//CPU culled instances and transforms, one region per frame in flight
+    VkDeviceMemory cpuVisibleMem=VK_NULL_HANDLE;
+    quint8 *cpuVisibleMapped=nullptr;
+    int cpuVisibleCapacity=0;//instances per region
+    std::atomic<int> publishedVisibleCount{0};
+    std::atomic<int> publishedDrawCount{0};
+    std::atomic<int> publishedBindCount{0};
+    struct{
+        bool active=false;
+        int count=0;//instances of the current step
+        int frame=0;//frames into the current mode
+        bool culled=true;//mode being measured
+        double culledMs=0;
+        QElapsedTimer timer;
+    }cullBench;
+
+    bool profilingRequested=true;
+    QString profileTraceFileName;//written on releaseResources()
+    GpuProfiler profiler;
+
     VkBuffer floorVertexBuf=VK_NULL_HANDLE;
     struct{
         Shader vs;
@@ -76,31 +240,82 @@ private:
         VkPipeline pipeline=VK_NULL_HANDLE;
     }floorMaterial;
 
-    VkDeviceMemory bufMem=VK_NULL_HANDLE;
+    VkDeviceMemory vertexBufMem=VK_NULL_HANDLE;//device local, floor only
+    VkDeviceMemory bufMem=VK_NULL_HANDLE;//host visible, uniforms only
+    UniformRing uniformRing;
+    Uploader uploader;
     VkBuffer uniBuf=VK_NULL_HANDLE;
     VkPipelineCache pipelineCache=VK_NULL_HANDLE;
     QFuture<void> pipelinesFuture;
 
+    // Shader hot reload: the watcher hands new SPIR-V to the GUI thread, the
+    // pipelines are rebuilt on a worker and swapped in at a frame boundary.
+    QScopedPointer<ShaderWatcher> shaderWatcher;
+    QHash<QString, int> shaderSources;//GLSL source path to ShaderSlot
+    QMutex reloadMutex;
+    QHash<int, QByteArray> compiledShaders;//by ShaderSlot, guarded by reloadMutex
+    QFuture<ShaderReload> reloadFuture;
+    bool reloadPending=false;//reloadFuture has a result to apply
+
+    struct RecordSlot{
+        VkCommandPool pool=VK_NULL_HANDLE;
+        VkCommandBuffer cmdBuf=VK_NULL_HANDLE;//secondary
+        RenderQueue queue;//draw packets of the job recorded into cmdBuf
+    };
+    QVector<RecordSlot> recordSlots;//recordSlotCount per frame in flight
+    int recordThreadCount=1;
+    int recordSlotCount=0;
+
     QVector3D lightPos;
     Camera cam;
 
     QMatrix4x4 proj;
-    int vpDirty=0;
-    QMatrix4x4 floorModel;
 
-    bool animatingStatus;
+    std::atomic<bool> animatingStatus;
     float rotation=0.0f;
+    bool animationRequested=false;
+    float animationTime=0.0f;//seconds of animation played
+    Animator animator;//instance tracks, only used with animationRequested
+    std::vector<float> animatedScales;
 
-    int instCount;
-    int preparedInstCount=0;
+    int instCount;//spawned instances asked for
+    std::atomic<int> publishedInstCount;
+    int preparedInstCount=0;//spawned instances in the scene
+    int itemCount=0;//item instances in instBuf, in draw order
+    int instCapacity=0;//instances instBuf has room for
+    int stressInstanceTarget=0;
+    std::vector<quint32> itemEntities;//entity of every item instance
     QByteArray instData;
+    QByteArray transformData;//world rotation, translation and scale of every item instance
+    QRandomGenerator random;//instance placement
+    //per frame in flight, what its region of instBuf lacks, sorted and non-overlapping
+    QVector<QVector<InstanceRange>> dirtyInstances;
+    QVector<QVector<InstanceRange>> dirtyTransforms;
+    QVector<InstanceRange> unculledTransforms;//not handed to cpuCuller yet
+    //any instance rotated or scaled so far, and the largest scale, for CPU culling
+    bool instancesTransformed=false;
+    float maxInstanceScale=1.0f;
+    quint64 frameUploadBytes=0;
+    //a region per frame in flight, each the attributes, then the transforms at transformOffset()
     VkBuffer instBuf=VK_NULL_HANDLE;
     VkDeviceMemory instBufMem=VK_NULL_HANDLE;
+    quint8 *instMapped=nullptr;//persistently mapped instBufMem
+
+    struct DeferredRelease{
+        quint64 frame;
+        std::function<void()> release;
+    };
+    QVector<DeferredRelease> deferredReleases;
+    quint64 frameCounter=0;
 
     QFutureWatcher<void> frameWatcher;
     bool framePending;
 
-    QMutex guiMutex;
+    // Camera, instance count and mesh choice belong to the render worker, the
+    // GUI thread only posts changes.
+    InputQueue input;
+    QVector<qint64> frameInputTimes;//timestamps of the events applied to the frame being built
+    LatencyHistogram inputLatency;
 };
 
 #endif // RENDERER_H
@@ -0,0 +1,212 @@
+#include "renderqueue.h"
+#include <QVulkanFunctions>
+#include <cstring>
+
+// Bits of the sort key from the top: pass, pipeline, material, mesh, depth.
+// Ids that do not fit only sort next to others, the state of every packet is
+// compared in full before anything is skipped or merged.
+static const int PASS_BITS = 4;
+static const int PIPELINE_BITS = 8;
+static const int MATERIAL_BITS = 12;
+static const int MESH_BITS = 12;
+static_assert(PASS_BITS + PIPELINE_BITS + MATERIAL_BITS + MESH_BITS + RenderQueue::DEPTH_BITS == 64,
+              "The sort key is 64 bits");
+
+static inline quint64 field(int value, int bits, int shift)
+{
+    return (quint64(value) & ((quint64(1) << bits) - 1)) << shift;
+}
+
+RenderQueue::Stats &RenderQueue::Stats::operator+=(const Stats &o)
+{
+    packets += o.packets;
+    draws += o.draws;
+    pipelineBinds += o.pipelineBinds;
+    descriptorBinds += o.descriptorBinds;
+    vertexBufferBinds += o.vertexBufferBinds;
+    indexBufferBinds += o.indexBufferBinds;
+    pushConstants += o.pushConstants;
+    return *this;
+}
+
+RenderQueue::RenderQueue() {}
+
+quint64 RenderQueue::key(Pass pass, int pipeline, int material, int mesh, quint32 depth)
+{
+    int shift = DEPTH_BITS;
+    quint64 k = field(int(depth), DEPTH_BITS, 0);
+    k |= field(mesh, MESH_BITS, shift);
+    shift += MESH_BITS;
+    k |= field(material, MATERIAL_BITS, shift);
+    shift += MATERIAL_BITS;
+    k |= field(pipeline, PIPELINE_BITS, shift);
+    shift += PIPELINE_BITS;
+    return k | field(pass, PASS_BITS, shift);
+}
+
+quint32 RenderQueue::depth(float distance, float farPlane)
+{
+    const quint32 maxDepth = (1u << DEPTH_BITS) - 1;
+    if (!(distance > 0.0f))
+        return 0;
+    if (distance >= farPlane)
+        return maxDepth;
+    return quint32(double(distance) / farPlane * maxDepth);
+}
+
+void RenderQueue::clear()
+{
+    packets.clear();
+}
+
+RenderQueue::Packet &RenderQueue::add()
+{
+    packets.emplace_back();
+    return packets.back();
+}
+
+// LSD radix sort over the bytes of the key, 8 bits per pass, skipping the
+// passes where every key has the same digit. A queue holds a few packets per
+// mesh and material, so that is most of them.
+void RenderQueue::sort()
+{
+    const size_t n = packets.size();
+    entries.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        entries[i] = { packets[i].key, quint32(i) };
+    if (n < 2)
+        return;
+
+    sortTemp.resize(n);
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {};
+        for (const SortEntry &e : entries)
+            ++counts[(e.key >> shift) & 0xff];
+        if (counts[(entries.front().key >> shift) & 0xff] == n)
+            continue;
+        size_t offset = 0;
+        for (size_t &c : counts) {
+            const size_t count = c;
+            c = offset;
+            offset += count;
+        }
+        for (const SortEntry &e : entries)
+            sortTemp[counts[(e.key >> shift) & 0xff]++] = e;
+        entries.swap(sortTemp);
+    }
+}
+
+bool RenderQueue::samePush(const Packet &a, const Packet &b)
+{
+    for (int i = 0; i < 2; ++i) {
+        const PushRange &ra = a.push[i];
+        const PushRange &rb = b.push[i];
+        if (ra.stages != rb.stages || ra.offset != rb.offset || ra.size != rb.size)
+            return false;
+        if (ra.size && memcmp(a.pushData + ra.offset, b.pushData + rb.offset, ra.size))
+            return false;
+    }
+    return true;
+}
+
+// b continues a, whose instance count may have grown by earlier merges, with
+// the same state and the instances right after.
+bool RenderQueue::mergeable(const Packet &a, const Packet &b, uint32_t aInstanceCount)
+{
+    return !a.indirectBuf && !b.indirectBuf
+        && a.pipeline == b.pipeline && a.layout == b.layout
+        && a.descSet == b.descSet && a.dynamicOffsetCount == b.dynamicOffsetCount
+        && !memcmp(a.dynamicOffsets, b.dynamicOffsets, a.dynamicOffsetCount * sizeof(uint32_t))
+        && a.vertexBuf == b.vertexBuf && a.vertexOffset == b.vertexOffset
+        && a.instanceBuf == b.instanceBuf && a.instanceOffset == b.instanceOffset
+        && a.indexBuf == b.indexBuf && a.indexOffset == b.indexOffset && a.indexType == b.indexType
+        && a.elementCount == b.elementCount
+        && a.firstInstance + aInstanceCount == b.firstInstance
+        && samePush(a, b);
+}
+
+// A secondary command buffer starts without any state, so the first packet
+// binds everything it uses. From then on only what changed is bound again,
+// compared against the packet that bound it last. Descriptor sets and push
+// constants are bound again after the pipeline layout changes.
+void RenderQueue::record(QVulkanDeviceFunctions *f, VkCommandBuffer cb)
+{
+    sort();
+    Stats stats;
+    stats.packets = int(packets.size());
+
+    const Packet *pipelineOf = nullptr;
+    const Packet *descSetOf = nullptr;
+    const Packet *vertexBufOf = nullptr;
+    const Packet *instanceBufOf = nullptr;
+    const Packet *indexBufOf = nullptr;
+    const Packet *pushOf[2] = {};
+    for (size_t s = 0; s < entries.size(); ) {
+        const Packet &p = packets[entries[s].packet];
+        uint32_t instanceCount = p.instanceCount;
+        for (++s; s < entries.size() && mergeable(p, packets[entries[s].packet], instanceCount); ++s)
+            instanceCount += packets[entries[s].packet].instanceCount;
+        if (!instanceCount && !p.indirectBuf)
+            continue;
+
+        if (!pipelineOf || pipelineOf->pipeline != p.pipeline) {
+            f->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, p.pipeline);
+            ++stats.pipelineBinds;
+        }
+        if (pipelineOf && pipelineOf->layout != p.layout)
+            descSetOf = pushOf[0] = pushOf[1] = nullptr;
+        pipelineOf = &p;
+
+        if (p.descSet && (!descSetOf || descSetOf->descSet != p.descSet
+                          || descSetOf->dynamicOffsetCount != p.dynamicOffsetCount
+                          || memcmp(descSetOf->dynamicOffsets, p.dynamicOffsets,
+                                    p.dynamicOffsetCount * sizeof(uint32_t)))) {
+            f->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, p.layout, 0, 1, &p.descSet,
+                                       p.dynamicOffsetCount, p.dynamicOffsets);
+            ++stats.descriptorBinds;
+            descSetOf = &p;
+        }
+        if (!vertexBufOf || vertexBufOf->vertexBuf != p.vertexBuf || vertexBufOf->vertexOffset != p.vertexOffset) {
+            f->vkCmdBindVertexBuffers(cb, 0, 1, &p.vertexBuf, &p.vertexOffset);
+            ++stats.vertexBufferBinds;
+            vertexBufOf = &p;
+        }
+        if (p.instanceBuf && (!instanceBufOf || instanceBufOf->instanceBuf != p.instanceBuf
+                              || instanceBufOf->instanceOffset != p.instanceOffset)) {
+            f->vkCmdBindVertexBuffers(cb, 1, 1, &p.instanceBuf, &p.instanceOffset);
+            ++stats.vertexBufferBinds;
+            instanceBufOf = &p;
+        }
+        if (p.indexBuf && (!indexBufOf || indexBufOf->indexBuf != p.indexBuf
+                           || indexBufOf->indexOffset != p.indexOffset || indexBufOf->indexType != p.indexType)) {
+            f->vkCmdBindIndexBuffer(cb, p.indexBuf, p.indexOffset, p.indexType);
+            ++stats.indexBufferBinds;
+            indexBufOf = &p;
+        }
+        for (int i = 0; i < 2; ++i) {
+            const PushRange &r = p.push[i];
+            if (!r.size)
+                continue;
+            const Packet *q = pushOf[i];
+            if (q && q->push[i].stages == r.stages && q->push[i].offset == r.offset && q->push[i].size == r.size
+                && !memcmp(q->pushData + r.offset, p.pushData + r.offset, r.size))
+                continue;
+            f->vkCmdPushConstants(cb, p.layout, r.stages, r.offset, r.size, p.pushData + r.offset);
+            ++stats.pushConstants;
+            pushOf[i] = &p;
+        }
+
+        if (p.indirectBuf) {
+            if (p.indexBuf)
+                f->vkCmdDrawIndexedIndirect(cb, p.indirectBuf, p.indirectOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+            else
+                f->vkCmdDrawIndirect(cb, p.indirectBuf, p.indirectOffset, 1, sizeof(VkDrawIndirectCommand));
+        } else if (p.indexBuf) {
+            f->vkCmdDrawIndexed(cb, p.elementCount, instanceCount, 0, 0, p.firstInstance);
+        } else {
+            f->vkCmdDraw(cb, p.elementCount, instanceCount, 0, p.firstInstance);
+        }
+        ++stats.draws;
+    }
+    lastStats = stats;
+}
@@ -0,0 +1,96 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <QVulkanInstance>
+#include <vector>
+
+class QVulkanDeviceFunctions;
+
+/**
+ * @brief Draw packets of one command buffer, recorded in the order of a 64 bit
+ * sort key: pass, pipeline, material, mesh and quantized depth, most
+ * significant first. Packets are radix sorted by key, and neighbours that draw
+ * the same mesh with the same state from adjacent instances are merged into a
+ * single instanced draw. Recording only binds what differs from the packet
+ * before, and counts the binds and draws.
+*/
+class RenderQueue
+{
+public:
+    enum Pass{Opaque, PassCount};
+
+    static const int PUSH_CONSTANT_SIZE = 128;//the least every device supports
+
+    struct PushRange{
+        VkShaderStageFlags stages=0;
+        uint32_t offset=0;//into Packet::pushData as well
+        uint32_t size=0;//0 for none
+    };
+    struct Packet{
+        quint64 key=0;
+        VkPipeline pipeline=VK_NULL_HANDLE;
+        VkPipelineLayout layout=VK_NULL_HANDLE;
+        VkDescriptorSet descSet=VK_NULL_HANDLE;//none if null
+        uint32_t dynamicOffsets[2]={};
+        uint32_t dynamicOffsetCount=0;
+        VkBuffer vertexBuf=VK_NULL_HANDLE;//binding 0
+        VkDeviceSize vertexOffset=0;
+        VkBuffer instanceBuf=VK_NULL_HANDLE;//binding 1, none if null
+        VkDeviceSize instanceOffset=0;
+        VkBuffer indexBuf=VK_NULL_HANDLE;//draws non-indexed if null
+        VkDeviceSize indexOffset=0;
+        VkIndexType indexType=VK_INDEX_TYPE_UINT16;
+        uint32_t elementCount=0;//indices per instance when indexed, vertices otherwise
+        uint32_t firstInstance=0;
+        uint32_t instanceCount=1;
+        VkBuffer indirectBuf=VK_NULL_HANDLE;//a draw command to use instead of the counts above
+        VkDeviceSize indirectOffset=0;
+        PushRange push[2];
+        quint8 pushData[PUSH_CONSTANT_SIZE];
+    };
+    //of the last record()
+    struct Stats{
+        int packets=0;
+        int draws=0;
+        int pipelineBinds=0;
+        int descriptorBinds=0;
+        int vertexBufferBinds=0;
+        int indexBufferBinds=0;
+        int pushConstants=0;
+        int binds() const {return pipelineBinds + descriptorBinds + vertexBufferBinds + indexBufferBinds + pushConstants;}
+        Stats &operator+=(const Stats &o);
+    };
+
+    RenderQueue();
+
+    static const int DEPTH_BITS = 28;
+    //pipeline, material and mesh are small ids such as the handles of Scene
+    static quint64 key(Pass pass, int pipeline, int material, int mesh, quint32 depth);
+    //distance from the eye to a depth for key(), so that nearer packets come first
+    static quint32 depth(float distance, float farPlane);
+
+    void clear();
+    //a packet with default state, valid until the next add()
+    Packet &add();
+    int size() const {return int(packets.size());}
+
+    //sort, merge and record the packets added since clear() into cb
+    void record(QVulkanDeviceFunctions *f, VkCommandBuffer cb);
+    const Stats &stats() const {return lastStats;}
+
+private:
+    struct SortEntry{
+        quint64 key;
+        quint32 packet;
+    };
+    void sort();
+    static bool samePush(const Packet &a, const Packet &b);
+    static bool mergeable(const Packet &a, const Packet &b, uint32_t aInstanceCount);
+
+    std::vector<Packet> packets;
+    std::vector<SortEntry> entries;
+    std::vector<SortEntry> sortTemp;
+    Stats lastStats;
+};
+
+#endif // RENDERQUEUE_H
@@ -0,0 +1,48 @@
+#ifndef RENDERTARGET_H
+#define RENDERTARGET_H
+
+#include <QVulkanInstance>
+#include <QMatrix4x4>
+#include <QList>
+#include <QSize>
+
+/**
+ * @brief What the Renderer needs from whatever it draws into: the device, the
+ * render pass and framebuffer of the current frame, and the frame pacing.
+ * Named after their QVulkanWindow counterparts, which Vkview forwards to;
+ * OffscreenTarget implements them on offscreen images without a surface.
+*/
+class RenderTarget
+{
+public:
+    virtual ~RenderTarget() {}
+
+    virtual QVulkanInstance *vulkanInstance() const = 0;
+    virtual VkPhysicalDevice physicalDevice() const = 0;
+    virtual VkDevice device() const = 0;
+    virtual const VkPhysicalDeviceProperties *physicalDeviceProperties() const = 0;
+    virtual VkQueue graphicsQueue() const = 0;
+    virtual uint32_t graphicsQueueFamilyIndex() const = 0;
+    virtual uint32_t hostVisibleMemoryIndex() const = 0;
+    virtual uint32_t deviceLocalMemoryIndex() const = 0;
+
+    virtual QList<int> supportedSampleCounts() = 0;
+    //only before the resources are initialized
+    virtual void setSampleCount(int sampleCount) = 0;
+    virtual VkSampleCountFlagBits sampleCountFlagBits() const = 0;
+    virtual VkRenderPass defaultRenderPass() const = 0;
+    virtual QMatrix4x4 clipCorrectionMatrix() = 0;
+
+    virtual int concurrentFrameCount() const = 0;
+    virtual int currentFrame() const = 0;
+    //valid from QVulkanWindowRenderer::startNextFrame() until frameReady()
+    virtual VkCommandBuffer currentCommandBuffer() const = 0;
+    virtual VkFramebuffer currentFramebuffer() const = 0;
+    virtual QSize swapChainImageSize() const = 0;
+    virtual void frameReady() = 0;
+    virtual void requestUpdate() = 0;
+
+    virtual bool isDebugEnabled() const = 0;
+};
+
+#endif // RENDERTARGET_H
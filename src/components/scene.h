@@ -0,0 +1,133 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <QMatrix4x4>
+#include <QString>
+#include <QVector3D>
+#include <QVector>
+#include <vector>
+
+/**
+ * @brief Entities of a scene as contiguous component arrays, indexed by
+ * entity: parent, local and world transform, mesh and material handle and
+ * color adjustment. Parents always come before their children, so
+ * the world transforms are propagated in a single pass in index order, from
+ * the first entity whose transform changed on. The entities that are drawn are
+ * radix sorted by pipeline, mesh and material into a draw list of batches, each
+ * a run of entities drawn with the same state. Both stay linear in the number
+ * of entities. There are no world bounds per entity, culling tests the mesh
+ * bounds under the world transforms itself.
+*/
+class Scene
+{
+public:
+    enum Pipeline{Floor, Items, PipelineCount};//in draw order
+
+    //rotation, translation and uniform scale, laid out like the instance
+    //transforms of color_phong.vert
+    struct Transform{
+        float rotation[4]={0, 0, 0, 1};//unit quaternion, x, y, z, w
+        float translate[3]={};
+        float scale=1;
+    };
+    struct MeshInfo{
+        QString fileName;
+        float rotation[4]={0, 0, 0, 1};//orientation of the mesh within its entity
+    };
+    struct Material{
+        QString name;
+        Pipeline pipeline=Items;//Floor draws the floor quad, whatever the mesh
+        float color[3]={0.7f, 0.7f, 0.7f};//diffuse
+    };
+    //entities drawOrder()[first, first + count) share pipeline, mesh and material
+    struct Batch{
+        Pipeline pipeline;
+        int mesh;
+        int material;
+        int first;
+        int count;
+    };
+    //where generated instances go, as children of entity
+    struct Spawner{
+        int entity=-1;
+        QVector<int> meshes;//to choose from, see Renderer::setSpawnMesh()
+        int material=-1;
+    };
+
+    Scene();
+
+    /**
+     * @brief replace the scene with the one described by a JSON file: meshes
+     * and materials by name, entities with an optional parent, mesh, material,
+     * translate, rotation as [degrees, x, y, z], scale and tint, in any order.
+     * Relative mesh file names are relative to the scene file.
+     * @return false, with a warning, if the file cannot be read or refers to
+     * something that is not there, the scene is empty then
+    */
+    bool load(const QString &fileName);
+    void clear();
+
+    int addMesh(const MeshInfo &mesh);
+    int addMaterial(const Material &material);
+    //parent is an entity added before, or -1, mesh and material may be -1 for entities that are not drawn
+    int addEntity(int parent, int mesh, int material, const Transform &local, const QVector3D &tint = QVector3D());
+    //drop the entities from count on, which includes all their children
+    void truncate(int count);
+
+    int meshCount() const {return int(meshes.size());}
+    const MeshInfo &mesh(int mesh) const {return meshes[mesh];}
+    int materialCount() const {return int(materials.size());}
+    const Material &material(int material) const {return materials[material];}
+    const Spawner &spawner() const {return spawn;}
+
+    int entityCount() const {return int(parents.size());}
+    int meshOf(int entity) const {return meshHandles[entity];}
+    int materialOf(int entity) const {return materialHandles[entity];}
+    void setMesh(int entity, int mesh);
+    const Transform &localTransform(int entity) const {return locals[entity];}
+    void setLocalTransform(int entity, const Transform &local);
+    //writable local transforms of the entities [begin, end), for animation
+    Transform *localTransforms(int begin, int end);
+    const Transform *worldTransforms() const {return worlds.data();}
+    const QVector3D *tints() const {return colors.data();}
+
+    //propagate the transforms and rebuild the draw list, if anything changed
+    void update();
+    //first entity whose world transform changed with the last update(), entityCount() if none
+    int changedFrom() const {return lastChangedFrom;}
+    bool drawListChanged() const {return lastDrawListChanged;}
+    //entity of every draw slot, sorted by pipeline, mesh and material
+    const std::vector<quint32> &drawOrder() const {return order;}
+    const std::vector<Batch> &batches() const {return drawBatches;}
+
+    static QMatrix4x4 matrix(const Transform &t);
+    //build scenes of up to count entities and log how long update() takes per
+    //entity, all transforms and the draw list, and with only the transforms
+    static void benchmark(int count);
+
+private:
+    void propagate(int begin);
+    void buildDrawList();
+
+    std::vector<MeshInfo> meshes;
+    std::vector<Material> materials;
+    Spawner spawn;
+
+    std::vector<int> parents;
+    std::vector<Transform> locals;
+    std::vector<Transform> worlds;
+    std::vector<int> meshHandles;
+    std::vector<int> materialHandles;
+    std::vector<QVector3D> colors;//diffuse adjustment of every entity
+
+    int firstChanged=0;//first entity whose local transform changed since the last update()
+    bool drawListDirty=true;
+    int lastChangedFrom=0;
+    bool lastDrawListChanged=false;
+    std::vector<quint32> order;
+    std::vector<quint64> sortKeys;//key in the upper half, entity in the lower one
+    std::vector<quint64> sortTemp;
+    std::vector<Batch> drawBatches;
+};
+
+#endif // SCENE_H
@@ -1,42 +1,51 @@
 #include "shader.h"
-#include <QtConcurrentRun>
 #include <QFile>
 #include <QVulkanDeviceFunctions>
 
 Shader::Shader() {}
 
-void Shader::load(QVulkanInstance *inst, VkDevice dev, const QString &fn){
+void Shader::load(QVulkanInstance *inst, VkDevice dev, const QString &fn, AssetManager::Priority priority){
     reset();
-    maybeRunning = true;
-    future=QtConcurrent::run([inst, dev, fn](){
+    //not shared, the owner destroys the module
+    asset = AssetManager::instance()->request<ShaderData>(QString(), priority, [inst, dev, fn](){
         ShaderData sd;
         QFile infile(fn);
         if(!infile.open(QIODevice::ReadOnly)){
             qWarning("Failed to open %s", qPrintable(fn));
             return sd;
         }
-        QByteArray blob = infile.readAll();
-        VkShaderModuleCreateInfo shaderInfo;
-        memset(&shaderInfo, 0, sizeof(shaderInfo));
-        shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-        shaderInfo.codeSize = blob.size();
-        //reinterpret_cast only works when the bit mode are same
-        shaderInfo.pCode = reinterpret_cast<const uint32_t *>(blob.constData());
-        VkResult err = inst->deviceFunctions(dev)->vkCreateShaderModule(dev, &shaderInfo, nullptr, &sd.shaderModule);
-        if(err!=VK_SUCCESS){
-            qWarning("Failed to create shader module: %d", err);
-            return sd;
-        }
+        sd.shaderModule = createModule(inst->deviceFunctions(dev), dev, infile.readAll());
         return sd;
     });
 }
 
-ShaderData *Shader::data(){
-    if(maybeRunning &&! shaderData.isValid()) shaderData = future.result();
-    return &shaderData;
+VkShaderModule Shader::createModule(QVulkanDeviceFunctions *f, VkDevice dev, const QByteArray &spirv){
+    VkShaderModule module = VK_NULL_HANDLE;
+    VkShaderModuleCreateInfo shaderInfo;
+    memset(&shaderInfo, 0, sizeof(shaderInfo));
+    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderInfo.codeSize = spirv.size();
+    //reinterpret_cast only works when the bit mode are same
+    shaderInfo.pCode = reinterpret_cast<const uint32_t *>(spirv.constData());
+    VkResult err = f->vkCreateShaderModule(dev, &shaderInfo, nullptr, &module);
+    if(err!=VK_SUCCESS){
+        qWarning("Failed to create shader module: %d", err);
+        return VK_NULL_HANDLE;
+    }
+    return module;
+}
+
+void Shader::adopt(VkShaderModule module){
+    ShaderData sd;
+    sd.shaderModule = module;
+    asset = AssetHandle<ShaderData>::fromValue(sd);
+}
+
+const ShaderData *Shader::data(){
+    static const ShaderData empty;
+    return asset.isNull() ? &empty : &asset.wait();
 }
 
 void Shader::reset(){
-    *data() = ShaderData();
-    maybeRunning = false;
+    asset.reset();
 }
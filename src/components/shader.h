@@ -2,7 +2,9 @@
 #define SHADER_H
 
 #include <QVulkanInstance>
-#include <QFuture>
+#include "assetmanager.h"
+
+class QVulkanDeviceFunctions;
 
 struct ShaderData{
     bool isValid() const{return shaderModule!=VK_NULL_HANDLE;}
@@ -13,14 +15,21 @@ class Shader
 {
 public:
     Shader();
-    void load(QVulkanInstance *inst, VkDevice dev, const QString &fn);
-    ShaderData *data();
+    //shaders gate the pipelines, so they go ahead of other assets by default
+    void load(QVulkanInstance *inst, VkDevice dev, const QString &fn,
+              AssetManager::Priority priority = AssetManager::High);
+    //blocks until loaded
+    const ShaderData *data();
     bool isValid() {return data()->isValid();}
+    const AssetHandle<ShaderData> &handle() const {return asset;}
+    //take over a module created elsewhere, the previous one is left to the caller
+    void adopt(VkShaderModule module);
     void reset();
+
+    //VK_NULL_HANDLE on failure
+    static VkShaderModule createModule(QVulkanDeviceFunctions *f, VkDevice dev, const QByteArray &spirv);
 private:
-    bool maybeRunning=false;
-    QFuture<ShaderData> future;
-    ShaderData shaderData;
+    AssetHandle<ShaderData> asset;
 };
 
 #endif // SHADER_H
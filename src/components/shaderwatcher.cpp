@@ -0,0 +1,94 @@
+#include "shaderwatcher.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+
+static const int DEBOUNCE_MS = 100;
+
+ShaderWatcher::ShaderWatcher(QObject *parent)
+    : QObject(parent)
+{
+    debounce.setSingleShot(true);
+    debounce.setInterval(DEBOUNCE_MS);
+    connect(&debounce, &QTimer::timeout, this, [this] {
+        for (const QString &source : std::as_const(dirty)) {
+            if (!queue.contains(source))
+                queue.append(source);
+        }
+        dirty.clear();
+        compileNext();
+    });
+    connect(&watcher, &QFileSystemWatcher::fileChanged, this, &ShaderWatcher::changed);
+}
+
+void ShaderWatcher::watch(const QStringList &sources, Callback callback)
+{
+    done = std::move(callback);
+    for (const QString &source : sources) {
+        if (QFileInfo::exists(source))
+            watcher.addPath(source);
+    }
+}
+
+void ShaderWatcher::changed(const QString &source)
+{
+    // Saving by replacing the file drops it from the watcher, add it again.
+    if (!watcher.files().contains(source) && QFileInfo::exists(source))
+        watcher.addPath(source);
+    dirty.insert(source);
+    debounce.start();
+}
+
+void ShaderWatcher::compileNext()
+{
+    if (compiling || queue.isEmpty())
+        return;
+    if (!outDir.isValid()) {
+        qWarning("No directory for compiled shaders: %s", qPrintable(outDir.errorString()));
+        queue.clear();
+        return;
+    }
+
+    const QString source = queue.takeFirst();
+    const QString spv = outDir.filePath(QFileInfo(source).fileName() + QLatin1String(".spv"));
+    compiling = true;
+
+    QProcess *glslc = new QProcess(this);
+    glslc->setProcessChannelMode(QProcess::MergedChannels);
+    QElapsedTimer *timer = new QElapsedTimer;
+    timer->start();
+    connect(glslc, &QProcess::finished, this, [this, glslc, timer, source, spv](int exitCode, QProcess::ExitStatus status) {
+        const qint64 ms = timer->elapsed();
+        delete timer;
+        const QByteArray output = glslc->readAll();
+        glslc->deleteLater();
+        compiling = false;
+
+        if (status != QProcess::NormalExit || exitCode != 0) {
+            // keep the pipelines as they are until the source compiles again
+            qWarning("Failed to compile %s:\n%s", qPrintable(source), output.constData());
+        } else {
+            QFile f(spv);
+            if (f.open(QIODevice::ReadOnly)) {
+                if (debug)
+                    qDebug("Compiled %s in %lld ms", qPrintable(QFileInfo(source).fileName()), ms);
+                if (done)
+                    done(source, f.readAll());
+            } else {
+                qWarning("Failed to open %s", qPrintable(spv));
+            }
+        }
+        compileNext();
+    });
+    connect(glslc, &QProcess::errorOccurred, this, [this, glslc, timer](QProcess::ProcessError error) {
+        if (error != QProcess::FailedToStart)
+            return;
+        qWarning("Failed to start %s: %s", GLSLC_EXECUTABLE, qPrintable(glslc->errorString()));
+        delete timer;
+        glslc->deleteLater();
+        compiling = false;
+        compileNext();
+    });
+    glslc->start(QStringLiteral(GLSLC_EXECUTABLE), { source, QStringLiteral("-o"), spv });
+}
@@ -0,0 +1,45 @@
+#ifndef SHADERWATCHER_H
+#define SHADERWATCHER_H
+
+#include <QObject>
+#include <QFileSystemWatcher>
+#include <QTemporaryDir>
+#include <QTimer>
+#include <QSet>
+#include <functional>
+
+/**
+ * @brief Watches GLSL sources and compiles them to SPIR-V in a glslc process
+ * whenever they change. Lives on the GUI thread, nothing here blocks: the
+ * compiler runs as a separate process and the result is handed to the
+ * callback once it has exited.
+*/
+class ShaderWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    //called on the GUI thread with the source that changed and its new SPIR-V
+    using Callback = std::function<void(const QString &source, const QByteArray &spirv)>;
+
+    explicit ShaderWatcher(QObject *parent = nullptr);
+
+    void watch(const QStringList &sources, Callback callback);
+    //log the compile times, failures are always reported
+    void setDebug(bool on) {debug=on;}
+
+private:
+    void changed(const QString &source);
+    void compileNext();
+
+    QFileSystemWatcher watcher;
+    QTimer debounce;//editors tend to write a file in several steps
+    QSet<QString> dirty;
+    QStringList queue;
+    bool compiling=false;
+    QTemporaryDir outDir;
+    Callback done;
+    bool debug=false;
+};
+
+#endif // SHADERWATCHER_H
@@ -0,0 +1,42 @@
+#include "uniformring.h"
+
+static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
+{
+    return (v + byteAlign - 1) & ~(byteAlign - 1);
+}
+
+UniformRing::UniformRing() {}
+
+void UniformRing::create(quint8 *p, VkDeviceSize size, int count, VkDeviceSize align)
+{
+    mapped = p;
+    frameSize = size;
+    frameCount = count;
+    alignment = align;
+    frameStart = 0;
+    used = 0;
+}
+
+void UniformRing::reset()
+{
+    mapped = nullptr;
+    frameSize = 0;
+    frameCount = 0;
+}
+
+void UniformRing::beginFrame(int frame)
+{
+    Q_ASSERT(frame >= 0 && frame < frameCount);
+    frameStart = frame * frameSize;
+    used = 0;
+}
+
+UniformRing::Allocation UniformRing::allocate(VkDeviceSize size)
+{
+    const VkDeviceSize ofs = aligned(used, alignment);
+    if (ofs + size > frameSize)
+        qFatal("Uniform ring exhausted: %llu bytes requested, %llu of %llu used",
+               (unsigned long long) size, (unsigned long long) used, (unsigned long long) frameSize);
+    used = ofs + size;
+    return { mapped + frameStart + ofs, uint32_t(frameStart + ofs) };
+}
@@ -0,0 +1,38 @@
+#ifndef UNIFORMRING_H
+#define UNIFORMRING_H
+
+#include <QVulkanInstance>
+
+/**
+ * @brief Linear sub-allocator over a persistently mapped uniform buffer that is
+ * split into one region per frame in flight. Every frame starts over at the
+ * beginning of its own region, so nothing written for a frame the GPU may still
+ * be reading is ever touched.
+*/
+class UniformRing
+{
+public:
+    struct Allocation{
+        quint8 *p;//where to write the data
+        uint32_t offset;//dynamic offset to bind the buffer with
+    };
+
+    UniformRing();
+
+    void create(quint8 *mapped, VkDeviceSize frameSize, int frameCount, VkDeviceSize alignment);
+    void reset();
+    static VkDeviceSize bufferSize(VkDeviceSize frameSize, int frameCount) {return frameSize * frameCount;}
+
+    void beginFrame(int frame);
+    Allocation allocate(VkDeviceSize size);
+
+private:
+    quint8 *mapped=nullptr;
+    VkDeviceSize frameSize=0;
+    int frameCount=0;
+    VkDeviceSize alignment=1;
+    VkDeviceSize frameStart=0;
+    VkDeviceSize used=0;
+};
+
+#endif // UNIFORMRING_H
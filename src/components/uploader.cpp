@@ -0,0 +1,239 @@
+#include "uploader.h"
+#include <QVulkanDeviceFunctions>
+
+// Offsets handed out by the ring are aligned to this.
+static const VkDeviceSize STAGING_ALIGNMENT = 16;
+
+static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
+{
+    return (v + byteAlign - 1) & ~(byteAlign - 1);
+}
+
+Uploader::Uploader() {}
+
+void Uploader::create(QVulkanDeviceFunctions *f, VkDevice device, VkQueue q, uint32_t queueFamilyIndex,
+                      uint32_t hostVisibleMemoryIndex, VkDeviceSize stagingSize)
+{
+    devFuncs = f;
+    dev = device;
+    queue = q;
+    ringSize = stagingSize;
+    head = tail = 0;
+    wrapped = false;
+
+    VkCommandPoolCreateInfo poolInfo;
+    memset(&poolInfo, 0, sizeof(poolInfo));
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndex;
+    VkResult err = devFuncs->vkCreateCommandPool(dev, &poolInfo, nullptr, &cmdPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create upload command pool: %d", err);
+
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = ringSize;
+    bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    err = devFuncs->vkCreateBuffer(dev, &bufInfo, nullptr, &stagingBuf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create staging buffer: %d", err);
+
+    VkMemoryRequirements memReq;
+    devFuncs->vkGetBufferMemoryRequirements(dev, stagingBuf, &memReq);
+    VkMemoryAllocateInfo memAllocInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        nullptr,
+        memReq.size,
+        hostVisibleMemoryIndex
+    };
+    err = devFuncs->vkAllocateMemory(dev, &memAllocInfo, nullptr, &stagingMem);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate staging memory: %d", err);
+    err = devFuncs->vkBindBufferMemory(dev, stagingBuf, stagingMem, 0);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind staging buffer memory: %d", err);
+
+    // The staging memory stays mapped for the lifetime of the uploader.
+    err = devFuncs->vkMapMemory(dev, stagingMem, 0, ringSize, 0, reinterpret_cast<void **>(&mapped));
+    if (err != VK_SUCCESS)
+        qFatal("Failed to map staging memory: %d", err);
+}
+
+void Uploader::destroy()
+{
+    if (!dev)
+        return;
+
+    wait();
+
+    for (const Batch &b : std::as_const(freeBatches))
+        devFuncs->vkDestroyFence(dev, b.fence, nullptr);
+    freeBatches.clear();
+
+    if (cmdPool) {
+        devFuncs->vkDestroyCommandPool(dev, cmdPool, nullptr);
+        cmdPool = VK_NULL_HANDLE;
+    }
+
+    if (stagingBuf) {
+        devFuncs->vkDestroyBuffer(dev, stagingBuf, nullptr);
+        stagingBuf = VK_NULL_HANDLE;
+    }
+
+    if (stagingMem) {
+        devFuncs->vkFreeMemory(dev, stagingMem, nullptr);
+        stagingMem = VK_NULL_HANDLE;
+        mapped = nullptr;
+    }
+
+    dev = VK_NULL_HANDLE;
+}
+
+VkDeviceSize Uploader::allocate(VkDeviceSize size)
+{
+    Q_ASSERT(size <= ringSize);
+    for (;;) {
+        if (pending.isEmpty() && inFlight.isEmpty()) {
+            head = tail = 0;
+            wrapped = false;
+        }
+
+        const VkDeviceSize start = aligned(head, STAGING_ALIGNMENT);
+        if (!wrapped) {
+            // data in use is [tail, head), free space is [head, ringSize) and [0, tail)
+            if (start + size <= ringSize) {
+                head = start + size;
+                return start;
+            }
+            if (size <= tail) {
+                head = size;
+                wrapped = true;
+                return 0;
+            }
+        } else if (start + size <= tail) {
+            // data in use is [tail, ringSize) and [0, head)
+            head = start + size;
+            return start;
+        }
+
+        // Out of space: submit what is pending and wait for the oldest
+        // submission to give its part of the ring back.
+        flush();
+        retireOldest();
+    }
+}
+
+void Uploader::upload(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size)
+{
+    const quint8 *src = static_cast<const quint8 *>(data);
+    while (size) {
+        const VkDeviceSize chunk = qMin(size, ringSize);
+        const VkDeviceSize ofs = allocate(chunk);
+        memcpy(mapped + ofs, src, chunk);
+        pending.append({ dst, { ofs, dstOffset, chunk } });
+        totalBytes += chunk;
+        src += chunk;
+        dstOffset += chunk;
+        size -= chunk;
+    }
+}
+
+void Uploader::flush()
+{
+    retireCompleted();
+    if (pending.isEmpty())
+        return;
+
+    Batch batch;
+    VkResult err;
+    if (!freeBatches.isEmpty()) {
+        batch = freeBatches.takeLast();
+        devFuncs->vkResetCommandBuffer(batch.cmdBuf, 0);
+        devFuncs->vkResetFences(dev, 1, &batch.fence);
+    } else {
+        VkCommandBufferAllocateInfo cmdBufInfo = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, cmdPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1
+        };
+        err = devFuncs->vkAllocateCommandBuffers(dev, &cmdBufInfo, &batch.cmdBuf);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate upload command buffer: %d", err);
+        VkFenceCreateInfo fenceInfo;
+        memset(&fenceInfo, 0, sizeof(fenceInfo));
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        err = devFuncs->vkCreateFence(dev, &fenceInfo, nullptr, &batch.fence);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create upload fence: %d", err);
+    }
+
+    VkCommandBufferBeginInfo beginInfo;
+    memset(&beginInfo, 0, sizeof(beginInfo));
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    devFuncs->vkBeginCommandBuffer(batch.cmdBuf, &beginInfo);
+
+    // One vkCmdCopyBuffer per run of copies into the same destination.
+    QVector<VkBufferCopy> regions;
+    for (int i = 0; i < pending.size(); ++i) {
+        regions.append(pending[i].region);
+        if (i + 1 == pending.size() || pending[i + 1].dst != pending[i].dst) {
+            devFuncs->vkCmdCopyBuffer(batch.cmdBuf, stagingBuf, pending[i].dst, uint32_t(regions.size()), regions.constData());
+            regions.clear();
+        }
+    }
+
+    // Make the copies visible to whatever the following submissions use the
+    // destination buffers for.
+    VkMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT
+                            | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT
+                            | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    devFuncs->vkCmdPipelineBarrier(batch.cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                   0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    err = devFuncs->vkEndCommandBuffer(batch.cmdBuf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end upload command buffer: %d", err);
+
+    VkSubmitInfo submitInfo;
+    memset(&submitInfo, 0, sizeof(submitInfo));
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.cmdBuf;
+    err = devFuncs->vkQueueSubmit(queue, 1, &submitInfo, batch.fence);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to submit uploads: %d", err);
+
+    batch.ringEnd = head;
+    inFlight.append(batch);
+    pending.clear();
+}
+
+void Uploader::retireOldest()
+{
+    if (inFlight.isEmpty())
+        return;
+    Batch batch = inFlight.takeFirst();
+    devFuncs->vkWaitForFences(dev, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+    // the tail moving backwards means it followed the head around the end
+    if (batch.ringEnd < tail)
+        wrapped = false;
+    tail = batch.ringEnd;
+    freeBatches.append(batch);
+}
+
+void Uploader::retireCompleted()
+{
+    while (!inFlight.isEmpty() && devFuncs->vkGetFenceStatus(dev, inFlight.first().fence) == VK_SUCCESS)
+        retireOldest();
+}
+
+void Uploader::wait()
+{
+    flush();
+    while (!inFlight.isEmpty())
+        retireOldest();
+}
@@ -0,0 +1,67 @@
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include <QVulkanInstance>
+#include <QVector>
+
+class QVulkanDeviceFunctions;
+
+/**
+ * @brief Moves data into device-local buffers through a host-visible staging
+ * ring. Copies are collected and recorded into one command buffer per flush(),
+ * every submission is tracked by a fence so that its part of the ring can be
+ * reused once the GPU is done with it.
+*/
+class Uploader
+{
+public:
+    Uploader();
+
+    void create(QVulkanDeviceFunctions *f, VkDevice dev, VkQueue queue, uint32_t queueFamilyIndex,
+                uint32_t hostVisibleMemoryIndex, VkDeviceSize stagingSize);
+    void destroy();
+    bool isValid() const {return stagingBuf!=VK_NULL_HANDLE;}
+
+    //copy data into the staging ring now, the GPU copy into dst happens on the next flush()
+    void upload(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size);
+    //submit all pending copies, later submissions to the same queue see the results
+    void flush();
+    //flush and block until every submitted copy has completed
+    void wait();
+
+    quint64 bytesUploaded() const {return totalBytes;}
+
+private:
+    struct PendingCopy{
+        VkBuffer dst;
+        VkBufferCopy region;
+    };
+    struct Batch{
+        VkCommandBuffer cmdBuf=VK_NULL_HANDLE;
+        VkFence fence=VK_NULL_HANDLE;
+        VkDeviceSize ringEnd=0;//ring head at submission, becomes the tail once retired
+    };
+
+    VkDeviceSize allocate(VkDeviceSize size);
+    void retireOldest();
+    void retireCompleted();
+
+    QVulkanDeviceFunctions *devFuncs=nullptr;
+    VkDevice dev=VK_NULL_HANDLE;
+    VkQueue queue=VK_NULL_HANDLE;
+    VkCommandPool cmdPool=VK_NULL_HANDLE;
+    VkBuffer stagingBuf=VK_NULL_HANDLE;
+    VkDeviceMemory stagingMem=VK_NULL_HANDLE;
+    quint8 *mapped=nullptr;
+    VkDeviceSize ringSize=0;
+    VkDeviceSize head=0;
+    VkDeviceSize tail=0;
+    bool wrapped=false;//head has wrapped around and is behind tail
+
+    QVector<PendingCopy> pending;
+    QVector<Batch> inFlight;//oldest first
+    QVector<Batch> freeBatches;
+    quint64 totalBytes=0;
+};
+
+#endif // UPLOADER_H
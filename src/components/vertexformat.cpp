@@ -0,0 +1,117 @@
+#include "vertexformat.h"
+#include <QFloat16>
+#include <QtMath>
+#include <cstring>
+
+VertexFormat::VertexFormat(Id id, int stride, const QVector<Attribute> &attributes)
+    : formatId(id), byteStride(stride), attrs(attributes){
+}
+
+const VertexFormat &VertexFormat::get(Id id){
+    // x,y,z,u,v,nx,ny,nz
+    static const VertexFormat standard(Standard, 8 * sizeof(float), {
+        {Position, Float3, 0},
+        {TexCoord, Float2, 3 * sizeof(float)},
+        {Normal, Float3, 5 * sizeof(float)}
+    });
+    static const VertexFormat packed(Packed, 16, {
+        {Position, Unorm16x4, 0},
+        {TexCoord, Half2, 8},
+        {Normal, OctSnorm16x2, 12}
+    });
+    return id == Packed ? packed : standard;
+}
+
+VertexFormat::Id VertexFormat::fromEnvironment(){
+    return qgetenv("KEYFRAME_VERTEX_FORMAT") == "packed" ? Packed : Standard;
+}
+
+const VertexFormat::Attribute *VertexFormat::find(Semantic semantic) const{
+    for(const Attribute &a : attrs){
+        if(a.semantic == semantic)
+            return &a;
+    }
+    return nullptr;
+}
+
+static inline quint16 toUnorm16(float v){
+    return quint16(qRound(qBound(0.0f, v, 1.0f) * 65535.0f));
+}
+
+static inline qint16 toSnorm16(float v){
+    return qint16(qRound(qBound(-1.0f, v, 1.0f) * 32767.0f));
+}
+
+// Projects the unit normal onto the octahedron |x|+|y|+|z|=1 and folds the
+// lower half over the diagonals, see Cigolle et al. 2014.
+static void encodeOctahedral(const float *n, float *out){
+    const float l1 = qAbs(n[0]) + qAbs(n[1]) + qAbs(n[2]);
+    float x = l1 > 0.0f ? n[0] / l1 : 0.0f;
+    float y = l1 > 0.0f ? n[1] / l1 : 0.0f;
+    if(n[2] < 0.0f){
+        const float fx = (1.0f - qAbs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        const float fy = (1.0f - qAbs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    out[0] = x;
+    out[1] = y;
+}
+
+QByteArray VertexFormat::encode(const float *vertices, int vertexCount, const float *aabb) const{
+    QByteArray out(qsizetype(vertexCount) * byteStride, Qt::Uninitialized);
+    float invExtent[3];
+    for(int i = 0; i < 3; ++i){
+        const float extent = aabb[2 * i + 1] - aabb[2 * i];
+        invExtent[i] = extent > 0.0f ? 1.0f / extent : 0.0f;
+    }
+
+    for(int v = 0; v < vertexCount; ++v){
+        const float *src = vertices + size_t(v) * 8;
+        char *dst = out.data() + qsizetype(v) * byteStride;
+        for(const Attribute &a : attrs){
+            const float *in = src + (a.semantic == Position ? 0 : a.semantic == TexCoord ? 3 : 5);
+            char *p = dst + a.offset;
+            switch(a.encoding){
+            case Float2:
+                memcpy(p, in, 2 * sizeof(float));
+                break;
+            case Float3:
+                memcpy(p, in, 3 * sizeof(float));
+                break;
+            case Unorm16x4:{
+                const quint16 q[4] = {
+                    toUnorm16((in[0] - aabb[0]) * invExtent[0]),
+                    toUnorm16((in[1] - aabb[2]) * invExtent[1]),
+                    toUnorm16((in[2] - aabb[4]) * invExtent[2]),
+                    0xFFFF
+                };
+                memcpy(p, q, sizeof(q));
+                break;
+            }
+            case Half2:{
+                const qfloat16 h[2] = {qfloat16(in[0]), qfloat16(in[1])};
+                memcpy(p, h, sizeof(h));
+                break;
+            }
+            case OctSnorm16x2:{
+                float oct[2];
+                encodeOctahedral(in, oct);
+                const qint16 q[2] = {toSnorm16(oct[0]), toSnorm16(oct[1])};
+                memcpy(p, q, sizeof(q));
+                break;
+            }
+            }
+        }
+    }
+    return out;
+}
+
+void VertexFormat::positionDecode(const float *aabb, float *offset, float *scale) const{
+    const Attribute *pos = find(Position);
+    const bool quantized = pos && pos->encoding == Unorm16x4;
+    for(int i = 0; i < 3; ++i){
+        offset[i] = quantized ? aabb[2 * i] : 0.0f;
+        scale[i] = quantized ? aabb[2 * i + 1] - aabb[2 * i] : 1.0f;
+    }
+}
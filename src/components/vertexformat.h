@@ -0,0 +1,57 @@
+#ifndef VERTEXFORMAT_H
+#define VERTEXFORMAT_H
+
+#include <QByteArray>
+#include <QVector>
+
+/**
+ * @brief Describes how the vertices of a mesh are laid out in memory. The
+ * standard layout is what .buf files contain, 8 floats per vertex. The packed
+ * layout stores positions as 16-bit UNORM relative to the mesh bounds, UVs as
+ * half floats and normals octahedral encoded in two 16-bit SNORM components,
+ * 16 bytes per vertex. Both the conversion and the pipeline's vertex attributes
+ * are driven by the attribute list.
+*/
+class VertexFormat
+{
+public:
+    enum Id{Standard, Packed};
+    enum Semantic{Position, TexCoord, Normal};
+    enum Encoding{
+        Float2,
+        Float3,
+        Unorm16x4,//xyz relative to the bounds, w is always 1
+        Half2,
+        OctSnorm16x2
+    };
+    struct Attribute{
+        Semantic semantic;
+        Encoding encoding;
+        int offset;
+    };
+
+    static const VertexFormat &get(Id id);
+    //KEYFRAME_VERTEX_FORMAT=packed selects the packed layout
+    static Id fromEnvironment();
+
+    Id id() const {return formatId;}
+    const char *name() const {return formatId == Packed ? "packed" : "standard";}
+    int stride() const {return byteStride;}
+    const QVector<Attribute> &attributes() const {return attrs;}
+    const Attribute *find(Semantic semantic) const;
+
+    //convert vertices of the standard layout, aabb is minX, maxX, minY, maxY, minZ, maxZ
+    QByteArray encode(const float *vertices, int vertexCount, const float *aabb) const;
+    //decoded Unorm16x4 positions map back into mesh space as offset + p * scale,
+    //offset 0 and scale 1 for float positions
+    void positionDecode(const float *aabb, float *offset, float *scale) const;
+
+private:
+    VertexFormat(Id id, int stride, const QVector<Attribute> &attributes);
+
+    Id formatId;
+    int byteStride;
+    QVector<Attribute> attrs;
+};
+
+#endif // VERTEXFORMAT_H
@@ -20,7 +20,7 @@ void Vkview::togglePaused(){
 
 void Vkview::meshSwitched(bool enable)
 {
-    renderer->setUseLogo(enable);
+    renderer->setSpawnMesh(enable ? 1 : 0);
 }
 
 void Vkview::mousePressEvent(QMouseEvent *e)
@@ -77,6 +77,11 @@ int Vkview::instanceCount() const
     return renderer->instanceCount();
 }
 
+QString Vkview::profileSummary() const
+{
+    return renderer ? renderer->profileSummary() : QString();
+}
+
 
 
 
@@ -2,16 +2,41 @@
 #define VKVIEW_H
 
 #include <QVulkanWindow>
+#include "rendertarget.h"
 
 class Renderer;
 
-class Vkview:public QVulkanWindow{
+class Vkview:public QVulkanWindow, public RenderTarget{
 public:
     Vkview(bool dbg);
     QVulkanWindowRenderer *createRenderer() override;
 
-    bool isDebugEnabled() const { return debug;}
+    bool isDebugEnabled() const override { return debug;}
     int instanceCount() const;
+    //GPU pass timings of the last frames, empty before the renderer exists
+    QString profileSummary() const;
+
+    // RenderTarget, the swapchain of the window
+    QVulkanInstance *vulkanInstance() const override { return QVulkanWindow::vulkanInstance();}
+    VkPhysicalDevice physicalDevice() const override { return QVulkanWindow::physicalDevice();}
+    VkDevice device() const override { return QVulkanWindow::device();}
+    const VkPhysicalDeviceProperties *physicalDeviceProperties() const override { return QVulkanWindow::physicalDeviceProperties();}
+    VkQueue graphicsQueue() const override { return QVulkanWindow::graphicsQueue();}
+    uint32_t graphicsQueueFamilyIndex() const override { return QVulkanWindow::graphicsQueueFamilyIndex();}
+    uint32_t hostVisibleMemoryIndex() const override { return QVulkanWindow::hostVisibleMemoryIndex();}
+    uint32_t deviceLocalMemoryIndex() const override { return QVulkanWindow::deviceLocalMemoryIndex();}
+    QList<int> supportedSampleCounts() override { return QVulkanWindow::supportedSampleCounts();}
+    void setSampleCount(int sampleCount) override { QVulkanWindow::setSampleCount(sampleCount);}
+    VkSampleCountFlagBits sampleCountFlagBits() const override { return QVulkanWindow::sampleCountFlagBits();}
+    VkRenderPass defaultRenderPass() const override { return QVulkanWindow::defaultRenderPass();}
+    QMatrix4x4 clipCorrectionMatrix() override { return QVulkanWindow::clipCorrectionMatrix();}
+    int concurrentFrameCount() const override { return QVulkanWindow::concurrentFrameCount();}
+    int currentFrame() const override { return QVulkanWindow::currentFrame();}
+    VkCommandBuffer currentCommandBuffer() const override { return QVulkanWindow::currentCommandBuffer();}
+    VkFramebuffer currentFramebuffer() const override { return QVulkanWindow::currentFramebuffer();}
+    QSize swapChainImageSize() const override { return QVulkanWindow::swapChainImageSize();}
+    void frameReady() override { QVulkanWindow::frameReady();}
+    void requestUpdate() override { QVulkanWindow::requestUpdate();}
 
 public slots:
     void addNew();
@@ -25,7 +50,7 @@ private:
     void keyPressEvent(QKeyEvent *) override;
 
     bool debug;
-    Renderer *renderer;
+    Renderer *renderer=nullptr;
     bool pressed=false;
     QPoint lastPos;
 };
@@ -3,10 +3,27 @@
 #include <QLocale>
 #include <QTranslator>
 #include <QLoggingCategory>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QThread>
 #include "vkview.h"
+#include "offscreentarget.h"
+#include "frameencoder.h"
+
+// Frames read back but not yet written, beyond that rendering waits for the encoder.
+static const int ENCODER_QUEUE_SIZE = 8;
 
 int main(int argc, char *argv[])
 {
+    // Headless rendering needs no display, only the Vulkan instance, which the
+    // offscreen platform provides as well, so it does not depend on xcb or
+    // wayland being there. The parser needs the application, hence the scan.
+    for (int i = 1; i < argc; ++i) {
+        if (!qstrcmp(argv[i], "--headless") || !qstrcmp(argv[i], "-headless")) {
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+            break;
+        }
+    }
     QApplication a(argc, argv);
 
     QTranslator translator;
@@ -19,6 +36,17 @@ int main(int argc, char *argv[])
         }
     }
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption headlessOption("headless", "Render without a window and write every frame to a file.");
+    QCommandLineOption framesOption("frames", "Number of frames to render headless.", "count", "100");
+    QCommandLineOption sizeOption("size", "Size of the headless frames.", "WxH", "1280x720");
+    QCommandLineOption outputOption("output", "Directory for the headless frames.", "dir", "frames");
+    QCommandLineOption formatOption("format", "raw for RGBA8 pixels, or an image format Qt can write.", "format", "png");
+    QCommandLineOption instancesOption("instances", "Number of instances rendered headless.", "count", "128");
+    parser.addOptions({ headlessOption, framesOption, sizeOption, outputOption, formatOption, instancesOption });
+    parser.process(a);
+
     const bool dbg = qEnvironmentVariableIntValue("QT_VK_DEBUG");
 
     QVulkanInstance inst;
@@ -31,6 +59,39 @@ int main(int argc, char *argv[])
     if (!inst.create())
         qFatal("Failed to create Vulkan instance: %d", inst.errorCode());
 
+    if (parser.isSet(headlessOption)) {
+        const QStringList wh = parser.value(sizeOption).split('x');
+        const QSize size = wh.size() == 2 ? QSize(wh[0].toInt(), wh[1].toInt()) : QSize();
+        const int frames = parser.value(framesOption).toInt();
+        const int instances = parser.value(instancesOption).toInt();
+        if (size.isEmpty() || frames <= 0 || instances <= 0) {
+            qCritical("Invalid --size, --frames or --instances");
+            return 1;
+        }
+
+        FrameEncoder encoder(parser.value(outputOption), parser.value(formatOption).toLatin1(),
+                             qMax(1, QThread::idealThreadCount() / 2), ENCODER_QUEUE_SIZE);
+        if (!encoder.errorString().isEmpty()) {
+            qCritical("%s, supported: %s", qPrintable(encoder.errorString()),
+                      FrameEncoder::supportedFormats().join(", ").constData());
+            return 1;
+        }
+
+        OffscreenTarget target(&inst, size, dbg);
+        QElapsedTimer timer;
+        QObject::connect(&target, &OffscreenTarget::finished, &a, [&] {
+            encoder.finish();
+            const qint64 ms = qMax<qint64>(1, timer.elapsed());
+            qDebug("Wrote %d frames to %s in %lld ms (%.1f fps)", encoder.writtenCount(),
+                   qPrintable(parser.value(outputOption)), ms, encoder.writtenCount() * 1000.0 / ms);
+            a.exit(encoder.failedCount() ? 1 : 0);
+        });
+        timer.start();
+        if (!target.start(instances, frames, &encoder))
+            return 1;
+        return a.exec();
+    }
+
     Vkview *vkwindow = new Vkview(dbg);
     vkwindow->setVulkanInstance(&inst);
 
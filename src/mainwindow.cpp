@@ -2,6 +2,9 @@
 #include "vkview.h"
 #include "./ui_mainwindow.h"
 #include "glview.h"
+#include <QTimer>
+
+static const int PROFILE_UPDATE_MS = 500;
 
 MainWindow::MainWindow(Vkview *vkview, QWidget *parent):
     QMainWindow(parent),
@@ -19,6 +22,14 @@ MainWindow::MainWindow(Vkview *vkview, QWidget *parent):
     // vulkan
     layout->addWidget(wrapper);
 
+    // GPU timings, the renderer reads them back a few frames late anyway
+    ui->plainTextEdit->setReadOnly(true);
+    QTimer *profileTimer = new QTimer(this);
+    connect(profileTimer, &QTimer::timeout, this, [this, vkview] {
+        ui->plainTextEdit->setPlainText(vkview->profileSummary());
+    });
+    profileTimer->start(PROFILE_UPDATE_MS);
+
     // opengl
     // GLView *glview = new GLView();
     // layout->addWidget(glview);
@@ -0,0 +1,15 @@
+#version 440
+
+// Source of the precompiled color_frag.spv, recompiled when edited with
+// KEYFRAME_SHADER_HOT_RELOAD=1.
+
+layout(push_constant) uniform PC {
+    layout(offset = 64) vec3 color;
+} pc;
+
+layout(location = 0) out vec4 fragColor;
+
+void main()
+{
+    fragColor = vec4(pc.color, 1.0);
+}
@@ -0,0 +1,17 @@
+#version 440
+
+// Source of the precompiled color_vert.spv, recompiled when edited with
+// KEYFRAME_SHADER_HOT_RELOAD=1.
+
+layout(location = 0) in vec4 position;
+
+out gl_PerVertex { vec4 gl_Position; };
+
+layout(push_constant) uniform PC {
+    mat4 mvp;
+} pc;
+
+void main()
+{
+    gl_Position = pc.mvp * position;
+}
@@ -0,0 +1,49 @@
+#version 440
+
+// Compiled at build time into color_phong_vert.spv, recompiled when edited
+// with KEYFRAME_SHADER_HOT_RELOAD=1.
+
+layout(location = 0) in vec4 position;
+layout(location = 1) in vec3 normal;
+
+// Instanced attribute to variate the diffuse color.
+layout(location = 2) in vec3 instDiffuseAdjust;
+
+out gl_PerVertex { vec4 gl_Position; };
+
+layout(location = 0) out vec3 vECVertNormal;
+layout(location = 1) out vec3 vECVertPos;
+layout(location = 2) flat out vec3 vDiffuseAdjust;
+
+layout(std140, binding = 0) uniform buf {
+    mat4 vp;
+    mat4 model;
+    mat3 modelNormal;
+} ubuf;
+
+// Placement of every instance, applied after the model matrix: a uniform
+// scale, then the rotation, then the translation.
+struct Transform {
+    vec4 rotation;  // unit quaternion, xyz and w
+    vec3 translate;
+    float scale;
+};
+
+layout(std430, binding = 2) readonly buffer Transforms {
+    Transform transforms[];
+};
+
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main()
+{
+    Transform t = transforms[gl_InstanceIndex];
+    vECVertNormal = normalize(rotate(t.rotation, ubuf.modelNormal * normal));
+    vec3 worldPos = rotate(t.rotation, (ubuf.model * position).xyz * t.scale) + t.translate;
+    vECVertPos = worldPos;
+    vDiffuseAdjust = instDiffuseAdjust;
+    gl_Position = ubuf.vp * vec4(worldPos, 1.0);
+}
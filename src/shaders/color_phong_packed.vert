@@ -0,0 +1,59 @@
+#version 440
+
+// color_phong.vert for the packed vertex format. The position arrives as
+// UNORM relative to the mesh bounds, the dequantization is folded into the
+// model matrix. The normal is octahedral encoded.
+
+layout(location = 0) in vec4 position;
+layout(location = 1) in vec2 octNormal;
+
+// Instanced attribute to variate the diffuse color.
+layout(location = 2) in vec3 instDiffuseAdjust;
+
+out gl_PerVertex { vec4 gl_Position; };
+
+layout(location = 0) out vec3 vECVertNormal;
+layout(location = 1) out vec3 vECVertPos;
+layout(location = 2) flat out vec3 vDiffuseAdjust;
+
+layout(std140, binding = 0) uniform buf {
+    mat4 vp;
+    mat4 model;
+    mat3 modelNormal;
+} ubuf;
+
+// Placement of every instance, applied after the model matrix: a uniform
+// scale, then the rotation, then the translation.
+struct Transform {
+    vec4 rotation;  // unit quaternion, xyz and w
+    vec3 translate;
+    float scale;
+};
+
+layout(std430, binding = 2) readonly buffer Transforms {
+    Transform transforms[];
+};
+
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+vec3 decodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+void main()
+{
+    Transform t = transforms[gl_InstanceIndex];
+    vECVertNormal = normalize(rotate(t.rotation, ubuf.modelNormal * decodeOctahedral(octNormal)));
+    vec3 worldPos = rotate(t.rotation, (ubuf.model * position).xyz * t.scale) + t.translate;
+    vECVertPos = worldPos;
+    vDiffuseAdjust = instDiffuseAdjust;
+    gl_Position = ubuf.vp * vec4(worldPos, 1.0);
+}
@@ -1,7 +1,8 @@
 #version 410 core
 
 layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec3 aIntensity;
+layout (location = 1) in float aIntensity;
+layout (location = 2) in vec4 aColor;
 
 uniform mat4 model;
 uniform mat4 view;
@@ -11,5 +12,5 @@ out vec3 ourColor;
 void main()
 {
     gl_Position = projection * view * model * vec4(aPos, 1.0);
-    ourColor = vec3(0.5f, 1.0f, 1.0f);
+    ourColor = aColor.rgb;
 }
@@ -0,0 +1,23 @@
+#include "../components/mesh.h"
+#include <QCoreApplication>
+#include <QStringList>
+
+// Converts a .buf mesh to the indexed format 2, so that the welding and
+// reordering does not have to happen at load time:
+//   bufindex scanned.buf scanned_indexed.buf
+// The meshes in resource/meshes are converted already.
+int main(int argc, char *argv[]){
+    QCoreApplication app(argc, argv);
+    const QStringList args = app.arguments();
+    if(args.size() != 3){
+        qWarning("Usage: %s <input.buf> <output.buf>", qPrintable(args.first()));
+        return 1;
+    }
+
+    Mesh::setVerbose(true);
+    Mesh mesh;
+    mesh.load(args[1]);
+    if(!mesh.isValid())
+        return 1;
+    return Mesh::save(args[2], *mesh.data()) ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+#include "../components/offscreentarget.h"
+#include "../components/renderer.h"
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtMath>
+#include <algorithm>
+
+// Renders a fixed script headless and reports the frame times per instance
+// count, as a baseline to diff between commits:
+//   KeyFrameBench --format json --output baseline.json
+// Every step doubles the instance count from 128 to 16384 through addNew(),
+// the camera follows the same path in every run and the instances are placed
+// from a fixed seed, so two runs only differ in what the code does. It runs
+// on the offscreen platform, so it needs no display, lavapipe will do.
+
+static const int FIRST_INSTANCE_COUNT = 128;
+static const int LAST_INSTANCE_COUNT = 16384;
+static const int INSTANCES_PER_ADD = 16; // Renderer::addNew()
+static const int CAMERA_PERIOD = 240; // frames of one sway of the camera path
+
+struct Step{
+    int instanceCount;
+    QVector<qint64> record;
+    QVector<qint64> submit;
+    QVector<qint64> gpu;
+    int draws=0;//of the last frame, see Renderer::drawCount()
+    int binds=0;
+};
+
+// nearest rank, in ms
+static double percentile(QVector<qint64> ns, double fraction){
+    if(ns.isEmpty())
+        return -1;
+    std::sort(ns.begin(), ns.end());
+    const int rank = qBound(0, int(qCeil(fraction * ns.size())) - 1, int(ns.size()) - 1);
+    return ns[rank] / 1000000.0;
+}
+
+static QJsonObject percentiles(const QVector<qint64> &ns){
+    QJsonObject o;
+    o["p50"] = percentile(ns, 0.50);
+    o["p95"] = percentile(ns, 0.95);
+    o["p99"] = percentile(ns, 0.99);
+    return o;
+}
+
+static QByteArray toJson(const QVector<Step> &steps, const QString &device, const QSize &size,
+                         int framesPerStep, int warmupFrames){
+    QJsonArray stepArray;
+    for(const Step &step : steps){
+        QJsonObject o;
+        o["instances"] = step.instanceCount;
+        o["frames"] = int(step.record.size());
+        o["draws"] = step.draws;
+        o["binds"] = step.binds;
+        o["recordMs"] = percentiles(step.record);
+        o["submitMs"] = percentiles(step.submit);
+        o["gpuMs"] = percentiles(step.gpu);
+        stepArray.append(o);
+    }
+    QJsonObject root;
+    root["device"] = device;
+    root["width"] = size.width();
+    root["height"] = size.height();
+    root["framesPerStep"] = framesPerStep;
+    root["warmupFrames"] = warmupFrames;
+    root["steps"] = stepArray;
+    return QJsonDocument(root).toJson();
+}
+
+static QByteArray toCsv(const QVector<Step> &steps){
+    QByteArray csv = "instances,frames,draws,binds";
+    for(const char *metric : {"record", "submit", "gpu"})
+        csv += QByteArray(",") + metric + "_p50_ms," + metric + "_p95_ms," + metric + "_p99_ms";
+    csv += '\n';
+    for(const Step &step : steps){
+        csv += QByteArray::number(step.instanceCount) + ',' + QByteArray::number(step.record.size())
+            + ',' + QByteArray::number(step.draws) + ',' + QByteArray::number(step.binds);
+        for(const QVector<qint64> *ns : {&step.record, &step.submit, &step.gpu}){
+            for(double fraction : {0.50, 0.95, 0.99})
+                csv += ',' + QByteArray::number(percentile(*ns, fraction), 'f', 4);
+        }
+        csv += '\n';
+    }
+    return csv;
+}
+
+int main(int argc, char *argv[]){
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption formatOption("format", "json or csv.", "format", "json");
+    QCommandLineOption outputOption("output", "File to write the results to, stdout if not given.", "file");
+    QCommandLineOption framesOption("frames", "Measured frames per instance count.", "count", "300");
+    QCommandLineOption warmupOption("warmup", "Frames rendered before measuring at each instance count.", "count", "30");
+    QCommandLineOption sizeOption("size", "Frame size.", "WxH", "1280x720");
+    QCommandLineOption seedOption("seed", "Seed for the instance placement.", "seed", "1");
+    parser.addOptions({ formatOption, outputOption, framesOption, warmupOption, sizeOption, seedOption });
+    parser.process(app);
+
+    const QString format = parser.value(formatOption);
+    const QStringList wh = parser.value(sizeOption).split('x');
+    const QSize size = wh.size() == 2 ? QSize(wh[0].toInt(), wh[1].toInt()) : QSize();
+    const int measured = parser.value(framesOption).toInt();
+    const int warmup = qMax(0, parser.value(warmupOption).toInt());
+    if((format != "json" && format != "csv") || size.isEmpty() || measured <= 0){
+        qCritical("Invalid --format, --size or --frames");
+        return 1;
+    }
+
+    QVulkanInstance inst;
+    const bool dbg = qEnvironmentVariableIntValue("QT_VK_DEBUG");
+    if(dbg)
+        inst.setLayers({ "VK_LAYER_KHRONOS_validation" });
+    if(!inst.create())
+        qFatal("Failed to create Vulkan instance: %d", inst.errorCode());
+
+    QVector<Step> steps;
+    for(int count = FIRST_INSTANCE_COUNT; count <= LAST_INSTANCE_COUNT; count *= 2)
+        steps.append({ count, {}, {}, {} });
+    const int framesPerStep = warmup + measured;
+
+    OffscreenTarget target(&inst, size, dbg);
+    int instanceCount = FIRST_INSTANCE_COUNT;
+    target.setFrameStartCallback([&](int frame){
+        Renderer *renderer = target.frameRenderer();
+        if(frame == 0)
+            renderer->setRandomSeed(parser.value(seedOption).toUInt());
+        const Step &step = steps[frame / framesPerStep];
+        for(; instanceCount < step.instanceCount; instanceCount += INSTANCES_PER_ADD)
+            renderer->addNew();
+        const float phase = 2.0f * float(M_PI) * (frame % CAMERA_PERIOD) / CAMERA_PERIOD;
+        renderer->yaw(0.25f);
+        renderer->pitch(0.1f * qSin(phase));
+        renderer->walk(0.02f * qCos(phase));
+    });
+    target.setFrameTimesCallback([&](const OffscreenTarget::FrameTimes &times){
+        if(times.frameIndex % framesPerStep < warmup)
+            return;
+        Step &step = steps[times.frameIndex / framesPerStep];
+        step.record.append(times.recordNs);
+        step.submit.append(times.submitNs);
+        if(times.gpuNs >= 0)
+            step.gpu.append(times.gpuNs);
+        step.draws = target.frameRenderer()->drawCount();
+        step.binds = target.frameRenderer()->bindCount();
+    });
+    QObject::connect(&target, &OffscreenTarget::finished, &app, [&]{
+        const QByteArray result = format == "csv"
+            ? toCsv(steps)
+            : toJson(steps, QString::fromUtf8(target.physicalDeviceProperties()->deviceName), size, measured, warmup);
+        QFile out;
+        if(parser.isSet(outputOption)){
+            out.setFileName(parser.value(outputOption));
+            if(!out.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+                qWarning("Failed to open %s", qPrintable(out.fileName()));
+                app.exit(1);
+                return;
+            }
+        } else{
+            out.open(stdout, QIODevice::WriteOnly);
+        }
+        out.write(result);
+        app.exit(0);
+    });
+
+    if(!target.start(FIRST_INSTANCE_COUNT, int(steps.size()) * framesPerStep, nullptr))
+        return 1;
+    return app.exec();
+}